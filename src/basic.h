@@ -15,8 +15,12 @@
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #endif
 
 #define unused(x) ((void)(x))
@@ -29,6 +33,33 @@
 #define export __attribute__((visibility("default")))
 #endif
 
+// Allocations made through mem_* go to the current allocator and are
+// counted, so a frame can be checked for allocating at all
+typedef struct
+{
+	void *(*alloc_fn)(void *ctx, size_t size);
+	void *(*realloc_fn)(void *ctx, void *ptr, size_t size);
+	void (*free_fn)(void *ctx, void *ptr);
+	void *ctx;
+} Allocator;
+
+typedef struct
+{
+	// Calls to mem_alloc, mem_calloc and mem_realloc
+	int64_t calls;
+	int64_t bytes;
+	int64_t frees;
+} AllocStats;
+
+// NULL switches back to the C allocator
+void set_allocator(const Allocator *allocator);
+void *mem_alloc(size_t size);
+void *mem_calloc(size_t count, size_t size);
+void *mem_realloc(void *ptr, size_t size);
+void mem_free(void *ptr);
+// Totals since the start, the difference of two is what happened between
+AllocStats alloc_stats(void);
+
 #define ARRAY_INIT_CAP 10
 
 #define ARRAY(T)     \
@@ -44,21 +75,78 @@
     if ((array)->capacity < (array)->length + 1) {                             \
       (array)->capacity =                                                      \
           ((array)->capacity == 0) ? ARRAY_INIT_CAP : (array)->capacity * 2;   \
-      (array)->items = realloc(                                            \
+      (array)->items = mem_realloc(                                        \
           (array)->items, (array)->capacity * sizeof(*(array)->items));        \
           assert((array)->items != NULL);                                      \
     }                                                                          \
     (array)->items[(array)->length++] = (item);                                \
   } while (0)
 
+// Replaces remove items at index at with count items from new_items
+#define array_splice(array, at, remove, new_items, count)                      \
+  do {                                                                         \
+    size_t new_length_ = (array)->length - (remove) + (count);                 \
+    if ((array)->capacity < new_length_) {                                     \
+      (array)->capacity = ((array)->capacity * 2 > new_length_)                \
+          ? (array)->capacity * 2 : new_length_;                               \
+      (array)->items = mem_realloc(                                            \
+          (array)->items, (array)->capacity * sizeof(*(array)->items));        \
+          assert((array)->items != NULL);                                      \
+    }                                                                          \
+    if ((array)->items != NULL)                                                \
+      memmove((array)->items + (at) + (count),                                 \
+          (array)->items + (at) + (remove),                                    \
+          ((array)->length - (at) - (remove)) * sizeof(*(array)->items));      \
+    if ((count) > 0)                                                           \
+      memcpy((array)->items + (at), (new_items),                               \
+          (count) * sizeof(*(array)->items));                                  \
+    (array)->length = new_length_;                                             \
+  } while (0)
+
+// Grows the capacity to at least count items, the length stays the same
+#define array_reserve(array, count)                                            \
+  do {                                                                         \
+    if ((array)->capacity < (count)) {                                         \
+      (array)->capacity = (count);                                             \
+      (array)->items = mem_realloc(                                            \
+          (array)->items, (array)->capacity * sizeof(*(array)->items));        \
+          assert((array)->items != NULL);                                      \
+    }                                                                          \
+  } while (0)
+
 #define array_free(array)                                                      \
   do {                                                                         \
-    free((array)->items);                                                      \
+    mem_free((array)->items);                                                  \
     (array)->items = NULL;                                                     \
     (array)->length = 0;                                                       \
     (array)->capacity = 0;                                                     \
   } while (0)
 
+#define ARENA_INIT_CAP (1024 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t length;
+	size_t capacity;
+	uint8_t *items;
+} ArenaBlock;
+
+// Bump allocator, everything allocated from it is released at once by
+// arena_reset. After a reset the memory is kept in a single block so
+// a workload that repeats every frame stops hitting the system allocator.
+typedef struct
+{
+	ArenaBlock *blocks;
+	size_t length;
+	size_t capacity;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
 #ifdef __GNUC__
 #define PACK( __Declaration__ ) __Declaration__ __attribute__((__packed__))
 #endif
@@ -125,6 +213,12 @@ StringView sv_chop_delim(StringView *sv, char delim);
 
 StringView sv_chop_str(StringView *sv, char *str);
 
+#define UTF8_REPLACEMENT 0xFFFD
+
+// Decodes the codepoint at *text and moves past it, malformed sequences
+// read as UTF8_REPLACEMENT one byte at a time. Never reads past a NUL.
+uint32_t utf8_next(const char **text);
+
 #ifdef _WIN32
 typedef HANDLE Process;
 #define INVALID_PROCESS INVALID_HANDLE_VALUE
@@ -142,11 +236,28 @@ Process cmd_run_async(Cmd *cmd);
 bool cmd_run_sync(Cmd *cmd);
 
 bool file_rename(char* old_path, char* new_path);
+// Both return -1 when the file does not exist
+int64_t get_file_mod_time(const char *file_path);
+int64_t get_file_size(const char *file_path);
 bool file_needs_rebuild(char* binary_path, char** src_files, size_t src_files_len);
 
+// Read only view of a whole file, data is NULL for an empty file
+typedef struct
+{
+	const uint8_t *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} FileMapping;
+
+bool file_map(FileMapping *map, const char *path);
+void file_unmap(FileMapping *map);
+
 #ifdef _WIN32
 typedef HANDLE Thread;
-#define INVALID_PROCESS NULL
+#define INVALID_THREAD NULL
 #else
 typedef pthread_t Thread;
 #define INVALID_THREAD 0
@@ -155,12 +266,256 @@ typedef pthread_t Thread;
 Thread thread_create(void (*func)(void*), void* arg);
 void thread_join(Thread proc);
 
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE CondVar;
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t CondVar;
+#endif
+
+void mutex_init(Mutex *mutex);
+void mutex_lock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+void mutex_destroy(Mutex *mutex);
+
+void condvar_init(CondVar *cv);
+void condvar_wait(CondVar *cv, Mutex *mutex);
+void condvar_signal(CondVar *cv);
+void condvar_broadcast(CondVar *cv);
+void condvar_destroy(CondVar *cv);
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// Both return the new value
+int64_t atomic_add(volatile int64_t *value, int64_t amount);
+int64_t atomic_get(volatile int64_t *value);
+
+int cpu_count(void);
+void thread_yield(void);
+// Monotonic clock for measuring durations
+uint64_t time_ns(void);
+
+#define THREAD_POOL_MAX_THREADS 64
+#define THREAD_POOL_DEQUE_SIZE 1024
+
+// Tasks of a group are waited on together, zero initialized is empty
+typedef struct
+{
+	volatile int64_t pending;
+} WaitGroup;
+
+typedef struct
+{
+	void (*fn)(void *arg);
+	// Set instead of fn for parallel_for, the range is split in halves
+	// until it is no larger than grain
+	void (*range_fn)(void *ctx, size_t begin, size_t end);
+	void *arg;
+	size_t begin;
+	size_t end;
+	size_t grain;
+	WaitGroup *group;
+} ThreadPoolTask;
+
+// Every thread owns a deque, tasks are pushed and popped at the bottom by
+// the owner and stolen from the top by the others. Threads outside the
+// pool share the deque at index 0.
+typedef struct
+{
+	Mutex mutex;
+	ThreadPoolTask tasks[THREAD_POOL_DEQUE_SIZE];
+	size_t top;
+	size_t bottom;
+} ThreadPoolDeque;
+
+typedef struct
+{
+	bool running;
+	bool quit;
+	int thread_count;
+	Thread threads[THREAD_POOL_MAX_THREADS];
+	ThreadPoolDeque deques[THREAD_POOL_MAX_THREADS];
+	// Tasks sitting in deques, idle workers sleep while it is zero
+	volatile int64_t queued;
+	Mutex sleep_mutex;
+	CondVar wake;
+	// Broadcast whenever the last task of a group finishes
+	CondVar done;
+} ThreadPool;
+
+// Zero threads means one per core, the calling thread counts as one.
+// Submitting starts the pool when it is not running yet.
+void thread_pool_start(int thread_count);
+// Joins the workers, no task may be pending
+void thread_pool_stop(void);
+// Threads of the pool are 1 to count - 1, every other thread is 0
+int thread_pool_thread_index(void);
+int thread_pool_thread_count(void);
+
+void thread_pool_submit(WaitGroup *group, void (*fn)(void *arg), void *arg);
+// Runs queued tasks on the calling thread until the group is done, then
+// sleeps until the tasks other threads are still running finish
+void wait_group_wait(WaitGroup *group);
+void parallel_for(size_t begin, size_t end, size_t grain, void (*fn)(void *ctx, size_t begin, size_t end), void *ctx);
+
 #ifdef BASIC_IMPLEMENTATION
 
+static void *libc_alloc(void *ctx, size_t size)
+{
+	unused(ctx);
+	return malloc(size);
+}
+
+static void *libc_realloc(void *ctx, void *ptr, size_t size)
+{
+	unused(ctx);
+	return realloc(ptr, size);
+}
+
+static void libc_free(void *ctx, void *ptr)
+{
+	unused(ctx);
+	free(ptr);
+}
+
+static Allocator allocator = {
+	.alloc_fn = libc_alloc,
+	.realloc_fn = libc_realloc,
+	.free_fn = libc_free,
+};
+static volatile int64_t alloc_calls = 0;
+static volatile int64_t alloc_bytes = 0;
+static volatile int64_t alloc_frees = 0;
+
+// Memory has to be freed by the allocator that returned it, switch
+// before allocating anything
+void set_allocator(const Allocator *new_allocator)
+{
+	if (new_allocator == NULL)
+	{
+		allocator = (Allocator){
+			.alloc_fn = libc_alloc,
+			.realloc_fn = libc_realloc,
+			.free_fn = libc_free,
+		};
+		return;
+	}
+	allocator = *new_allocator;
+}
+
+void *mem_alloc(size_t size)
+{
+	atomic_add(&alloc_calls, 1);
+	atomic_add(&alloc_bytes, size);
+	return allocator.alloc_fn(allocator.ctx, size);
+}
+
+void *mem_calloc(size_t count, size_t size)
+{
+	void *result = mem_alloc(count * size);
+	if (result != NULL) memset(result, 0, count * size);
+	return result;
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+	atomic_add(&alloc_calls, 1);
+	atomic_add(&alloc_bytes, size);
+	return allocator.realloc_fn(allocator.ctx, ptr, size);
+}
+
+void mem_free(void *ptr)
+{
+	if (ptr == NULL) return;
+	atomic_add(&alloc_frees, 1);
+	allocator.free_fn(allocator.ctx, ptr);
+}
+
+AllocStats alloc_stats(void)
+{
+	return (AllocStats){
+		.calls = atomic_get(&alloc_calls),
+		.bytes = atomic_get(&alloc_bytes),
+		.frees = atomic_get(&alloc_frees),
+	};
+}
+
+ArenaBlock *arena_new_block(size_t capacity)
+{
+	ArenaBlock *block = mem_alloc(sizeof(ArenaBlock));
+	assert(block != NULL);
+	block->next = NULL;
+	block->length = 0;
+	block->capacity = capacity;
+	block->items = mem_alloc(capacity);
+	assert(block->items != NULL);
+	return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+	ArenaBlock *block = arena->blocks;
+	if (block == NULL || block->capacity < block->length + size)
+	{
+		size_t capacity = (arena->capacity == 0) ? ARENA_INIT_CAP : arena->capacity;
+		while (capacity < size)
+			capacity *= 2;
+
+		block = arena_new_block(capacity);
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->capacity += capacity;
+	}
+
+	void *result = block->items + block->length;
+	block->length += size;
+	arena->length += size;
+	return result;
+}
+
+void arena_reset(Arena *arena)
+{
+	// Coalescing the blocks so the next cycle fits in one block
+	if (arena->blocks != NULL && arena->blocks->next != NULL)
+	{
+		size_t capacity = arena->capacity;
+		arena_free(arena);
+		arena->blocks = arena_new_block(capacity);
+		arena->capacity = capacity;
+	}
+
+	if (arena->blocks != NULL)
+		arena->blocks->length = 0;
+	arena->length = 0;
+}
+
+void arena_free(Arena *arena)
+{
+	ArenaBlock *block = arena->blocks;
+	while (block != NULL)
+	{
+		ArenaBlock *next = block->next;
+		mem_free(block->items);
+		mem_free(block);
+		block = next;
+	}
+
+	arena->blocks = NULL;
+	arena->length = 0;
+	arena->capacity = 0;
+}
+
 void sb_resize(StringBuilder *sb, size_t new_capacity)
 {
 	sb->capacity = new_capacity;
-	sb->items = realloc(sb->items, sb->capacity + 1);
+	sb->items = mem_realloc(sb->items, sb->capacity + 1);
 	assert(sb->items != NULL);
 }
 
@@ -353,6 +708,63 @@ StringView sv_chop_str(StringView *sv, char *str)
 	return result;
 }
 
+uint32_t utf8_next(const char **text)
+{
+	const uint8_t *bytes = (const uint8_t *)*text;
+	uint32_t codepoint = bytes[0];
+	int length;
+	uint32_t min;
+
+	if (codepoint < 0x80)
+	{
+		*text += 1;
+		return codepoint;
+	}
+	else if ((codepoint & 0xE0) == 0xC0)
+	{
+		length = 2;
+		codepoint &= 0x1F;
+		min = 0x80;
+	}
+	else if ((codepoint & 0xF0) == 0xE0)
+	{
+		length = 3;
+		codepoint &= 0x0F;
+		min = 0x800;
+	}
+	else if ((codepoint & 0xF8) == 0xF0)
+	{
+		length = 4;
+		codepoint &= 0x07;
+		min = 0x10000;
+	}
+	else
+	{
+		*text += 1;
+		return UTF8_REPLACEMENT;
+	}
+
+	for (int i = 1; i < length; ++i)
+	{
+		if ((bytes[i] & 0xC0) != 0x80)
+		{
+			*text += 1;
+			return UTF8_REPLACEMENT;
+		}
+		codepoint = (codepoint << 6) | (bytes[i] & 0x3F);
+	}
+
+	// Overlong forms and surrogates are not valid
+	if (codepoint < min || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF))
+	{
+		*text += 1;
+		return UTF8_REPLACEMENT;
+	}
+
+	*text += length;
+	return codepoint;
+}
+
 bool proc_wait(Process proc)
 {
 #ifdef _WIN32
@@ -435,6 +847,8 @@ Process cmd_run_async(Cmd *cmd)
 	Process proc = fork();
 	if (proc == 0)
 	{
+		// execvp needs the arguments terminated by NULL
+		array_append(cmd, NULL);
 		if (execvp(cmd->items[0], cmd->items) < 0)
 		{
 			fprintf(stderr, "ERROR: Failed to run command: %s\n", cmd->items[0]);
@@ -504,6 +918,26 @@ int64_t get_file_mod_time(const char *file_path)
 #endif
 }
 
+int64_t get_file_size(const char *file_path)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(file_path, GetFileExInfoStandard, &data))
+		return -1;
+
+	ULARGE_INTEGER uli;
+	uli.LowPart = data.nFileSizeLow;
+	uli.HighPart = data.nFileSizeHigh;
+	return (int64_t)uli.QuadPart;
+#else
+	struct stat st;
+	if (stat(file_path, &st) < 0)
+		return -1;
+
+	return st.st_size;
+#endif
+}
+
 bool file_needs_rebuild(char* binary_path, char** src_files, size_t src_files_len)
 {
 	int out_time = get_file_mod_time(binary_path);
@@ -523,6 +957,85 @@ bool file_needs_rebuild(char* binary_path, char** src_files, size_t src_files_le
 	return false;
 }
 
+bool file_map(FileMapping *map, const char *path)
+{
+	*map = (FileMapping){0};
+#ifdef _WIN32
+	map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(map->file, &size))
+	{
+		CloseHandle(map->file);
+		return false;
+	}
+
+	map->size = (size_t)size.QuadPart;
+	if (map->size == 0)
+		return true;
+
+	map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (map->mapping == NULL)
+	{
+		CloseHandle(map->file);
+		return false;
+	}
+
+	map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (map->data == NULL)
+	{
+		CloseHandle(map->mapping);
+		CloseHandle(map->file);
+		return false;
+	}
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	map->size = st.st_size;
+	if (map->size > 0)
+	{
+		void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			return false;
+		}
+		map->data = data;
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+#endif
+	return true;
+}
+
+void file_unmap(FileMapping *map)
+{
+#ifdef _WIN32
+	if (map->data != NULL)
+		UnmapViewOfFile(map->data);
+	if (map->mapping != NULL)
+		CloseHandle(map->mapping);
+	if (map->file != NULL && map->file != INVALID_HANDLE_VALUE)
+		CloseHandle(map->file);
+#else
+	if (map->data != NULL)
+		munmap((void *)map->data, map->size);
+#endif
+	*map = (FileMapping){0};
+}
+
 Thread thread_create(void (*func)(void*), void* arg)
 {
 #ifdef _WIN32
@@ -531,7 +1044,7 @@ Thread thread_create(void (*func)(void*), void* arg)
 	if (thread == NULL)
 	{
 		fprintf(stderr, "ERROR: Failed to create thread\n");
-		return INVALID_PROCESS;
+		return INVALID_THREAD;
 	}
 	return thread;
 #else
@@ -555,4 +1068,359 @@ void thread_join(Thread thread)
 #endif
 }
 
+void mutex_init(Mutex *mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_lock(Mutex *mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(Mutex *mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void mutex_destroy(Mutex *mutex)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+void condvar_init(CondVar *cv)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(cv);
+#else
+	pthread_cond_init(cv, NULL);
+#endif
+}
+
+void condvar_wait(CondVar *cv, Mutex *mutex)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS(cv, mutex, INFINITE);
+#else
+	pthread_cond_wait(cv, mutex);
+#endif
+}
+
+void condvar_signal(CondVar *cv)
+{
+#ifdef _WIN32
+	WakeConditionVariable(cv);
+#else
+	pthread_cond_signal(cv);
+#endif
+}
+
+void condvar_broadcast(CondVar *cv)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(cv);
+#else
+	pthread_cond_broadcast(cv);
+#endif
+}
+
+void condvar_destroy(CondVar *cv)
+{
+#ifdef _WIN32
+	// Condition variables hold no resources on Windows
+	unused(cv);
+#else
+	pthread_cond_destroy(cv);
+#endif
+}
+
+int64_t atomic_add(volatile int64_t *value, int64_t amount)
+{
+#ifdef _WIN32
+	return InterlockedExchangeAdd64((volatile LONG64 *)value, amount) + amount;
+#else
+	return __atomic_add_fetch(value, amount, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int64_t atomic_get(volatile int64_t *value)
+{
+#ifdef _WIN32
+	return InterlockedCompareExchange64((volatile LONG64 *)value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? count : 1;
+#endif
+}
+
+void thread_yield(void)
+{
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+uint64_t time_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ull +
+	       (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static ThreadPool thread_pool = {0};
+static THREAD_LOCAL int thread_pool_index = 0;
+
+int thread_pool_thread_index(void)
+{
+	return thread_pool_index;
+}
+
+int thread_pool_thread_count(void)
+{
+	return thread_pool.running ? thread_pool.thread_count : 1;
+}
+
+static bool thread_pool_push(ThreadPoolTask task)
+{
+	ThreadPoolDeque *deque = &thread_pool.deques[thread_pool_index];
+
+	mutex_lock(&deque->mutex);
+	bool full = deque->bottom - deque->top == THREAD_POOL_DEQUE_SIZE;
+	if (!full)
+	{
+		deque->tasks[deque->bottom % THREAD_POOL_DEQUE_SIZE] = task;
+		deque->bottom++;
+	}
+	mutex_unlock(&deque->mutex);
+	if (full) return false;
+
+	// Taken under the sleep mutex so a worker about to sleep sees it
+	atomic_add(&thread_pool.queued, 1);
+	mutex_lock(&thread_pool.sleep_mutex);
+	condvar_signal(&thread_pool.wake);
+	mutex_unlock(&thread_pool.sleep_mutex);
+	return true;
+}
+
+// Newest task of the own deque first, oldest of any other one otherwise
+static bool thread_pool_take(ThreadPoolTask *task)
+{
+	const int count = thread_pool.thread_count;
+	for (int i = 0; i < count; ++i)
+	{
+		const int index = (thread_pool_index + i) % count;
+		ThreadPoolDeque *deque = &thread_pool.deques[index];
+
+		mutex_lock(&deque->mutex);
+		bool found = deque->bottom != deque->top;
+		if (found && i == 0)
+			*task = deque->tasks[--deque->bottom % THREAD_POOL_DEQUE_SIZE];
+		else if (found)
+			*task = deque->tasks[deque->top++ % THREAD_POOL_DEQUE_SIZE];
+		mutex_unlock(&deque->mutex);
+
+		if (found)
+		{
+			atomic_add(&thread_pool.queued, -1);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void thread_pool_run(ThreadPoolTask task)
+{
+	if (task.range_fn != NULL)
+	{
+		// The upper half goes back to the deque for others to steal
+		while (task.end - task.begin > task.grain)
+		{
+			size_t half = (task.end - task.begin) / 2;
+			ThreadPoolTask upper = task;
+			upper.begin = task.begin + half;
+
+			atomic_add(&task.group->pending, 1);
+			if (!thread_pool_push(upper))
+			{
+				atomic_add(&task.group->pending, -1);
+				break;
+			}
+			task.end = upper.begin;
+		}
+		task.range_fn(task.arg, task.begin, task.end);
+	}
+	else
+	{
+		task.fn(task.arg);
+	}
+
+	// The group may be gone once it reaches zero, only the pool is touched
+	if (atomic_add(&task.group->pending, -1) == 0)
+	{
+		mutex_lock(&thread_pool.sleep_mutex);
+		condvar_broadcast(&thread_pool.done);
+		mutex_unlock(&thread_pool.sleep_mutex);
+	}
+}
+
+static void thread_pool_worker(void *arg)
+{
+	thread_pool_index = (int)(intptr_t)arg;
+
+	while (true)
+	{
+		ThreadPoolTask task;
+		if (thread_pool_take(&task))
+		{
+			thread_pool_run(task);
+			continue;
+		}
+
+		mutex_lock(&thread_pool.sleep_mutex);
+		while (!thread_pool.quit && atomic_get(&thread_pool.queued) == 0)
+			condvar_wait(&thread_pool.wake, &thread_pool.sleep_mutex);
+		bool quit = thread_pool.quit;
+		mutex_unlock(&thread_pool.sleep_mutex);
+
+		if (quit) break;
+	}
+}
+
+void thread_pool_start(int thread_count)
+{
+	if (thread_pool.running) return;
+
+	if (thread_count <= 0) thread_count = cpu_count();
+	if (thread_count > THREAD_POOL_MAX_THREADS) thread_count = THREAD_POOL_MAX_THREADS;
+
+	thread_pool.quit = false;
+	thread_pool.queued = 0;
+	thread_pool.thread_count = thread_count;
+	mutex_init(&thread_pool.sleep_mutex);
+	condvar_init(&thread_pool.wake);
+	condvar_init(&thread_pool.done);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		mutex_init(&thread_pool.deques[i].mutex);
+		thread_pool.deques[i].top = 0;
+		thread_pool.deques[i].bottom = 0;
+	}
+	thread_pool.running = true;
+
+	for (int i = 1; i < thread_count; ++i)
+	{
+		thread_pool.threads[i] = thread_create(thread_pool_worker, (void *)(intptr_t)i);
+	}
+}
+
+void thread_pool_stop(void)
+{
+	if (!thread_pool.running) return;
+
+	mutex_lock(&thread_pool.sleep_mutex);
+	thread_pool.quit = true;
+	condvar_broadcast(&thread_pool.wake);
+	mutex_unlock(&thread_pool.sleep_mutex);
+
+	for (int i = 1; i < thread_pool.thread_count; ++i)
+	{
+		if (thread_pool.threads[i] != INVALID_THREAD)
+			thread_join(thread_pool.threads[i]);
+	}
+	for (int i = 0; i < thread_pool.thread_count; ++i)
+	{
+		mutex_destroy(&thread_pool.deques[i].mutex);
+	}
+	condvar_destroy(&thread_pool.wake);
+	condvar_destroy(&thread_pool.done);
+	mutex_destroy(&thread_pool.sleep_mutex);
+	thread_pool.running = false;
+}
+
+static void thread_pool_submit_task(ThreadPoolTask task)
+{
+	if (!thread_pool.running)
+		thread_pool_start(0);
+
+	atomic_add(&task.group->pending, 1);
+
+	// A full deque runs the task right away
+	if (!thread_pool_push(task))
+		thread_pool_run(task);
+}
+
+void thread_pool_submit(WaitGroup *group, void (*fn)(void *arg), void *arg)
+{
+	assert(group != NULL);
+	thread_pool_submit_task((ThreadPoolTask){.fn = fn, .arg = arg, .group = group});
+}
+
+void wait_group_wait(WaitGroup *group)
+{
+	ThreadPoolTask task;
+	while (atomic_get(&group->pending) > 0 && thread_pool_take(&task))
+	{
+		thread_pool_run(task);
+	}
+
+	// The pool may never have started for an empty group
+	if (atomic_get(&group->pending) == 0) return;
+
+	// Nothing is queued, so the rest of the group is running elsewhere.
+	// Its last task decrements pending before taking the mutex.
+	mutex_lock(&thread_pool.sleep_mutex);
+	while (atomic_get(&group->pending) > 0)
+		condvar_wait(&thread_pool.done, &thread_pool.sleep_mutex);
+	mutex_unlock(&thread_pool.sleep_mutex);
+}
+
+void parallel_for(size_t begin, size_t end, size_t grain, void (*fn)(void *ctx, size_t begin, size_t end), void *ctx)
+{
+	if (begin >= end) return;
+	if (grain == 0) grain = 1;
+
+	WaitGroup group = {0};
+	thread_pool_submit_task((ThreadPoolTask){
+		.range_fn = fn, .arg = ctx, .begin = begin, .end = end, .grain = grain, .group = &group
+	});
+	wait_group_wait(&group);
+}
+
 #endif
@@ -0,0 +1,596 @@
+#define BASIC_IMPLEMENTATION
+#include "basic.h"
+#include "drawing.h"
+#include "paragraph.h"
+
+// Times the drawing primitives over a few sizes. Every benchmark is
+// warmed up and then run until enough samples are collected, the median
+// and p99 of single calls are printed and written as tab separated
+// values to the output file so runs can be diffed between commits.
+// Checks of optimized paths against reference versions run first and
+// a failing one fails the run.
+//
+// Usage: bench [-check] [output file], run from the repository root
+//   -check  only runs the checks
+
+#define BENCH_OUTPUT "bench_output.txt"
+#define BENCH_FONT "assets/spleen-16x32.bdf"
+#define BENCH_TEXT "The quick brown fox jumps over the lazy dog"
+// Paragraphs of a few sentences each, edited in the middle
+#define BENCH_NOTE_BYTES (1 << 20)
+#define BENCH_NOTE_SENTENCES 8
+#define BENCH_NOTE_TEXT_SIZE 16
+
+#define BENCH_WARMUP_NS 20000000ull
+#define BENCH_RUN_NS 250000000ull
+#define BENCH_MIN_SAMPLES 20
+#define BENCH_MAX_SAMPLES 5000
+
+#define BENCH_SIZE_COUNT 3
+// Side of the square target, or the text size for text benchmarks
+int image_sizes[BENCH_SIZE_COUNT] = {64, 256, 1024};
+int text_sizes[BENCH_SIZE_COUNT] = {16, 32, 64};
+
+typedef struct
+{
+	Image target;
+	// Same size as the target
+	Image source;
+	// Half the size of the target, drawn scaled up
+	Image small_source;
+	Font font;
+	int size;
+	// Scratch of benchmarks that need it, reset after every call
+	Arena arena;
+	ParagraphLayout note;
+} BenchContext;
+
+typedef struct
+{
+	const char *name;
+	void (*fn)(BenchContext *ctx);
+	bool is_text;
+} Benchmark;
+
+static Vec4 full_rect(BenchContext *ctx)
+{
+	return (Vec4){.x = 0, .y = 0, .w = ctx->size, .h = ctx->size};
+}
+
+static void bench_clear_image(BenchContext *ctx)
+{
+	clear_image(ctx->target, COLOR_WHITE);
+}
+
+static void bench_draw_rect_opaque(BenchContext *ctx)
+{
+	draw_rect(ctx->target, full_rect(ctx), COLOR_BLUE);
+}
+
+static void bench_draw_rect_translucent(BenchContext *ctx)
+{
+	draw_rect(ctx->target, full_rect(ctx), (Color){.rgba = 0x80BB9AB1});
+}
+
+// A group opacity layer, every blend into it lands on transparent pixels
+static void bench_draw_rect_layer(BenchContext *ctx)
+{
+	Image layer = begin_layer(ctx->target, &ctx->arena);
+	draw_rect(layer, full_rect(ctx), (Color){.rgba = 0x80BB9AB1});
+	end_layer(ctx->target, layer, 0.5f);
+	arena_reset(&ctx->arena);
+}
+
+static void bench_draw_rounded_rect(BenchContext *ctx)
+{
+	draw_rounded_rect(ctx->target, full_rect(ctx), (Color){.rgba = 0x80BB9AB1}, ctx->size / 8.0f);
+}
+
+static void bench_draw_image(BenchContext *ctx)
+{
+	draw_image(ctx->target, ctx->source, full_rect(ctx), NULL);
+}
+
+static void bench_draw_image_scaled(BenchContext *ctx)
+{
+	draw_image(ctx->target, ctx->small_source, full_rect(ctx), NULL);
+}
+
+static void bench_blur_image(BenchContext *ctx)
+{
+	blur_image_arena(&ctx->arena, ctx->target, 8);
+	arena_reset(&ctx->arena);
+}
+
+static void bench_scale_image(BenchContext *ctx)
+{
+	Image scaled = scale_image(ctx->small_source, 2.0f, 2.0f);
+	free_image(&scaled);
+}
+
+static void bench_draw_text(BenchContext *ctx)
+{
+	draw_text(ctx->target, ctx->font, BENCH_TEXT, ctx->size, (Vec2){.x = 0, .y = 0}, COLOR_BLACK);
+}
+
+static void bench_measure_text(BenchContext *ctx)
+{
+	measure_text(ctx->font, BENCH_TEXT, ctx->size);
+}
+
+// Typing a character in the middle of the note, deleting it again and
+// drawing what is in view, like a frame of typing
+static void bench_note_edit(BenchContext *ctx)
+{
+	ParagraphLayout *note = &ctx->note;
+	paragraph_layout_set_width(note, ctx->size);
+
+	size_t middle = note->text.length / 2;
+	paragraph_layout_edit(note, middle, 0, "x", 1);
+	paragraph_layout_edit(note, middle, 1, NULL, 0);
+
+	float scroll = paragraph_layout_height(note) / 2;
+	draw_paragraph_layout(ctx->target, note, (Vec2){.x = 0, .y = 0}, scroll, COLOR_BLACK);
+}
+
+Benchmark benchmarks[] = {
+	{"clear_image", bench_clear_image, false},
+	{"draw_rect_opaque", bench_draw_rect_opaque, false},
+	{"draw_rect_translucent", bench_draw_rect_translucent, false},
+	{"draw_rect_layer", bench_draw_rect_layer, false},
+	{"draw_rounded_rect", bench_draw_rounded_rect, false},
+	{"draw_image", bench_draw_image, false},
+	{"draw_image_scaled", bench_draw_image_scaled, false},
+	{"blur_image", bench_blur_image, false},
+	{"scale_image", bench_scale_image, false},
+	{"draw_text", bench_draw_text, true},
+	{"measure_text", bench_measure_text, true},
+	{"note_edit", bench_note_edit, false},
+};
+
+typedef struct
+{
+	const char *name;
+	bool (*fn)(void);
+} Check;
+
+// The float blend layer_color replaced
+static Color layer_color_reference(Color bottom, Color top)
+{
+	float top_alpha = (float) top.a / 255.0f;
+	float bottom_alpha = (float) bottom.a / 255.0f;
+	float out_alpha = top_alpha + bottom_alpha * (1.0f - top_alpha);
+	if (out_alpha == 0)
+	{
+		return (Color) { .r = 0, .g = 0, .b = 0, .a = 0 };
+	}
+
+	float r = ((float) top.r * top_alpha + (float) bottom.r * bottom_alpha * (1.0f - top_alpha)) / out_alpha;
+	float g = ((float) top.g * top_alpha + (float) bottom.g * bottom_alpha * (1.0f - top_alpha)) / out_alpha;
+	float b = ((float) top.b * top_alpha + (float) bottom.b * bottom_alpha * (1.0f - top_alpha)) / out_alpha;
+
+	return (Color)
+	{
+		.r = (uint8_t) r,
+		.g = (uint8_t) g,
+		.b = (uint8_t) b,
+		.a = (uint8_t) (out_alpha * 255.0f)
+	};
+}
+
+// Channels of a fully transparent result do not matter
+static bool blend_matches(Color bottom, Color top, Color blended)
+{
+	Color expected = layer_color_reference(bottom, top);
+	if (abs(blended.a - expected.a) > 1) return false;
+	if (expected.a == 0) return true;
+	return abs(blended.r - expected.r) <= 1 &&
+	       abs(blended.g - expected.g) <= 1 &&
+	       abs(blended.b - expected.b) <= 1;
+}
+
+#define CHECK_BLEND_STEP 15
+
+// Every pair of alphas with a sweep of channel values, through the
+// single pixel blend and both span kernels
+static bool check_blend(void)
+{
+	const int values = 255 / CHECK_BLEND_STEP + 1;
+	const size_t n = 256 * values;
+	Color *bottoms = malloc(n * sizeof(Color));
+	Color *tops = malloc(n * sizeof(Color));
+	Color *spans = malloc(n * sizeof(Color));
+	Color *color_spans = malloc(n * sizeof(Color));
+	assert(bottoms != NULL && tops != NULL && spans != NULL && color_spans != NULL);
+
+	for (int alpha = 0; alpha < 256; alpha++)
+	{
+		for (int v = 0; v < values; v++)
+		{
+			int value = v * CHECK_BLEND_STEP;
+			bottoms[alpha * values + v] = (Color){.r = value, .g = 255 - value, .b = value / 2, .a = alpha};
+		}
+	}
+
+	bool ok = true;
+	for (int alpha = 0; alpha < 256 && ok; alpha++)
+	{
+		for (int v = 0; v < values && ok; v++)
+		{
+			int value = v * CHECK_BLEND_STEP;
+			Color top = {.r = 255 - value, .g = value, .b = 255 - value / 3, .a = alpha};
+			for (size_t i = 0; i < n; i++) tops[i] = top;
+
+			memcpy(spans, bottoms, n * sizeof(Color));
+			memcpy(color_spans, bottoms, n * sizeof(Color));
+			layer_span(spans, tops, n);
+			layer_span_color(color_spans, top, n);
+
+			for (size_t i = 0; i < n; i++)
+			{
+				// The vector kernels give exactly the bytes of layer_color
+				Color blended[3] = {layer_color(bottoms[i], top), spans[i], color_spans[i]};
+				if (blended[1].rgba != blended[0].rgba || blended[2].rgba != blended[0].rgba)
+				{
+					Color b = bottoms[i];
+					fprintf(stderr, "ERROR: span blend of %d,%d,%d,%d over %d,%d,%d,%d differs from layer_color\n",
+					        top.r, top.g, top.b, top.a, b.r, b.g, b.b, b.a);
+					ok = false;
+					break;
+				}
+
+				for (int k = 0; k < 3; k++)
+				{
+					if (blend_matches(bottoms[i], top, blended[k])) continue;
+
+					Color b = bottoms[i];
+					Color e = layer_color_reference(b, top);
+					Color g = blended[k];
+					fprintf(stderr, "ERROR: blend of %d,%d,%d,%d over %d,%d,%d,%d gave %d,%d,%d,%d, expected %d,%d,%d,%d\n",
+					        top.r, top.g, top.b, top.a, b.r, b.g, b.b, b.a,
+					        g.r, g.g, g.b, g.a, e.r, e.g, e.b, e.a);
+					ok = false;
+					break;
+				}
+				if (!ok) break;
+			}
+		}
+	}
+
+	free(bottoms);
+	free(tops);
+	free(spans);
+	free(color_spans);
+	return ok;
+}
+
+// Compares everything an edit leaves in the layout with a layout of the
+// same text built from scratch
+static bool same_as_rebuilt(const ParagraphLayout *layout)
+{
+	ParagraphLayout rebuilt;
+	paragraph_layout_init(&rebuilt, layout->font, layout->size, layout->width);
+	paragraph_layout_set_text(&rebuilt, layout->text.items, layout->text.length);
+
+	bool same = layout->paragraphs.length == rebuilt.paragraphs.length &&
+	            layout->line_starts.length == rebuilt.line_starts.length &&
+	            layout->text.items[layout->text.length] == '\0';
+	for (size_t i = 0; same && i < layout->line_starts.length; i++)
+	{
+		same = layout->line_starts.items[i] == rebuilt.line_starts.items[i];
+	}
+	for (size_t i = 0; same && i < layout->paragraphs.length; i++)
+	{
+		Paragraph a = layout->paragraphs.items[i];
+		Paragraph b = rebuilt.paragraphs.items[i];
+		same = a.start == b.start && a.length == b.length && a.first_line == b.first_line &&
+		       a.line_count == b.line_count && a.widest_line == b.widest_line;
+	}
+
+	free_paragraph_layout(&rebuilt);
+	return same;
+}
+
+#define CHECK_REFLOW_STEPS 4000
+#define CHECK_REFLOW_WIDTH_EVERY 250
+
+// Random edits and widths, after each step the incrementally reflowed
+// layout has to match one built from its whole text
+static bool check_note_reflow(void)
+{
+	Font font = {0};
+	load_font(&font, BENCH_FONT);
+	if (font.data == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to load %s\n", BENCH_FONT);
+		return false;
+	}
+
+	const char *pieces[] = {"a", "word ", "\n", "  ", "longlonglonglonglonglongword", "\xC3\xA9", "x y z "};
+	ParagraphLayout layout;
+	paragraph_layout_init(&layout, font, BENCH_NOTE_TEXT_SIZE, 200);
+	srand(1);
+
+	bool ok = true;
+	for (int step = 0; step < CHECK_REFLOW_STEPS && ok; step++)
+	{
+		size_t length = layout.text.length;
+		size_t offset = rand() % (length + 1);
+		size_t remove = (rand() % 3 == 0) ? rand() % (length - offset + 1) % 20 : 0;
+		// Edits never split a multi byte character
+		while (offset > 0 && (layout.text.items[offset] & 0xC0) == 0x80) offset--;
+		while (offset + remove < length && (layout.text.items[offset + remove] & 0xC0) == 0x80) remove++;
+
+		const char *piece = pieces[rand() % countof(pieces)];
+		paragraph_layout_edit(&layout, offset, remove, piece, strlen(piece));
+		if (step % CHECK_REFLOW_WIDTH_EVERY == 0)
+		{
+			paragraph_layout_set_width(&layout, 50 + rand() % 400);
+		}
+
+		if (!same_as_rebuilt(&layout))
+		{
+			fprintf(stderr, "ERROR: Reflow after step %d differs from a full layout\n", step);
+			ok = false;
+		}
+	}
+
+	free_paragraph_layout(&layout);
+	free_font(&font);
+	return ok;
+}
+
+// Deterministic pattern with varying alpha so blending is not skipped
+static Image pattern_image(int width, int height)
+{
+	Image image = new_image(width, height);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			image.pixels[y * width + x] = (Color){
+				.r = x * 255 / width,
+				.g = y * 255 / height,
+				.b = (x ^ y) & 0xFF,
+				.a = 128 + ((x + y) & 127),
+			};
+		}
+	}
+	return image;
+}
+
+// Not a multiple of the tile size so the last tiles are partial
+#define CHECK_SCENE_WIDTH 300
+#define CHECK_SCENE_HEIGHT 200
+#define CHECK_SCENE_FRAMES 3
+
+typedef struct
+{
+	Font font;
+	Image source;
+	TextLayout layout;
+	Arena arena;
+} CheckScene;
+
+// Off pixel positions and sizes, scaled images, a faded layer and text
+// across tile edges. The frame moves some of it to redraw part of the tiles.
+static void draw_check_scene(Image image, CheckScene *scene, int frame)
+{
+	clear_image(image, COLOR_WHITE);
+	draw_rect(image, (Vec4){.x = 10.5f, .y = 20.25f, .w = 120.75f, .h = 70.5f}, (Color){.rgba = 0x80BB9AB1});
+	draw_rounded_rect(image, (Vec4){.x = 50.3f + frame, .y = 60.7f, .w = 140.2f, .h = 90.6f}, (Color){.rgba = 0xC04080F0}, 12.5f);
+	draw_image(image, scene->source, (Vec4){.x = 30.5f, .y = 100.25f, .w = 150.5f, .h = 97.75f}, NULL);
+	Vec4 crop = {.x = 8, .y = 4, .w = 40, .h = 30};
+	draw_image(image, scene->source, (Vec4){.x = 200.4f, .y = 130.6f, .w = 90.2f, .h = 50.1f}, &crop);
+	copy_image(image, scene->source, (Vec2){.x = 170.6f, .y = 5.3f});
+	draw_curve(image, (BezierCurve){.p1 = {.x = 5, .y = 190}, .p2 = {.x = 80, .y = 10}, .p3 = {.x = 200, .y = 250}, .p4 = {.x = 295, .y = 30}}, COLOR_RED);
+
+	Image panel = clip_image(image, (Vec4){.x = 100.5f, .y = 40.5f, .w = 150.25f, .h = 110.75f});
+	Image layer = begin_layer(panel, &scene->arena);
+	draw_rect(layer, (Vec4){.x = 90, .y = 30, .w = 100, .h = 60}, (Color){.rgba = 0xA0202080});
+	draw_rounded_rect(layer, (Vec4){.x = 120.5f, .y = 70.5f, .w = 110, .h = 60}, (Color){.rgba = 0x6000C0C0}, 9.0f);
+	draw_text(layer, scene->font, "Layered", 24, (Vec2){.x = 110.5f, .y = 60.25f + frame}, COLOR_BLACK);
+	end_layer(image, layer, 0.6f);
+
+	draw_text(image, scene->font, "Across tiles", 32, (Vec2){.x = 40.5f, .y = 110.5f}, (Color){.rgba = 0xD0000000});
+	draw_text_layout(image, &scene->layout, (Vec2){.x = 20.25f + 2 * frame, .y = 55.75f}, COLOR_BLUE);
+}
+
+// The same scene drawn directly and through a draw list, frame after
+// frame into the same buffer, has to give the same bytes
+static bool check_draw_list(void)
+{
+	CheckScene scene = {0};
+	load_font(&scene.font, BENCH_FONT);
+	if (scene.font.data == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to load %s\n", BENCH_FONT);
+		return false;
+	}
+	scene.source = pattern_image(64, 48);
+	layout_text(&scene.layout, scene.font, "Layout text", 20);
+
+	Image direct = new_image(CHECK_SCENE_WIDTH, CHECK_SCENE_HEIGHT);
+	Image listed = new_image(CHECK_SCENE_WIDTH, CHECK_SCENE_HEIGHT);
+	DrawList list = {0};
+	Arena list_arena = {0};
+
+	bool ok = true;
+	for (int frame = 0; frame < CHECK_SCENE_FRAMES && ok; frame++)
+	{
+		arena_reset(&scene.arena);
+		draw_check_scene(direct, &scene, frame);
+
+		arena_reset(&list_arena);
+		draw_check_scene(begin_draw_list(&list, listed, &list_arena), &scene, frame);
+		end_draw_list(&list, frame == 0 ? 0 : 1);
+
+		size_t size = (size_t)CHECK_SCENE_WIDTH * CHECK_SCENE_HEIGHT;
+		for (size_t i = 0; i < size; i++)
+		{
+			if (direct.pixels[i].rgba == listed.pixels[i].rgba) continue;
+
+			fprintf(stderr, "ERROR: Frame %d through the draw list differs at %d,%d: %08x instead of %08x\n",
+			        frame, (int)(i % CHECK_SCENE_WIDTH), (int)(i / CHECK_SCENE_WIDTH),
+			        listed.pixels[i].rgba, direct.pixels[i].rgba);
+			ok = false;
+			break;
+		}
+	}
+
+	free_draw_list(&list);
+	arena_free(&list_arena);
+	arena_free(&scene.arena);
+	free_image(&direct);
+	free_image(&listed);
+	free_image(&scene.source);
+	free_text_layout(&scene.layout);
+	free_font(&scene.font);
+	return ok;
+}
+
+Check checks[] = {
+	{"blend", check_blend},
+	{"note_reflow", check_note_reflow},
+	{"draw_list", check_draw_list},
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static bool run_checks(void)
+{
+	bool ok = true;
+	for (size_t c = 0; c < countof(checks); c++)
+	{
+		uint64_t start = time_ns();
+		bool passed = checks[c].fn();
+		printf("check %-18s %s in %.1f ms\n", checks[c].name, passed ? "passed" : "FAILED", (time_ns() - start) / 1e6);
+		ok &= passed;
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	bool only_checks = argc > 1 && strcmp(argv[1], "-check") == 0;
+	if (only_checks)
+	{
+		argc--;
+		argv++;
+	}
+
+	if (!run_checks())
+	{
+		fprintf(stderr, "ERROR: Checks failed\n");
+		return 1;
+	}
+	if (only_checks) return 0;
+
+	const char *output_path = argc > 1 ? argv[1] : BENCH_OUTPUT;
+
+	FILE *output = fopen(output_path, "w");
+	if (output == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to open %s\n", output_path);
+		return 1;
+	}
+	fprintf(output, "# name\tsize\tpixels\tsamples\tmedian_ns\tp99_ns\tns_per_px\tmpix_per_s\n");
+
+	BenchContext ctx = {0};
+	load_font(&ctx.font, BENCH_FONT);
+	if (ctx.font.data == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to load %s\n", BENCH_FONT);
+		return 1;
+	}
+
+	paragraph_layout_init(&ctx.note, ctx.font, BENCH_NOTE_TEXT_SIZE, 0);
+	ARRAY(char) note_text = {0};
+	while (note_text.length < BENCH_NOTE_BYTES)
+	{
+		for (int i = 0; i < BENCH_NOTE_SENTENCES; i++)
+		{
+			array_splice(&note_text, note_text.length, 0, BENCH_TEXT ". ", sizeof(BENCH_TEXT ". ") - 1);
+		}
+		note_text.items[note_text.length - 1] = '\n';
+	}
+	paragraph_layout_set_text(&ctx.note, note_text.items, note_text.length);
+	array_free(&note_text);
+
+	uint64_t *samples = malloc(BENCH_MAX_SAMPLES * sizeof(uint64_t));
+	assert(samples != NULL);
+
+	printf("%-24s %6s %10s %12s %12s %10s %10s\n",
+	       "name", "size", "pixels", "median ns", "p99 ns", "ns/px", "Mpix/s");
+
+	for (size_t b = 0; b < countof(benchmarks); b++)
+	{
+		Benchmark *bench = &benchmarks[b];
+		for (int s = 0; s < BENCH_SIZE_COUNT; s++)
+		{
+			int image_size = image_sizes[s];
+			ctx.size = bench->is_text ? text_sizes[s] : image_size;
+			ctx.target = new_image(image_size, image_size);
+			ctx.source = pattern_image(image_size, image_size);
+			ctx.small_source = pattern_image(image_size / 2, image_size / 2);
+			clear_image(ctx.target, COLOR_WHITE);
+
+			size_t pixels = (size_t)image_size * image_size;
+			if (bench->is_text)
+			{
+				Vec2 text_size = measure_text(ctx.font, BENCH_TEXT, ctx.size);
+				pixels = (size_t)text_size.x * text_size.y;
+			}
+
+			// Fills caches and starts the thread pool
+			uint64_t start = time_ns();
+			do
+			{
+				bench->fn(&ctx);
+			}
+			while (time_ns() - start < BENCH_WARMUP_NS);
+
+			size_t count = 0;
+			start = time_ns();
+			while (count < BENCH_MAX_SAMPLES &&
+			        (count < BENCH_MIN_SAMPLES || time_ns() - start < BENCH_RUN_NS))
+			{
+				uint64_t before = time_ns();
+				bench->fn(&ctx);
+				samples[count++] = time_ns() - before;
+			}
+
+			qsort(samples, count, sizeof(uint64_t), compare_u64);
+			uint64_t median = samples[count / 2];
+			uint64_t p99 = samples[(count * 99) / 100];
+			double ns_per_px = (double)median / pixels;
+			double mpix_per_s = pixels * 1000.0 / (median > 0 ? median : 1);
+
+			printf("%-24s %6d %10zu %12llu %12llu %10.3f %10.1f\n",
+			       bench->name, ctx.size, pixels,
+			       (unsigned long long)median, (unsigned long long)p99, ns_per_px, mpix_per_s);
+			fprintf(output, "%s\t%d\t%zu\t%zu\t%llu\t%llu\t%.4f\t%.2f\n",
+			        bench->name, ctx.size, pixels, count,
+			        (unsigned long long)median, (unsigned long long)p99, ns_per_px, mpix_per_s);
+
+			free_image(&ctx.target);
+			free_image(&ctx.source);
+			free_image(&ctx.small_source);
+		}
+	}
+
+	free(samples);
+	free_paragraph_layout(&ctx.note);
+	arena_free(&ctx.arena);
+	free_font(&ctx.font);
+	thread_pool_stop();
+	fclose(output);
+
+	fprintf(stderr, "INFO: Results written to %s\n", output_path);
+	return 0;
+}
@@ -1,14 +1,29 @@
 #include "drawing.h"
 #include "basic.h"
+#include "profiler.h"
 
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define DRAWING_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC accepts intrinsics of any instruction set without this
+#ifdef __GNUC__
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
 #define EPSILON 1e-3f
-#define BORDER_RADIUS_THRESHOLD 10.0f
-#define THREAD_COUNT 4
 
 Vec4 v4_add_v4(Vec4 a, Vec4 b)
 {
@@ -59,6 +74,10 @@ Image image_from_env(Env* env)
 	image.width = env->width;
 	image.height = env->height;
 	image.pixels = (Color *)env->buffer;
+	image.clip = (Vec4)
+	{
+		.x = 0, .y = 0, .w = image.width, .h = image.height
+	};
 	return image;
 }
 
@@ -72,728 +91,3643 @@ Env env_from_image(Image image)
 	};
 }
 
-Color layer_color(Color bottom, Color top)
+Image clip_image(Image image, Vec4 rect)
 {
-	float top_alpha = (float) top.a / 255.0f;
-    float bottom_alpha = (float) bottom.a / 255.0f;
-    float out_alpha = top_alpha + bottom_alpha * (1.0f - top_alpha);
-    if (out_alpha == 0)
-    {
-        return (Color) { .r = 0, .g = 0, .b = 0, .a = 0 };
-    }
+	float left = fmaxf(image.clip.x, floorf(rect.x));
+	float top = fmaxf(image.clip.y, floorf(rect.y));
+	float right = fminf(image.clip.x + image.clip.w, ceilf(rect.x + rect.w));
+	float bottom = fminf(image.clip.y + image.clip.h, ceilf(rect.y + rect.h));
+
+	image.clip.x = left;
+	image.clip.y = top;
+	image.clip.w = fmaxf(right - left, 0.0f);
+	image.clip.h = fmaxf(bottom - top, 0.0f);
+	return image;
+}
 
-    float r = ((float) top.r * top_alpha + (float) bottom.r * bottom_alpha * (1.0f - top_alpha)) / out_alpha;
-    float g = ((float) top.g * top_alpha + (float) bottom.g * bottom_alpha * (1.0f - top_alpha)) / out_alpha;
-    float b = ((float) top.b * top_alpha + (float) bottom.b * bottom_alpha * (1.0f - top_alpha)) / out_alpha;
+bool clip_is_empty(Image image)
+{
+	return image.clip.w <= 0 || image.clip.h <= 0;
+}
 
-    return (Color)
-    {
-        .r = (uint8_t) r,
-        .g = (uint8_t) g,
-        .b = (uint8_t) b,
-        .a = (uint8_t) (out_alpha * 255.0f)
-    };
+// Intersects rect with the clip of the image, the result is in
+// drawing coordinates with exclusive right and bottom edges
+static bool clip_bounds(Image image, Vec4 rect, int *x0, int *y0, int *x1, int *y1)
+{
+	Image clipped = clip_image(image, rect);
+	if (clip_is_empty(clipped)) return false;
+
+	*x0 = clipped.clip.x;
+	*y0 = clipped.clip.y;
+	*x1 = clipped.clip.x + clipped.clip.w;
+	*y1 = clipped.clip.y + clipped.clip.h;
+	return true;
 }
 
-inline Color get_pixel(Image image, int x, int y)
+// Commands outside the clip of the image are dropped right away
+static void record_command(Image image, DrawCommand command)
 {
-	assert(image.pixels != NULL);
+	assert(image.list != NULL);
+	if (clip_is_empty(image)) return;
 
-	if (x < 0 || x >= image.width) return COLOR_TRANSPARENT;
-	if (y < 0 || y >= image.height) return COLOR_TRANSPARENT;
+	command.clip = image.clip;
+	array_append(&image.list->commands, command);
+}
 
-	return image.pixels[y * image.width + x];
+static inline Color *pixel_at(Image image, int x, int y)
+{
+	return &image.pixels[(y - image.y) * image.width + (x - image.x)];
 }
 
-inline void put_pixel(Image image, int x, int y, Color color)
+// Rounded x / 255, exact for x in [0, 255 * 255]
+static inline uint32_t div255(uint32_t x)
 {
-	assert(image.pixels != NULL);
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
 
-	if (x < 0 || x >= image.width) return;
-	if (y < 0 || y >= image.height) return;
-	if (color.a == 0) return;
+// Colors are stored with straight alpha, blending happens on premultiplied
+// values and the result is divided back by the output alpha.
+// Stays within 1 LSB of the floating point "over" operator.
+Color layer_color(Color bottom, Color top)
+{
+	if (top.a == 255) return top;
+	if (top.a == 0) return bottom;
 
-	if (color.a == 255)
+	uint32_t inv_alpha = 255 - top.a;
+
+	// Common case, everything ends up on an opaque frame
+	if (bottom.a == 255)
 	{
-		image.pixels[y * image.width + x] = color;
+		return (Color)
+		{
+			.r = div255(top.r * top.a + bottom.r * inv_alpha),
+			.g = div255(top.g * top.a + bottom.g * inv_alpha),
+			.b = div255(top.b * top.a + bottom.b * inv_alpha),
+			.a = 255,
+		};
 	}
-	else
+
+	// Both weights are kept scaled by 255 to not lose precision
+	uint32_t top_weight = top.a * 255;
+	uint32_t bottom_weight = bottom.a * inv_alpha;
+	uint32_t out_weight = top_weight + bottom_weight;
+	if (out_weight == 0) return COLOR_TRANSPARENT;
+
+	return (Color)
 	{
-		image.pixels[y * image.width + x] = layer_color(get_pixel(image, x, y), color);
-	}
+		.r = (top.r * top_weight + bottom.r * bottom_weight) / out_weight,
+		.g = (top.g * top_weight + bottom.g * bottom_weight) / out_weight,
+		.b = (top.b * top_weight + bottom.b * bottom_weight) / out_weight,
+		.a = out_weight / 255,
+	};
 }
 
-Color mix_color(Color a, Color b, float t)
+static void fill_span_scalar(Color *dst, Color color, size_t n)
 {
-	Color c = {0};
-	c.r = lerp(a.r, b.r, t);
-	c.g = lerp(a.g, b.g, t);
-	c.b = lerp(a.b, b.b, t);
-	c.a = lerp(a.a, b.a, t);
-	return c;
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = color;
 }
 
-Vec2 lerp_points(Vec2 a, Vec2 b, float t)
+static void layer_span_scalar(Color *dst, const Color *src, size_t n)
 {
-	Vec2 p = {0};
-	p.x = lerp(a.x, b.x, t);
-	p.y = lerp(a.y, b.y, t);
-	return p;
+	for (size_t i = 0; i < n; ++i)
+	{
+		dst[i] = layer_color(dst[i], src[i]);
+	}
 }
 
-typedef enum
-{
-	OUTSIDE_BORDER,
-	ON_BORDER,
-	INSIDE_BORDER,
-} BorderCheckResult;
-
-BorderCheckResult border_radius_check(Vec4 rect, int cx, int cy, float r, float r_squared)
+// Expects a translucent color
+static void layer_span_color_scalar(Color *dst, Color color, size_t n)
 {
-	bool inside_border = false;
-	bool on_border = false;
+	// The premultiplied color is shared by every opaque pixel of the span
+	uint32_t inv_alpha = 255 - color.a;
+	uint32_t r = color.r * color.a;
+	uint32_t g = color.g * color.a;
+	uint32_t b = color.b * color.a;
 
-	// Top Left corner
-	float c = powf(cx - (rect.x + r), 2.0f) + powf(cy - (rect.y + r), 2.0f);
-	if (cx <= (rect.x + r) && cy <= (rect.y + r))
+	for (size_t i = 0; i < n; ++i)
 	{
-		inside_border = c < r_squared;
-		on_border = fabsf(c - r_squared) <= BORDER_RADIUS_THRESHOLD;
+		if (dst[i].a == 255)
+		{
+			dst[i].r = div255(r + dst[i].r * inv_alpha);
+			dst[i].g = div255(g + dst[i].g * inv_alpha);
+			dst[i].b = div255(b + dst[i].b * inv_alpha);
+		}
+		else
+		{
+			dst[i] = layer_color(dst[i], color);
+		}
 	}
+}
 
-	// Top Right corner
-	c = powf(cx - (rect.x + rect.w - r), 2.0f) + powf(cy - (rect.y + r), 2.0f);
-	if (cx >= (rect.x + rect.w - r) && cy <= (rect.y + r))
+// The coverage of every pixel scales the alpha of the color
+static void layer_span_mask_scalar(Color *dst, Color color, const uint8_t *mask, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
 	{
-		inside_border = inside_border || c < r_squared;
-		on_border = on_border || fabsf(c - r_squared) <= BORDER_RADIUS_THRESHOLD;
+		if (mask[i] == 0) continue;
+
+		Color c = color;
+		c.a = div255(color.a * mask[i]);
+		dst[i] = layer_color(dst[i], c);
 	}
+}
 
-	// Bottom Left corner
-	c = powf(cx - (rect.x + r), 2.0f) + powf(cy - (rect.y + rect.h - r), 2.0f);
-	if (cx <= (rect.x + r) && cy >= (rect.y + rect.h - r))
+// BMP stores pixels as BGR or BGRA bytes, alpha is or'ed into every pixel
+static void swizzle_bgr_span_scalar(Color *dst, const uint8_t *src, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
 	{
-		inside_border = inside_border || c < r_squared;
-		on_border = on_border || fabsf(c - r_squared) <= BORDER_RADIUS_THRESHOLD;
+		dst[i] = (Color){.r = src[i*3 + 2], .g = src[i*3 + 1], .b = src[i*3], .a = 255};
 	}
+}
 
-	// Bottom Right corner
-	c = powf(cx - (rect.x + rect.w - r), 2.0f) + powf(cy - (rect.y + rect.h - r), 2.0f);
-	if (cx >= (rect.x + rect.w - r) && cy >= (rect.y + rect.h - r))
+static void swizzle_bgra_span_scalar(Color *dst, const uint8_t *src, size_t n, uint32_t alpha)
+{
+	for (size_t i = 0; i < n; ++i)
 	{
-		inside_border = inside_border || c < r_squared;
-		on_border = on_border || fabsf(c - r_squared) <= BORDER_RADIUS_THRESHOLD;
+		dst[i] = (Color){.r = src[i*4 + 2], .g = src[i*4 + 1], .b = src[i*4], .a = src[i*4 + 3]};
+		dst[i].rgba |= alpha;
 	}
+}
 
-	inside_border = inside_border
-	                || (cx > rect.x + r && cx < rect.x + rect.w - r)
-	                || (cy > rect.y + r && cy < rect.y + rect.h - r);
+// Blur sums are kept as one uint32_t per channel byte. Stored bytes are
+// sums times a scale in fixed point with BLUR_SCALE_BITS of fraction,
+// which has to stay below 256 << BLUR_SCALE_BITS.
+#define BLUR_SCALE_BITS 24
 
-	on_border = on_border
-	            || (cx == rect.x && cy >= rect.y + r && cy <= rect.y + rect.h - r)
-	            || (cx == rect.x + rect.w && cy >= rect.y + r && cy <= rect.y + rect.h - r)
-	            || (cy == rect.y && cx >= rect.x + r && cx <= rect.x + rect.w - r)
-	            || (cy == rect.y + rect.h && cx >= rect.x + r && cx <= rect.x + rect.w - r);
+static void blur_accumulate_span_scalar(uint32_t *sums, const uint8_t *src, uint32_t weight, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		sums[i] += src[i] * weight;
+}
 
-	if (on_border) return ON_BORDER;
-	if (inside_border) return INSIDE_BORDER;
+// Wraps around while a sum gets smaller, the sum itself never goes
+// below zero
+static void blur_slide_span_scalar(uint32_t *sums, const uint8_t *in, const uint8_t *out, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		sums[i] += in[i] - out[i];
+}
 
-	return OUTSIDE_BORDER;
+// Running sum of every channel along n pixels
+static void blur_prefix_span_scalar(uint32_t *sums, size_t n)
+{
+	for (size_t i = 4; i < n * 4; ++i)
+		sums[i] += sums[i - 4];
 }
 
-void clear_image(Image image, Color color)
+static void blur_store_span_scalar(uint8_t *dst, const uint32_t *sums, uint32_t scale, size_t n)
+{
+	const uint32_t round = (uint32_t)1 << (BLUR_SCALE_BITS - 1);
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = (sums[i] * scale + round) >> BLUR_SCALE_BITS;
+}
+
+// The vector kernels give the same bytes as layer_color, so the output is
+// identical whichever kernel runs.
+#ifdef DRAWING_X86
+
+TARGET("sse2") static inline __m128i div255_sse2(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+TARGET("sse2") static inline bool is_opaque_sse2(__m128i pixels)
+{
+	__m128i filled = _mm_or_si128(pixels, _mm_set1_epi32(0x00FFFFFF));
+	return _mm_movemask_epi8(_mm_cmpeq_epi32(filled, _mm_set1_epi32(-1))) == 0xFFFF;
+}
+
+TARGET("sse2") static void fill_span_sse2(Color *dst, Color color, size_t n)
+{
+	__m128i value = _mm_set1_epi32(color.rgba);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + i), value);
+	fill_span_scalar(dst + i, color, n - i);
+}
+
+// Alpha comes from the source pixel, the result is opaque
+TARGET("sse2") static inline __m128i blend_half_sse2(__m128i dst, __m128i src)
+{
+	__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, 0xFF), 0xFF);
+	__m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+	__m128i sum = _mm_add_epi16(_mm_mullo_epi16(src, alpha), _mm_mullo_epi16(dst, inv_alpha));
+	return div255_sse2(sum);
+}
+
+TARGET("sse2") static inline __m128 channel_sse2(__m128i pixels, int shift)
+{
+	return _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, shift), _mm_set1_epi32(0xFF)));
+}
+
+// layer_color of four pixels of any alpha, for layers. Each channel gets
+// its own float lanes, every product and sum stays below 2^24 so they are
+// exact, and a correctly rounded division truncates to the same integer
+// as the integer one.
+TARGET("sse2") static inline __m128i layer_any_sse2(__m128i dst, __m128i src)
 {
-	for (int y = 0; y < image.height; ++y)
+	const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+	const __m128 full = _mm_set1_ps(255.0f);
+
+	__m128 top_alpha = channel_sse2(src, 24);
+	__m128 top_weight = _mm_mul_ps(top_alpha, full);
+	__m128 bottom_weight = _mm_mul_ps(channel_sse2(dst, 24), _mm_sub_ps(full, top_alpha));
+	__m128 out_weight = _mm_add_ps(top_weight, bottom_weight);
+	// A zero weight only happens for transparent tops, which keep the bottom
+	__m128 divisor = _mm_max_ps(out_weight, _mm_set1_ps(1.0f));
+
+	// Truncated weight / 255, exact for weights below 2^16
+	__m128i weight = _mm_cvttps_epi32(out_weight);
+	weight = _mm_add_epi32(_mm_add_epi32(weight, _mm_srli_epi32(weight, 8)), _mm_set1_epi32(1));
+	__m128i result = _mm_slli_epi32(_mm_srli_epi32(weight, 8), 24);
+	for (int shift = 0; shift < 24; shift += 8)
 	{
-		for (int x = 0; x < image.width; ++x)
-		{
-			image.pixels[y * image.width + x] = color;
-		}
+		__m128 sum = _mm_add_ps(_mm_mul_ps(channel_sse2(src, shift), top_weight),
+		                        _mm_mul_ps(channel_sse2(dst, shift), bottom_weight));
+		result = _mm_or_si128(result, _mm_slli_epi32(_mm_cvttps_epi32(_mm_div_ps(sum, divisor)), shift));
+	}
+
+	// Opaque bottoms round like the opaque path of layer_color
+	__m128i bottom_opaque = _mm_cmpeq_epi32(_mm_or_si128(dst, _mm_set1_epi32(0x00FFFFFF)), _mm_set1_epi32(-1));
+	if (_mm_movemask_epi8(bottom_opaque) != 0)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i lo = blend_half_sse2(_mm_unpacklo_epi8(dst, zero), _mm_unpacklo_epi8(src, zero));
+		__m128i hi = blend_half_sse2(_mm_unpackhi_epi8(dst, zero), _mm_unpackhi_epi8(src, zero));
+		__m128i over_opaque = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask);
+		result = _mm_or_si128(_mm_and_si128(bottom_opaque, over_opaque), _mm_andnot_si128(bottom_opaque, result));
 	}
+
+	__m128i top_clear = _mm_cmpeq_epi32(_mm_and_si128(src, alpha_mask), _mm_setzero_si128());
+	return _mm_or_si128(_mm_and_si128(top_clear, dst), _mm_andnot_si128(top_clear, result));
 }
 
-void draw_rect(Image image, Vec4 rect, Color color)
+TARGET("sse2") static void layer_span_sse2(Color *dst, const Color *src, size_t n)
 {
-	for (size_t y = rect.y; y < rect.y + rect.h; ++y)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
 	{
-		for (size_t x = rect.x; x < rect.x + rect.w; ++x)
+		__m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		if (!is_opaque_sse2(d))
 		{
-			put_pixel(image, x, y, color);
+			_mm_storeu_si128((__m128i *)(dst + i), layer_any_sse2(d, s));
+			continue;
 		}
+
+		__m128i lo = blend_half_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero));
+		__m128i hi = blend_half_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero));
+		__m128i result = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask);
+		_mm_storeu_si128((__m128i *)(dst + i), result);
 	}
+	layer_span_scalar(dst + i, src + i, n - i);
 }
 
-void draw_rounded_rect(Image image, Vec4 rect, Color color, float border_radius)
+TARGET("sse2") static void layer_span_color_sse2(Color *dst, Color color, size_t n)
 {
-	float r_squared = border_radius * border_radius;
-
-	for (size_t cy = rect.y; cy <= rect.y + rect.h; ++cy)
+	const __m128i zero = _mm_setzero_si128();
+
+	// Per channel premultiplied color, the alpha lane always yields 255
+	short a = color.a;
+	short c0 = (short)((color.rgba & 0xFF) * a);
+	short c1 = (short)(((color.rgba >> 8) & 0xFF) * a);
+	short c2 = (short)(((color.rgba >> 16) & 0xFF) * a);
+	short full = (short)(255 * 255);
+	short inv = 255 - a;
+	const __m128i premultiplied = _mm_set_epi16(full, c2, c1, c0, full, c2, c1, c0);
+	const __m128i inv_alpha = _mm_set_epi16(0, inv, inv, inv, 0, inv, inv, inv);
+	const __m128i value = _mm_set1_epi32(color.rgba);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
 	{
-		for (size_t cx = rect.x; cx <= rect.x + rect.w; ++cx)
+		__m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+		if (!is_opaque_sse2(d))
 		{
-			BorderCheckResult result = border_radius_check(rect, cx, cy, border_radius, r_squared);
-			if (result != OUTSIDE_BORDER)
-			{
-				put_pixel(image, cx, cy, color);
-			}
+			_mm_storeu_si128((__m128i *)(dst + i), layer_any_sse2(d, value));
+			continue;
 		}
+
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv_alpha), premultiplied);
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv_alpha), premultiplied);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(div255_sse2(lo), div255_sse2(hi)));
 	}
+	layer_span_color_scalar(dst + i, color, n - i);
 }
 
-void draw_curve(Image image, BezierCurve curve, Color color)
+// Coverage and color are 16 bit channels, the result is opaque
+TARGET("sse2") static inline __m128i blend_mask_half_sse2(__m128i dst, __m128i color, __m128i coverage, __m128i color_alpha)
 {
-	float t = 0.0f;
-	while (t <= 1.0f)
+	__m128i alpha = div255_sse2(_mm_mullo_epi16(coverage, color_alpha));
+	__m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+	__m128i sum = _mm_add_epi16(_mm_mullo_epi16(color, alpha), _mm_mullo_epi16(dst, inv_alpha));
+	return div255_sse2(sum);
+}
+
+TARGET("sse2") static void layer_span_mask_sse2(Color *dst, Color color, const uint8_t *mask, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+	const __m128i color_alpha = _mm_set1_epi16(color.a);
+	const __m128i value = _mm_set1_epi32(color.rgba);
+	const __m128i c = _mm_unpacklo_epi8(value, zero);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
 	{
-		Vec2 p5 = lerp_points(curve.p1, curve.p2, t);
-		Vec2 p6 = lerp_points(curve.p2, curve.p3, t);
-		Vec2 p7 = lerp_points(curve.p3, curve.p4, t);
+		uint32_t coverage;
+		memcpy(&coverage, mask + i, sizeof(coverage));
+		if (coverage == 0) continue;
 
-		Vec2 p8 = lerp_points(p5, p6, t);
-		Vec2 p9 = lerp_points(p6, p7, t);
+		// Every byte of a pixel gets its coverage
+		__m128i m = _mm_cvtsi32_si128((int)coverage);
+		m = _mm_unpacklo_epi8(m, m);
+		m = _mm_unpacklo_epi16(m, m);
 
-		Vec2 p10 = lerp_points(p8, p9, t);
-		put_pixel(image, (int)p10.x, (int)p10.y, color);
+		__m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+		if (!is_opaque_sse2(d))
+		{
+			// The color with the alpha of every pixel scaled by its coverage
+			__m128i alpha_lo = div255_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(m, zero), color_alpha));
+			__m128i alpha_hi = div255_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(m, zero), color_alpha));
+			__m128i alpha = _mm_and_si128(_mm_packus_epi16(alpha_lo, alpha_hi), alpha_mask);
+			__m128i s = _mm_or_si128(_mm_andnot_si128(alpha_mask, value), alpha);
+			_mm_storeu_si128((__m128i *)(dst + i), layer_any_sse2(d, s));
+			continue;
+		}
 
-		t += EPSILON;
+		__m128i lo = blend_mask_half_sse2(_mm_unpacklo_epi8(d, zero), c, _mm_unpacklo_epi8(m, zero), color_alpha);
+		__m128i hi = blend_mask_half_sse2(_mm_unpackhi_epi8(d, zero), c, _mm_unpackhi_epi8(m, zero), color_alpha);
+		__m128i result = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask);
+		_mm_storeu_si128((__m128i *)(dst + i), result);
 	}
+	layer_span_mask_scalar(dst + i, color, mask + i, n - i);
 }
 
-PACK(typedef struct
+// Swaps the red and blue bytes of every pixel but on windows, where the
+// colors are stored as BGRA already
+TARGET("sse2") static void swizzle_bgra_span_sse2(Color *dst, const uint8_t *src, size_t n, uint32_t alpha)
 {
-	uint16_t type;
-	uint32_t size;
-	uint16_t reserved1;
-	uint16_t reserved2;
-	uint32_t offset;
-})
-BMPHeader;
+	const __m128i alpha_mask = _mm_set1_epi32(alpha);
 
-PACK(typedef struct
-{
-	uint32_t size;
-	int32_t width;
-	int32_t height;
-	uint16_t planes;
-	uint16_t bits_per_pixel;
-	uint32_t compression;
-	uint32_t image_size;
-	int32_t x_pixels_per_meter;
-	int32_t y_pixels_per_meter;
-	uint32_t colors_used;
-	uint32_t colors_important;
-})
-BMPInfoHeader;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + i*4));
+#ifndef _WIN32
+		__m128i ga = _mm_and_si128(p, _mm_set1_epi32(0xFF00FF00));
+		__m128i rb = _mm_and_si128(p, _mm_set1_epi32(0x00FF00FF));
+		rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(rb, 0xB1), 0xB1);
+		p = _mm_or_si128(ga, rb);
+#endif
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(p, alpha_mask));
+	}
+	swizzle_bgra_span_scalar(dst + i, src + i*4, n - i, alpha);
+}
 
-void blur_image(Image image)
+// Weights are below 1 << 16, so a byte times a weight is put together
+// from the low and high halves of 16 bit products
+TARGET("sse2") static void blur_accumulate_span_sse2(uint32_t *sums, const uint8_t *src, uint32_t weight, size_t n)
 {
-	assert(image.pixels != NULL);
-
-	static int kernel_size = 3;
-	static float kernel[3][3] =
-	{
-		{1.0f/16.0f, 2.0f/16.0f, 1.0f/16.0f},
-		{2.0f/16.0f, 4.0f/16.0f, 2.0f/16.0f},
-		{1.0f/16.0f, 2.0f/16.0f, 1.0f/16.0f},
-	};
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16((short)weight);
 
-	for (int y=0; y<image.height; ++y)
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
 	{
-		for (int x=0; x<image.width; ++x)
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i halves[2] = {_mm_unpacklo_epi8(x, zero), _mm_unpackhi_epi8(x, zero)};
+		for (int h = 0; h < 2; ++h)
 		{
-			float r = 0.0f;
-			float g = 0.0f;
-			float b = 0.0f;
-			float a = 0.0f;
-
-			for (int ky=0; ky<kernel_size; ++ky)
-			{
-				for (int kx=0; kx<kernel_size; ++kx)
-				{
-					int px = x + kx - kernel_size / 2;
-					int py = y + ky - kernel_size / 2;
-
-					Color color = get_pixel(image, px, py);
-
-					r += color.r * kernel[ky][kx];
-					g += color.g * kernel[ky][kx];
-					b += color.b * kernel[ky][kx];
-					a += color.a * kernel[ky][kx];
-				}
-			}
-
-			r = clamp(r, 0.0f, 255.0f);
-			g = clamp(g, 0.0f, 255.0f);
-			b = clamp(b, 0.0f, 255.0f);
-
-			put_pixel(image, x, y, (Color)
-			{
-				.r=(uint8_t)r,
-				.g=(uint8_t)g,
-				.b=(uint8_t)b,
-				.a=(uint8_t)a,
-			});
+			__m128i lo = _mm_mullo_epi16(halves[h], w);
+			__m128i hi = _mm_mulhi_epu16(halves[h], w);
+			__m128i *s0 = (__m128i *)(sums + i + h*8);
+			__m128i *s1 = (__m128i *)(sums + i + h*8 + 4);
+			_mm_storeu_si128(s0, _mm_add_epi32(_mm_loadu_si128(s0), _mm_unpacklo_epi16(lo, hi)));
+			_mm_storeu_si128(s1, _mm_add_epi32(_mm_loadu_si128(s1), _mm_unpackhi_epi16(lo, hi)));
 		}
 	}
+	blur_accumulate_span_scalar(sums + i, src + i, weight, n - i);
 }
 
-void fade_image(Image image, float opacity)
+TARGET("sse2") static void blur_slide_span_sse2(uint32_t *sums, const uint8_t *in, const uint8_t *out, size_t n)
 {
-	assert(image.pixels != NULL);
+	const __m128i zero = _mm_setzero_si128();
 
-	for (int y=0; y<image.height; ++y)
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
 	{
-		for (int x=0; x<image.width; ++x)
+		__m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(out + i));
+		__m128i deltas[2] = {
+			_mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+			_mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+		};
+		for (int h = 0; h < 2; ++h)
 		{
-			Color color = get_pixel(image, x, y);
-			color.a = (uint8_t)((float)color.a * opacity);
-			put_pixel(image, x, y, color);
+			// Sign extended by shifting the delta down from the high half
+			__m128i d0 = _mm_srai_epi32(_mm_unpacklo_epi16(deltas[h], deltas[h]), 16);
+			__m128i d1 = _mm_srai_epi32(_mm_unpackhi_epi16(deltas[h], deltas[h]), 16);
+			__m128i *s0 = (__m128i *)(sums + i + h*8);
+			__m128i *s1 = (__m128i *)(sums + i + h*8 + 4);
+			_mm_storeu_si128(s0, _mm_add_epi32(_mm_loadu_si128(s0), d0));
+			_mm_storeu_si128(s1, _mm_add_epi32(_mm_loadu_si128(s1), d1));
 		}
 	}
+	blur_slide_span_scalar(sums + i, in + i, out + i, n - i);
 }
 
-Image scale_image(Image image, float sx, float sy)
+// Each pixel depends on the one before, a pixel is one vector
+TARGET("sse2") static void blur_prefix_span_sse2(uint32_t *sums, size_t n)
 {
-	assert(image.pixels != NULL);
+	__m128i total = _mm_setzero_si128();
+	for (size_t i = 0; i < n; ++i)
+	{
+		__m128i *sum = (__m128i *)(sums + i * 4);
+		total = _mm_add_epi32(total, _mm_loadu_si128(sum));
+		_mm_storeu_si128(sum, total);
+	}
+}
 
-	int scaled_w = (int)((float)image.width * sx);
-	int scaled_h = (int)((float)image.height * sy);
+// Low halves of the 32 bit products, SSE2 only multiplies every other lane
+TARGET("sse2") static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
 
-	Image scaled_image = new_image(scaled_w, scaled_h);
+TARGET("sse2") static void blur_store_span_sse2(uint8_t *dst, const uint32_t *sums, uint32_t scale, size_t n)
+{
+	const __m128i s = _mm_set1_epi32(scale);
+	const __m128i round = _mm_set1_epi32(1 << (BLUR_SCALE_BITS - 1));
 
-	for (int y = 0; y < scaled_h; ++y)
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
 	{
-		for (int x = 0; x < scaled_w; ++x)
+		__m128i v[4];
+		for (int k = 0; k < 4; ++k)
 		{
-			int src_x = (int)(((float)x / sx));
-			int src_y = (int)(((float)y / sy));
-
-			Color c = get_pixel(image, src_x, src_y);
-			put_pixel(scaled_image, x, y, c);
+			__m128i sum = _mm_loadu_si128((const __m128i *)(sums + i + k*4));
+			v[k] = _mm_srli_epi32(_mm_add_epi32(mullo_epi32_sse2(sum, s), round), BLUR_SCALE_BITS);
 		}
+		// Every value fits in a byte so the saturating packs keep them
+		__m128i lo = _mm_packs_epi32(v[0], v[1]);
+		__m128i hi = _mm_packs_epi32(v[2], v[3]);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
 	}
-
-	return scaled_image;
+	blur_store_span_scalar(dst + i, sums + i, scale, n - i);
 }
 
-Image duplicate_image(Image image)
+// The rest of the file is built without AVX, so every AVX2 kernel clears
+// the upper halves of the registers before it calls into scalar code or
+// returns. Otherwise that code pays for a transition on every SSE op.
+TARGET("avx2") static inline __m256i div255_avx2(__m256i x)
 {
-	assert(image.pixels != NULL);
-
-	Image duplicate = new_image(image.width, image.height);
-	memcpy(duplicate.pixels, image.pixels, image.width * image.height * sizeof(Color));
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
 
-	return duplicate;
+TARGET("avx2") static inline bool is_opaque_avx2(__m256i pixels)
+{
+	__m256i filled = _mm256_or_si256(pixels, _mm256_set1_epi32(0x00FFFFFF));
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi32(filled, _mm256_set1_epi32(-1))) == -1;
 }
 
-Image new_image(int width, int height)
+TARGET("avx2") static void fill_span_avx2(Color *dst, Color color, size_t n)
 {
-	Image image = {0};
-	image.width = width;
-	image.height = height;
-	size_t size = width * height * sizeof(Color);
-	image.pixels = malloc(size);
-	assert(image.pixels != NULL);
-	memset(image.pixels, 0, size);
+	__m256i value = _mm256_set1_epi32(color.rgba);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i *)(dst + i), value);
+	_mm256_zeroupper();
+	fill_span_scalar(dst + i, color, n - i);
+}
 
-	return image;
+TARGET("avx2") static inline __m256i blend_half_avx2(__m256i dst, __m256i src)
+{
+	__m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(src, 0xFF), 0xFF);
+	__m256i inv_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+	__m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(src, alpha), _mm256_mullo_epi16(dst, inv_alpha));
+	return div255_avx2(sum);
 }
 
-void load_image_bmp(Image *image, const char *filename)
+TARGET("avx2") static inline __m256 channel_avx2(__m256i pixels, int shift)
 {
-	FILE *file = fopen(filename, "rb");
-	if (file == NULL)
-	{
-		fprintf(stderr, "ERROR: Failed to open file\n");
-		return;
-	}
+	return _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixels, shift), _mm256_set1_epi32(0xFF)));
+}
 
-	BMPHeader header;
-	fread(&header, sizeof(BMPHeader), 1, file);
-	if (header.type != 0x4D42)
+// Same as layer_any_sse2 on eight pixels
+TARGET("avx2") static inline __m256i layer_any_avx2(__m256i dst, __m256i src)
+{
+	const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+	const __m256 full = _mm256_set1_ps(255.0f);
+
+	__m256 top_alpha = channel_avx2(src, 24);
+	__m256 top_weight = _mm256_mul_ps(top_alpha, full);
+	__m256 bottom_weight = _mm256_mul_ps(channel_avx2(dst, 24), _mm256_sub_ps(full, top_alpha));
+	__m256 out_weight = _mm256_add_ps(top_weight, bottom_weight);
+	__m256 divisor = _mm256_max_ps(out_weight, _mm256_set1_ps(1.0f));
+
+	__m256i weight = _mm256_cvttps_epi32(out_weight);
+	weight = _mm256_add_epi32(_mm256_add_epi32(weight, _mm256_srli_epi32(weight, 8)), _mm256_set1_epi32(1));
+	__m256i result = _mm256_slli_epi32(_mm256_srli_epi32(weight, 8), 24);
+	for (int shift = 0; shift < 24; shift += 8)
 	{
-		fprintf(stderr, "ERROR: Invalid BMP file\n");
-		fclose(file);
-		return;
+		__m256 sum = _mm256_add_ps(_mm256_mul_ps(channel_avx2(src, shift), top_weight),
+		                           _mm256_mul_ps(channel_avx2(dst, shift), bottom_weight));
+		result = _mm256_or_si256(result, _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_div_ps(sum, divisor)), shift));
 	}
 
-	BMPInfoHeader info_header;
-	fread(&info_header, sizeof(BMPInfoHeader), 1, file);
-
-	if (info_header.compression != 0)
+	__m256i bottom_opaque = _mm256_cmpeq_epi32(_mm256_or_si256(dst, _mm256_set1_epi32(0x00FFFFFF)), _mm256_set1_epi32(-1));
+	if (_mm256_movemask_epi8(bottom_opaque) != 0)
 	{
-		fprintf(stderr, "ERROR: Compressed BMP files are not supported\n");
-		fclose(file);
-		return;
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i lo = blend_half_avx2(_mm256_unpacklo_epi8(dst, zero), _mm256_unpacklo_epi8(src, zero));
+		__m256i hi = blend_half_avx2(_mm256_unpackhi_epi8(dst, zero), _mm256_unpackhi_epi8(src, zero));
+		__m256i over_opaque = _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask);
+		result = _mm256_blendv_epi8(result, over_opaque, bottom_opaque);
 	}
 
-	image->width = info_header.width;
-	image->height = info_header.height;
-	image->pixels = malloc(image->width * image->height * sizeof(Color));
-
-	fprintf(stderr, "INFO: Image size: %dx%d\n", image->width, image->height);
-	fprintf(stderr, "INFO: Bits per pixel: %d\n", info_header.bits_per_pixel);
+	__m256i top_clear = _mm256_cmpeq_epi32(_mm256_and_si256(src, alpha_mask), _mm256_setzero_si256());
+	return _mm256_blendv_epi8(result, dst, top_clear);
+}
 
-	fseek(file, header.offset, SEEK_SET);
-	int bytes_per_pixel = info_header.bits_per_pixel / 8;
-	int bytes_per_scanline = image->width * bytes_per_pixel;
-	int padding = (4 - (bytes_per_scanline % 4)) % 4;
+// Unpacking and packing both work within 128 bit lanes so the pixel order is kept
+TARGET("avx2") static void layer_span_avx2(Color *dst, const Color *src, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
 
-	for (int y = image->height - 1; y >= 0; --y)
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
 	{
-		for (int x = 0; x < image->width; ++x)
+		__m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		if (!is_opaque_avx2(d))
 		{
-			Color color = {0};
-			uint8_t bytes[4] = {0};
-			for (int i = 0; i < bytes_per_pixel; ++i)
-			{
-				fread(&bytes[i], sizeof(uint8_t), 1, file);
-			}
-
-			if (bytes_per_pixel == 1)
-			{
-				color.b = bytes[0];
-				color.g = bytes[0];
-				color.r = bytes[0];
-				color.a = 255;
-			}
-			else if (bytes_per_pixel == 3)
-			{
-				color.b = bytes[0];
-				color.g = bytes[1];
-				color.r = bytes[2];
-				color.a = 255;
-			}
-			else if (bytes_per_pixel == 4)
-			{
-				color.b = bytes[0];
-				color.g = bytes[1];
-				color.r = bytes[2];
-				color.a = bytes[3];
-			}
-
-			image->pixels[y * image->width + x] = color;
+			_mm256_storeu_si256((__m256i *)(dst + i), layer_any_avx2(d, s));
+			continue;
 		}
-		fseek(file, padding, SEEK_CUR);
+
+		__m256i lo = blend_half_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero));
+		__m256i hi = blend_half_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero));
+		__m256i result = _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask);
+		_mm256_storeu_si256((__m256i *)(dst + i), result);
 	}
+	_mm256_zeroupper();
+	layer_span_scalar(dst + i, src + i, n - i);
 }
 
-void load_image(Image *image, const char *filename)
+TARGET("avx2") static void layer_span_color_avx2(Color *dst, Color color, size_t n)
 {
-	fprintf(stderr, "INFO: Loading image: %s\n", filename);
-	const char *ext = filename + strlen(filename) - 4;
-	if (strcmp(ext, ".bmp") == 0)
+	const __m256i zero = _mm256_setzero_si256();
+
+	short a = color.a;
+	short c0 = (short)((color.rgba & 0xFF) * a);
+	short c1 = (short)(((color.rgba >> 8) & 0xFF) * a);
+	short c2 = (short)(((color.rgba >> 16) & 0xFF) * a);
+	short full = (short)(255 * 255);
+	short inv = 255 - a;
+	const __m256i premultiplied = _mm256_set_epi16(
+		full, c2, c1, c0, full, c2, c1, c0,
+		full, c2, c1, c0, full, c2, c1, c0);
+	const __m256i inv_alpha = _mm256_set_epi16(
+		0, inv, inv, inv, 0, inv, inv, inv,
+		0, inv, inv, inv, 0, inv, inv, inv);
+	const __m256i value = _mm256_set1_epi32(color.rgba);
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
 	{
-		load_image_bmp(image, filename);
+		__m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+		if (!is_opaque_avx2(d))
+		{
+			_mm256_storeu_si256((__m256i *)(dst + i), layer_any_avx2(d, value));
+			continue;
+		}
+
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv_alpha), premultiplied);
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv_alpha), premultiplied);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(div255_avx2(lo), div255_avx2(hi)));
 	}
-	else
+	_mm256_zeroupper();
+	layer_span_color_scalar(dst + i, color, n - i);
+}
+
+// Byte order of four pixels within a 128 bit lane, -1 yields zero
+#ifdef _WIN32
+#define SWIZZLE_BGR 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+#define SWIZZLE_BGRA 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+#else
+#define SWIZZLE_BGR 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+#define SWIZZLE_BGRA 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+#endif
+
+// Each lane is loaded from 12 bytes of 4 pixels, the 16 byte loads read
+// 4 bytes past the pixels so the last ones never go past the span
+TARGET("avx2") static void swizzle_bgr_span_avx2(Color *dst, const uint8_t *src, size_t n)
+{
+	const __m256i shuffle = _mm256_setr_epi8(SWIZZLE_BGR, SWIZZLE_BGR);
+	const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+
+	size_t i = 0;
+	for (; (i + 8)*3 + 4 <= n*3; i += 8)
 	{
-		fprintf(stderr, "Unsupported image format\n");
+		__m128i lo = _mm_loadu_si128((const __m128i *)(src + i*3));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(src + i*3 + 12));
+		__m256i p = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		p = _mm256_or_si256(_mm256_shuffle_epi8(p, shuffle), alpha_mask);
+		_mm256_storeu_si256((__m256i *)(dst + i), p);
 	}
+	_mm256_zeroupper();
+	swizzle_bgr_span_scalar(dst + i, src + i*3, n - i);
 }
 
-typedef struct
+TARGET("avx2") static void swizzle_bgra_span_avx2(Color *dst, const uint8_t *src, size_t n, uint32_t alpha)
 {
-	Image background;
-	Image image;
-	Vec4 rect;
-	Vec4 crop;
-} DrawImageThreadArgs;
+	const __m256i shuffle = _mm256_setr_epi8(SWIZZLE_BGRA, SWIZZLE_BGRA);
+	const __m256i alpha_mask = _mm256_set1_epi32(alpha);
 
-void draw_image(Image background, Image image, Vec4 rect, Vec4 *crop)
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + i*4));
+		p = _mm256_or_si256(_mm256_shuffle_epi8(p, shuffle), alpha_mask);
+		_mm256_storeu_si256((__m256i *)(dst + i), p);
+	}
+	_mm256_zeroupper();
+	swizzle_bgra_span_scalar(dst + i, src + i*4, n - i, alpha);
+}
+
+TARGET("avx2") static void blur_accumulate_span_avx2(uint32_t *sums, const uint8_t *src, uint32_t weight, size_t n)
 {
-	assert(image.pixels != NULL);
-	assert(background.pixels != NULL);
+	const __m256i w = _mm256_set1_epi32(weight);
 
-	Vec4 crop_rect;
-	if (crop != NULL)
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
 	{
-		crop_rect = *crop;
+		__m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+		__m256i *sum = (__m256i *)(sums + i);
+		_mm256_storeu_si256(sum, _mm256_add_epi32(_mm256_loadu_si256(sum), _mm256_mullo_epi32(x, w)));
 	}
-	else
+	_mm256_zeroupper();
+	blur_accumulate_span_scalar(sums + i, src + i, weight, n - i);
+}
+
+TARGET("avx2") static void blur_slide_span_avx2(uint32_t *sums, const uint8_t *in, const uint8_t *out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
 	{
-		crop_rect = (Vec4)
-		{
-			.x = 0, .y = 0, .w = image.width, .h = image.height
-		};
+		__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(in + i)));
+		__m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(out + i)));
+		__m256i *sum = (__m256i *)(sums + i);
+		_mm256_storeu_si256(sum, _mm256_add_epi32(_mm256_loadu_si256(sum), _mm256_sub_epi32(a, b)));
 	}
+	_mm256_zeroupper();
+	blur_slide_span_scalar(sums + i, in + i, out + i, n - i);
+}
 
-	const float sx = crop_rect.w / rect.w;
-	const float sy = crop_rect.h / rect.h;
-
-	for (int y = 0; y < rect.h; ++y)
+TARGET("avx2") static void blur_store_span_avx2(uint8_t *dst, const uint32_t *sums, uint32_t scale, size_t n)
+{
+	const __m256i s = _mm256_set1_epi32(scale);
+	const __m256i round = _mm256_set1_epi32(1 << (BLUR_SCALE_BITS - 1));
+	// The packs work within 128 bit lanes, this puts the groups of four
+	// bytes back in order
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
 	{
-		for (int x = 0; x < rect.w; ++x)
+		__m256i v[4];
+		for (int k = 0; k < 4; ++k)
 		{
-			const int ix = (int)(x * sx + crop_rect.x);
-			const int iy = (int)(y * sy + crop_rect.y);
-
-			if (ix >= 0 && ix < image.width && iy >= 0 && iy < image.height)
-			{
-				int k = iy * image.width + ix;
-				put_pixel(background, x + rect.x, y + rect.y, image.pixels[k]);
-			}
+			__m256i sum = _mm256_loadu_si256((const __m256i *)(sums + i + k*8));
+			v[k] = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(sum, s), round), BLUR_SCALE_BITS);
 		}
+		__m256i lo = _mm256_packs_epi32(v[0], v[1]);
+		__m256i hi = _mm256_packs_epi32(v[2], v[3]);
+		__m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), order);
+		_mm256_storeu_si256((__m256i *)(dst + i), bytes);
 	}
+	_mm256_zeroupper();
+	blur_store_span_scalar(dst + i, sums + i, scale, n - i);
 }
 
-void free_image(Image *image)
+static bool cpu_has_avx2(void)
 {
-	free(image->pixels);
-	image->pixels = NULL;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+
+	// The OS has to save the ymm registers as well
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 6) != 6) return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
 }
 
-typedef struct
+static bool cpu_has_sse2(void)
 {
-	int width;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif
+
+typedef struct
+{
+	void (*fill_span)(Color *dst, Color color, size_t n);
+	void (*layer_span)(Color *dst, const Color *src, size_t n);
+	void (*layer_span_color)(Color *dst, Color color, size_t n);
+	void (*layer_span_mask)(Color *dst, Color color, const uint8_t *mask, size_t n);
+	void (*swizzle_bgr_span)(Color *dst, const uint8_t *src, size_t n);
+	void (*swizzle_bgra_span)(Color *dst, const uint8_t *src, size_t n, uint32_t alpha);
+	void (*blur_accumulate_span)(uint32_t *sums, const uint8_t *src, uint32_t weight, size_t n);
+	void (*blur_slide_span)(uint32_t *sums, const uint8_t *in, const uint8_t *out, size_t n);
+	void (*blur_prefix_span)(uint32_t *sums, size_t n);
+	void (*blur_store_span)(uint8_t *dst, const uint32_t *sums, uint32_t scale, size_t n);
+} SpanKernels;
+
+// Every entry is valid at any time so a racing first call is harmless
+static SpanKernels span_kernels =
+{
+	.fill_span = fill_span_scalar,
+	.layer_span = layer_span_scalar,
+	.layer_span_color = layer_span_color_scalar,
+	.layer_span_mask = layer_span_mask_scalar,
+	.swizzle_bgr_span = swizzle_bgr_span_scalar,
+	.swizzle_bgra_span = swizzle_bgra_span_scalar,
+	.blur_accumulate_span = blur_accumulate_span_scalar,
+	.blur_slide_span = blur_slide_span_scalar,
+	.blur_prefix_span = blur_prefix_span_scalar,
+	.blur_store_span = blur_store_span_scalar,
+};
+
+static const SpanKernels *get_span_kernels(void)
+{
+	static bool selected = false;
+	if (selected) return &span_kernels;
+
+#ifdef DRAWING_X86
+	if (cpu_has_avx2())
+	{
+		span_kernels.fill_span = fill_span_avx2;
+		span_kernels.layer_span = layer_span_avx2;
+		span_kernels.layer_span_color = layer_span_color_avx2;
+		// Glyph rows are too short for wider vectors to pay off
+		span_kernels.layer_span_mask = layer_span_mask_sse2;
+		span_kernels.swizzle_bgr_span = swizzle_bgr_span_avx2;
+		span_kernels.swizzle_bgra_span = swizzle_bgra_span_avx2;
+		span_kernels.blur_accumulate_span = blur_accumulate_span_avx2;
+		span_kernels.blur_slide_span = blur_slide_span_avx2;
+		// Wider vectors do not shorten the chain of pixels
+		span_kernels.blur_prefix_span = blur_prefix_span_sse2;
+		span_kernels.blur_store_span = blur_store_span_avx2;
+	}
+	else if (cpu_has_sse2())
+	{
+		span_kernels.fill_span = fill_span_sse2;
+		span_kernels.layer_span = layer_span_sse2;
+		span_kernels.layer_span_color = layer_span_color_sse2;
+		span_kernels.layer_span_mask = layer_span_mask_sse2;
+		// Three byte pixels need a byte shuffle, SSE2 has none
+		span_kernels.swizzle_bgra_span = swizzle_bgra_span_sse2;
+		span_kernels.blur_accumulate_span = blur_accumulate_span_sse2;
+		span_kernels.blur_slide_span = blur_slide_span_sse2;
+		span_kernels.blur_prefix_span = blur_prefix_span_sse2;
+		span_kernels.blur_store_span = blur_store_span_sse2;
+	}
+#endif
+
+	selected = true;
+	return &span_kernels;
+}
+
+void fill_span(Color *dst, Color color, size_t n)
+{
+	get_span_kernels()->fill_span(dst, color, n);
+}
+
+void layer_span(Color *dst, const Color *src, size_t n)
+{
+	get_span_kernels()->layer_span(dst, src, n);
+}
+
+void layer_span_color(Color *dst, Color color, size_t n)
+{
+	if (color.a == 0) return;
+
+	if (color.a == 255)
+	{
+		fill_span(dst, color, n);
+		return;
+	}
+
+	get_span_kernels()->layer_span_color(dst, color, n);
+}
+
+static inline Color get_pixel(Image image, int x, int y)
+{
+	assert(image.pixels != NULL);
+
+	if (x < image.x || x >= image.x + image.width) return COLOR_TRANSPARENT;
+	if (y < image.y || y >= image.y + image.height) return COLOR_TRANSPARENT;
+
+	return *pixel_at(image, x, y);
+}
+
+static inline void put_pixel(Image image, int x, int y, Color color)
+{
+	assert(image.pixels != NULL);
+
+	if (x < image.clip.x || x >= image.clip.x + image.clip.w) return;
+	if (y < image.clip.y || y >= image.clip.y + image.clip.h) return;
+	if (color.a == 0) return;
+
+	Color *pixel = pixel_at(image, x, y);
+	if (color.a == 255)
+	{
+		*pixel = color;
+	}
+	else
+	{
+		*pixel = layer_color(*pixel, color);
+	}
+}
+
+Color mix_color(Color a, Color b, float t)
+{
+	Color c = {0};
+	c.r = lerp(a.r, b.r, t);
+	c.g = lerp(a.g, b.g, t);
+	c.b = lerp(a.b, b.b, t);
+	c.a = lerp(a.a, b.a, t);
+	return c;
+}
+
+Vec2 lerp_points(Vec2 a, Vec2 b, float t)
+{
+	Vec2 p = {0};
+	p.x = lerp(a.x, b.x, t);
+	p.y = lerp(a.y, b.y, t);
+	return p;
+}
+
+void clear_image(Image image, Color color)
+{
+	if (image.list != NULL)
+	{
+		record_command(image, (DrawCommand){.kind = DRAW_CLEAR, .color = color});
+		return;
+	}
+
+	int x0, y0, x1, y1;
+	if (!clip_bounds(image, image.clip, &x0, &y0, &x1, &y1)) return;
+
+	// Full width rows are contiguous and filled in one go
+	if (x0 == image.x && x1 == image.x + image.width)
+	{
+		fill_span(pixel_at(image, x0, y0), color, (size_t)(x1 - x0) * (y1 - y0));
+		return;
+	}
+
+	for (int y = y0; y < y1; ++y)
+	{
+		fill_span(pixel_at(image, x0, y), color, x1 - x0);
+	}
+}
+
+void draw_rect(Image image, Vec4 rect, Color color)
+{
+	if (color.a == 0) return;
+
+	if (image.list != NULL)
+	{
+		record_command(image, (DrawCommand){.kind = DRAW_RECT, .rect = rect, .color = color});
+		return;
+	}
+
+	int x0, y0, x1, y1;
+	if (!clip_bounds(image, rect, &x0, &y0, &x1, &y1)) return;
+
+	for (int y = y0; y < y1; ++y)
+	{
+		layer_span_color(pixel_at(image, x0, y), color, x1 - x0);
+	}
+}
+
+// Blends the anti-aliased edge of a corner arc, the coverage is the
+// signed distance of the pixel center to the circle
+static void draw_corner_span(Image image, int x0, int x1, int y, float cx, float dy, float r, Color color)
+{
+	for (int x = x0; x < x1; ++x)
+	{
+		float dx = (x + 0.5f) - cx;
+		float coverage = clamp(r + 0.5f - sqrtf(dx * dx + dy * dy), 0.0f, 1.0f);
+
+		Color c = color;
+		c.a = (uint8_t)(color.a * coverage + 0.5f);
+		if (c.a == 0) continue;
+
+		Color *pixel = pixel_at(image, x, y);
+		*pixel = layer_color(*pixel, c);
+	}
+}
+
+void draw_rounded_rect(Image image, Vec4 rect, Color color, float border_radius)
+{
+	if (color.a == 0) return;
+
+	if (image.list != NULL)
+	{
+		record_command(image, (DrawCommand){
+			.kind = DRAW_ROUNDED_RECT, .rect = rect, .color = color, .value = border_radius
+		});
+		return;
+	}
+
+	float r = clamp(border_radius, 0.0f, fminf(rect.w, rect.h) / 2.0f);
+	if (r < 0.5f)
+	{
+		draw_rect(image, rect, color);
+		return;
+	}
+
+	int x0, y0, x1, y1;
+	if (!clip_bounds(image, rect, &x0, &y0, &x1, &y1)) return;
+
+	// Centers of the corner circles
+	const float left = rect.x + r;
+	const float right = rect.x + rect.w - r;
+	const float top = rect.y + r;
+	const float bottom = rect.y + rect.h - r;
+
+	for (int y = y0; y < y1; ++y)
+	{
+		float cy = y + 0.5f;
+		float dy = 0.0f;
+		if (cy < top) dy = top - cy;
+		else if (cy > bottom) dy = cy - bottom;
+
+		if (dy == 0.0f)
+		{
+			layer_span_color(pixel_at(image, x0, y), color, x1 - x0);
+			continue;
+		}
+
+		// Pixels within r - 0.5 of a corner center are fully covered and
+		// the ones beyond r + 0.5 not at all, only the band in between
+		// needs per pixel coverage
+		float inner = (r - 0.5f) * (r - 0.5f) - dy * dy;
+		float outer = (r + 0.5f) * (r + 0.5f) - dy * dy;
+		float inner_dx = (inner > 0.0f) ? sqrtf(inner) : 0.0f;
+		float outer_dx = (outer > 0.0f) ? sqrtf(outer) : 0.0f;
+
+		int solid_x0 = ceilf(left - inner_dx - 0.5f);
+		int solid_x1 = floorf(right + inner_dx - 0.5f) + 1;
+		int edge_x0 = floorf(left - outer_dx);
+		int edge_x1 = ceilf(right + outer_dx);
+
+		solid_x0 = (solid_x0 < x0) ? x0 : (solid_x0 > x1) ? x1 : solid_x0;
+		solid_x1 = (solid_x1 > x1) ? x1 : (solid_x1 < solid_x0) ? solid_x0 : solid_x1;
+		edge_x0 = (edge_x0 < x0) ? x0 : edge_x0;
+		edge_x1 = (edge_x1 > x1) ? x1 : edge_x1;
+
+		draw_corner_span(image, edge_x0, solid_x0, y, left, dy, r, color);
+		layer_span_color(pixel_at(image, solid_x0, y), color, solid_x1 - solid_x0);
+		draw_corner_span(image, solid_x1, edge_x1, y, right, dy, r, color);
+	}
+}
+
+void draw_curve(Image image, BezierCurve curve, Color color)
+{
+	if (image.list != NULL)
+	{
+		record_command(image, (DrawCommand){.kind = DRAW_CURVE, .curve = curve, .color = color});
+		return;
+	}
+
+	float t = 0.0f;
+	while (t <= 1.0f)
+	{
+		Vec2 p5 = lerp_points(curve.p1, curve.p2, t);
+		Vec2 p6 = lerp_points(curve.p2, curve.p3, t);
+		Vec2 p7 = lerp_points(curve.p3, curve.p4, t);
+
+		Vec2 p8 = lerp_points(p5, p6, t);
+		Vec2 p9 = lerp_points(p6, p7, t);
+
+		Vec2 p10 = lerp_points(p8, p9, t);
+		put_pixel(image, (int)p10.x, (int)p10.y, color);
+
+		t += EPSILON;
+	}
+}
+
+PACK(typedef struct
+{
+	uint16_t type;
+	uint32_t size;
+	uint16_t reserved1;
+	uint16_t reserved2;
+	uint32_t offset;
+})
+BMPHeader;
+
+PACK(typedef struct
+{
+	uint32_t size;
+	int32_t width;
+	int32_t height;
+	uint16_t planes;
+	uint16_t bits_per_pixel;
+	uint32_t compression;
+	uint32_t image_size;
+	int32_t x_pixels_per_meter;
+	int32_t y_pixels_per_meter;
+	uint32_t colors_used;
+	uint32_t colors_important;
+})
+BMPInfoHeader;
+
+#define BMP_RGB 0
+#define BMP_BITFIELDS 3
+#define BMP_ALPHABITFIELDS 6
+
+typedef enum
+{
+	BMP_FORMAT_BGR,
+	BMP_FORMAT_BGRA,
+	// 32 bit pixels with an unused fourth byte
+	BMP_FORMAT_BGRX,
+	BMP_FORMAT_PALETTE,
+	BMP_FORMAT_MASKED,
+} BMPFormat;
+
+typedef struct
+{
+	uint32_t mask;
+	int shift;
+	int bits;
+} BMPChannel;
+
+typedef struct
+{
+	Image image;
+	// First row stored in the file
+	const uint8_t *rows;
+	size_t stride;
+	bool top_down;
+	int bits_per_pixel;
+	BMPFormat format;
+	Color palette[256];
+	// Red, green, blue and alpha
+	BMPChannel channels[4];
+} BMPDecode;
+
+#define BLUR_GAUSSIAN_MAX_RADIUS 4
+#define BLUR_WEIGHT_BITS 16
+#define BLUR_BOX_PASSES 3
+#define BLUR_MIN_ROWS_PER_BAND 16
+
+typedef struct
+{
+	const Color *src;
+	Color *dst;
+	int width;
+	int height;
+	// Rows are split into this many bands run in parallel
+	int bands;
+	// Rows of dst written by this band
+	int y0;
+	int y1;
+	int radius;
+	bool vertical;
+	// Fixed point gaussian weights, NULL for a box filter
+	const uint32_t *weights;
+	// Channel sums of a whole row, 4 per pixel
+	uint32_t *sums;
+	// Copy of a row for the horizontal passes with padding pixels on
+	// either side
+	Color *row;
+	int padding;
+} BlurBand;
+
+static inline int clamp_index(int i, int n)
+{
+	return (i < 0) ? 0 : (i >= n) ? n - 1 : i;
+}
+
+// Copies row y with its end pixels repeated padding times on both sides
+static const Color *blur_pad_row(BlurBand *args, int y)
+{
+	const SpanKernels *kernels = get_span_kernels();
+	const int w = args->width;
+	const int pad = args->padding;
+	const Color *src = args->src + y * w;
+
+	kernels->fill_span(args->row, src[0], pad);
+	memcpy(args->row + pad, src, w * sizeof(Color));
+	kernels->fill_span(args->row + pad + w, src[w - 1], pad);
+	return args->row + pad;
+}
+
+// Rows are weighted and added up whole so the taps run through the span
+// kernels, the padding keeps the taps from needing clamps
+static void blur_gaussian_horizontal(BlurBand *args)
+{
+	const SpanKernels *kernels = get_span_kernels();
+	const int r = args->radius;
+	const int w = args->width;
+	const size_t n = (size_t)w * 4;
+
+	for (int y = args->y0; y < args->y1; ++y)
+	{
+		const Color *row = blur_pad_row(args, y);
+
+		memset(args->sums, 0, n * sizeof(uint32_t));
+		for (int k = -r; k <= r; ++k)
+			kernels->blur_accumulate_span(args->sums, (const uint8_t *)(row + k), args->weights[k + r], n);
+		kernels->blur_store_span((uint8_t *)(args->dst + y * w), args->sums, 1 << (BLUR_SCALE_BITS - BLUR_WEIGHT_BITS), n);
+	}
+}
+
+static void blur_gaussian_vertical(BlurBand *args)
+{
+	const SpanKernels *kernels = get_span_kernels();
+	const int r = args->radius;
+	const int w = args->width;
+	const size_t n = (size_t)w * 4;
+
+	for (int y = args->y0; y < args->y1; ++y)
+	{
+		memset(args->sums, 0, n * sizeof(uint32_t));
+		for (int k = -r; k <= r; ++k)
+		{
+			const Color *row = args->src + clamp_index(y + k, args->height) * w;
+			kernels->blur_accumulate_span(args->sums, (const uint8_t *)row, args->weights[k + r], n);
+		}
+		kernels->blur_store_span((uint8_t *)(args->dst + y * w), args->sums, 1 << (BLUR_SCALE_BITS - BLUR_WEIGHT_BITS), n);
+	}
+}
+
+// Sliding window average, constant cost per pixel whatever the radius.
+// The window sum of every pixel is the one before it plus what slid in
+// and out, so the differences are taken for the whole row and summed up.
+static void blur_box_horizontal(BlurBand *args)
+{
+	const SpanKernels *kernels = get_span_kernels();
+	const int r = args->radius;
+	const int w = args->width;
+	const size_t n = (size_t)w * 4;
+	const uint32_t scale = ((uint32_t)1 << BLUR_SCALE_BITS) / (2 * r + 1);
+
+	for (int y = args->y0; y < args->y1; ++y)
+	{
+		const Color *row = blur_pad_row(args, y);
+
+		memset(args->sums, 0, n * sizeof(uint32_t));
+		for (int k = -r; k <= r; ++k)
+			kernels->blur_accumulate_span(args->sums, (const uint8_t *)(row + k), 1, 4);
+		kernels->blur_slide_span(args->sums + 4, (const uint8_t *)(row + r + 1), (const uint8_t *)(row - r), n - 4);
+		kernels->blur_prefix_span(args->sums, w);
+		kernels->blur_store_span((uint8_t *)(args->dst + y * w), args->sums, scale, n);
+	}
+}
+
+// Columns slide down together so memory is still read row by row
+static void blur_box_vertical(BlurBand *args)
+{
+	const SpanKernels *kernels = get_span_kernels();
+	const int r = args->radius;
+	const int w = args->width;
+	const int h = args->height;
+	const size_t n = (size_t)w * 4;
+	const uint32_t scale = ((uint32_t)1 << BLUR_SCALE_BITS) / (2 * r + 1);
+
+	memset(args->sums, 0, n * sizeof(uint32_t));
+	for (int k = -r; k <= r; ++k)
+	{
+		const Color *row = args->src + clamp_index(args->y0 + k, h) * w;
+		kernels->blur_accumulate_span(args->sums, (const uint8_t *)row, 1, n);
+	}
+
+	for (int y = args->y0; y < args->y1; ++y)
+	{
+		const Color *in = args->src + clamp_index(y + r + 1, h) * w;
+		const Color *out = args->src + clamp_index(y - r, h) * w;
+		kernels->blur_store_span((uint8_t *)(args->dst + y * w), args->sums, scale, n);
+		kernels->blur_slide_span(args->sums, (const uint8_t *)in, (const uint8_t *)out, n);
+	}
+}
+
+// Scratch of every band, the sums of a row followed by the padded row
+static size_t blur_band_words(int width, int padding)
+{
+	return (size_t)width * 4 + width + 2 * padding;
+}
+
+static void blur_bands(void *ctx, size_t begin, size_t end)
+{
+	const BlurBand *pass = (const BlurBand *)ctx;
+	const int rows = (pass->height + pass->bands - 1) / pass->bands;
+
+	for (size_t i = begin; i < end; ++i)
+	{
+		BlurBand band = *pass;
+		band.y0 = i * rows;
+		band.y1 = (band.y0 + rows < pass->height) ? band.y0 + rows : pass->height;
+		band.sums = pass->sums + i * blur_band_words(pass->width, pass->padding);
+		band.row = (Color *)(band.sums + pass->width * 4);
+		if (band.y0 >= band.y1) continue;
+
+		if (band.weights != NULL)
+		{
+			if (band.vertical)
+				blur_gaussian_vertical(&band);
+			else
+				blur_gaussian_horizontal(&band);
+		}
+		else
+		{
+			if (band.vertical)
+				blur_box_vertical(&band);
+			else
+				blur_box_horizontal(&band);
+		}
+	}
+}
+
+// Runs one direction of the filter with the bands spread over the pool
+static void blur_pass(BlurBand pass)
+{
+	parallel_for(0, pass.bands, 1, blur_bands, &pass);
+}
+
+// Widths of the box filters whose repeated application approximates a
+// gaussian of the given sigma
+static void blur_box_sizes(float sigma, int sizes[BLUR_BOX_PASSES])
+{
+	const int n = BLUR_BOX_PASSES;
+	float ideal = sqrtf(12.0f * sigma * sigma / n + 1.0f);
+	int lower = (int)floorf(ideal);
+	if (lower % 2 == 0) lower--;
+	int upper = lower + 2;
+
+	float m_ideal = (12.0f * sigma * sigma - n * lower * lower - 4.0f * n * lower - 3.0f * n) / (-4.0f * lower - 4.0f);
+	int m = (int)roundf(m_ideal);
+
+	for (int i = 0; i < n; ++i)
+		sizes[i] = (i < m) ? lower : upper;
+}
+
+static float blur_sigma(int radius)
+{
+	return fmaxf(radius / 2.0f, 0.5f);
+}
+
+// Bands are at least a few rows high, more of them than threads only
+// adds work since every band of a box pass primes its own sums. The
+// padding covers the widest window of the passes.
+static BlurBand blur_setup(Image image, int radius)
+{
+	thread_pool_start(0);
+	int bands = image.height / BLUR_MIN_ROWS_PER_BAND;
+	if (bands > thread_pool_thread_count()) bands = thread_pool_thread_count();
+	if (bands < 1) bands = 1;
+
+	BlurBand pass = {0};
+	pass.width = image.width;
+	pass.height = image.height;
+	pass.bands = bands;
+	pass.padding = radius;
+	if (radius > BLUR_GAUSSIAN_MAX_RADIUS)
+	{
+		// The last box is the widest, a window also reads one pixel
+		// past its end while sliding
+		int sizes[BLUR_BOX_PASSES];
+		blur_box_sizes(blur_sigma(radius), sizes);
+		pass.padding = (sizes[BLUR_BOX_PASSES - 1] - 1) / 2 + 1;
+	}
+	return pass;
+}
+
+// A copy of the image between the passes and the rows of every band
+static size_t blur_scratch_size(const BlurBand *pass)
+{
+	return (size_t)pass->width * pass->height * sizeof(Color) +
+	       (size_t)pass->bands * blur_band_words(pass->width, pass->padding) * sizeof(uint32_t);
+}
+
+static void blur_image_into(Image image, int radius, BlurBand pass, void *scratch)
+{
+	Color *copy = scratch;
+	pass.sums = (uint32_t *)(copy + (size_t)image.width * image.height);
+
+	float sigma = blur_sigma(radius);
+	if (radius <= BLUR_GAUSSIAN_MAX_RADIUS)
+	{
+		uint32_t weights[2 * BLUR_GAUSSIAN_MAX_RADIUS + 1];
+		float total = 0.0f;
+		for (int k = -radius; k <= radius; ++k)
+			total += expf(-(k * k) / (2.0f * sigma * sigma));
+
+		uint32_t weight_sum = 0;
+		for (int k = -radius; k <= radius; ++k)
+		{
+			weights[k + radius] = roundf(expf(-(k * k) / (2.0f * sigma * sigma)) / total * (1 << BLUR_WEIGHT_BITS));
+			weight_sum += weights[k + radius];
+		}
+
+		// Rounding error goes to the center so flat areas stay unchanged
+		weights[radius] += (1 << BLUR_WEIGHT_BITS) - weight_sum;
+
+		pass.radius = radius;
+		pass.weights = weights;
+		pass.src = image.pixels;
+		pass.dst = copy;
+		blur_pass(pass);
+
+		pass.vertical = true;
+		pass.src = copy;
+		pass.dst = image.pixels;
+		blur_pass(pass);
+		return;
+	}
+
+	int sizes[BLUR_BOX_PASSES];
+	blur_box_sizes(sigma, sizes);
+	for (int i = 0; i < BLUR_BOX_PASSES; ++i)
+	{
+		pass.radius = (sizes[i] - 1) / 2;
+
+		pass.vertical = false;
+		pass.src = image.pixels;
+		pass.dst = copy;
+		blur_pass(pass);
+
+		pass.vertical = true;
+		pass.src = copy;
+		pass.dst = image.pixels;
+		blur_pass(pass);
+	}
+}
+
+// Separable blur where radius is about two standard deviations, small
+// radii use a true gaussian and larger ones three box filters
+void blur_image(Image image, int radius)
+{
+	assert(image.list == NULL && "blur needs the pixels, draw into a layer");
+	assert(image.pixels != NULL);
+	if (radius <= 0 || image.width <= 0 || image.height <= 0) return;
+
+	BlurBand pass = blur_setup(image, radius);
+	void *scratch = mem_alloc(blur_scratch_size(&pass));
+	assert(scratch != NULL);
+
+	blur_image_into(image, radius, pass, scratch);
+	mem_free(scratch);
+}
+
+// Scratch memory comes from the arena, so blurring every frame does not
+// allocate once the arena is large enough
+void blur_image_arena(Arena *arena, Image image, int radius)
+{
+	assert(image.list == NULL && "blur needs the pixels, draw into a layer");
+	assert(image.pixels != NULL);
+	if (radius <= 0 || image.width <= 0 || image.height <= 0) return;
+
+	BlurBand pass = blur_setup(image, radius);
+	blur_image_into(image, radius, pass, arena_alloc(arena, blur_scratch_size(&pass)));
+}
+
+void fade_image(Image image, float opacity)
+{
+	assert(image.pixels != NULL);
+	assert(image.list == NULL);
+
+	// Same truncation for every pixel of an alpha, so it is looked up
+	uint8_t faded[256];
+	for (int a = 0; a < 256; ++a)
+	{
+		faded[a] = (uint8_t)((float)a * opacity);
+	}
+
+	// Written in place, put_pixel would blend the faded pixel with itself
+	for (int i=0; i<image.width*image.height; ++i)
+	{
+		image.pixels[i].a = faded[image.pixels[i].a];
+	}
+}
+
+// Area averaging, every source pixel lands in exactly one output pixel
+static void scale_image_box(Image image, Image scaled_image)
+{
+	for (int y = 0; y < scaled_image.height; ++y)
+	{
+		int y0 = (int64_t)y * image.height / scaled_image.height;
+		int y1 = (int64_t)(y + 1) * image.height / scaled_image.height;
+		if (y1 <= y0) y1 = y0 + 1;
+
+		for (int x = 0; x < scaled_image.width; ++x)
+		{
+			int x0 = (int64_t)x * image.width / scaled_image.width;
+			int x1 = (int64_t)(x + 1) * image.width / scaled_image.width;
+			if (x1 <= x0) x1 = x0 + 1;
+
+			uint32_t sum[4] = {0};
+			for (int iy = y0; iy < y1; ++iy)
+			{
+				const Color *row = image.pixels + iy * image.width;
+				for (int ix = x0; ix < x1; ++ix)
+				{
+					sum[0] += row[ix].r;
+					sum[1] += row[ix].g;
+					sum[2] += row[ix].b;
+					sum[3] += row[ix].a;
+				}
+			}
+
+			uint32_t count = (uint32_t)(x1 - x0) * (y1 - y0);
+			scaled_image.pixels[y * scaled_image.width + x] = (Color)
+			{
+				.r = (sum[0] + count / 2) / count,
+				.g = (sum[1] + count / 2) / count,
+				.b = (sum[2] + count / 2) / count,
+				.a = (sum[3] + count / 2) / count,
+			};
+		}
+	}
+}
+
+// Source position of a destination pixel center in 16.16 fixed point,
+// clamped so the right and bottom neighbours stay inside the image
+static inline int64_t bilinear_position(int i, int64_t step, int size)
+{
+	int64_t p = i * step + step / 2 - (1 << 15);
+	int64_t max = (int64_t)(size - 1) << 16;
+	return (p < 0) ? 0 : (p > max) ? max : p;
+}
+
+static inline uint8_t bilinear_channel(uint32_t c00, uint32_t c01, uint32_t c10, uint32_t c11, uint32_t wx, uint32_t wy)
+{
+	uint32_t top = c00 * (256 - wx) + c01 * wx;
+	uint32_t bottom = c10 * (256 - wx) + c11 * wx;
+	return (top * (256 - wy) + bottom * wy + (1 << 15)) >> 16;
+}
+
+static void scale_image_bilinear(Image image, Image scaled_image)
+{
+	const int64_t step_x = ((int64_t)image.width << 16) / scaled_image.width;
+	const int64_t step_y = ((int64_t)image.height << 16) / scaled_image.height;
+
+	for (int y = 0; y < scaled_image.height; ++y)
+	{
+		int64_t fy = bilinear_position(y, step_y, image.height);
+		int iy = fy >> 16;
+		uint32_t wy = (fy >> 8) & 0xFF;
+		const Color *row0 = image.pixels + iy * image.width;
+		const Color *row1 = image.pixels + (iy + 1 < image.height ? iy + 1 : iy) * image.width;
+
+		for (int x = 0; x < scaled_image.width; ++x)
+		{
+			int64_t fx = bilinear_position(x, step_x, image.width);
+			int ix = fx >> 16;
+			int ix1 = ix + 1 < image.width ? ix + 1 : ix;
+			uint32_t wx = (fx >> 8) & 0xFF;
+
+			Color c00 = row0[ix], c01 = row0[ix1], c10 = row1[ix], c11 = row1[ix1];
+			scaled_image.pixels[y * scaled_image.width + x] = (Color)
+			{
+				.r = bilinear_channel(c00.r, c01.r, c10.r, c11.r, wx, wy),
+				.g = bilinear_channel(c00.g, c01.g, c10.g, c11.g, wx, wy),
+				.b = bilinear_channel(c00.b, c01.b, c10.b, c11.b, wx, wy),
+				.a = bilinear_channel(c00.a, c01.a, c10.a, c11.a, wx, wy),
+			};
+		}
+	}
+}
+
+// Shrinking uses area averaging so no source pixel is skipped,
+// anything else is interpolated bilinearly
+static void scale_image_into(Image image, Image scaled_image)
+{
+	if (scaled_image.width <= 0 || scaled_image.height <= 0) return;
+
+	if (scaled_image.width <= image.width && scaled_image.height <= image.height)
+		scale_image_box(image, scaled_image);
+	else
+		scale_image_bilinear(image, scaled_image);
+}
+
+Image scale_image(Image image, float sx, float sy)
+{
+	assert(image.pixels != NULL);
+
+	int scaled_w = (int)roundf((float)image.width * sx);
+	int scaled_h = (int)roundf((float)image.height * sy);
+
+	Image scaled_image = new_image(scaled_w, scaled_h);
+	scale_image_into(image, scaled_image);
+	return scaled_image;
+}
+
+Image scale_image_arena(Arena *arena, Image image, float sx, float sy)
+{
+	assert(image.pixels != NULL);
+
+	int scaled_w = (int)roundf((float)image.width * sx);
+	int scaled_h = (int)roundf((float)image.height * sy);
+
+	Image scaled_image = new_image_arena(arena, scaled_w, scaled_h);
+	scale_image_into(image, scaled_image);
+	return scaled_image;
+}
+
+Image duplicate_image(Image image)
+{
+	assert(image.pixels != NULL);
+
+	Image duplicate = new_image(image.width, image.height);
+	memcpy(duplicate.pixels, image.pixels, image.width * image.height * sizeof(Color));
+
+	return duplicate;
+}
+
+Image duplicate_image_arena(Arena *arena, Image image)
+{
+	assert(image.pixels != NULL);
+
+	Image duplicate = new_image_arena(arena, image.width, image.height);
+	memcpy(duplicate.pixels, image.pixels, image.width * image.height * sizeof(Color));
+
+	return duplicate;
+}
+
+static Image image_from_pixels(Color *pixels, int width, int height)
+{
+	Image image = {0};
+	image.width = width;
+	image.height = height;
+	image.clip = (Vec4)
+	{
+		.x = 0, .y = 0, .w = width, .h = height
+	};
+	image.pixels = pixels;
+	memset(image.pixels, 0, width * height * sizeof(Color));
+
+	return image;
+}
+
+Image new_image(int width, int height)
+{
+	Color *pixels = mem_alloc(width * height * sizeof(Color));
+	assert(pixels != NULL);
+	return image_from_pixels(pixels, width, height);
+}
+
+// The image is released by the next arena_reset, not by free_image
+Image new_image_arena(Arena *arena, int width, int height)
+{
+	Color *pixels = arena_alloc(arena, width * height * sizeof(Color));
+	return image_from_pixels(pixels, width, height);
+}
+
+static BMPChannel bmp_channel(uint32_t mask)
+{
+	BMPChannel channel = {.mask = mask};
+	if (mask == 0) return channel;
+
+	while (((mask >> channel.shift) & 1) == 0) channel.shift++;
+	while (channel.shift + channel.bits < 32 && ((mask >> (channel.shift + channel.bits)) & 1) != 0) channel.bits++;
+	return channel;
+}
+
+// Scales the bits of a channel to 0-255, missing channels are 0 and
+// a missing alpha is 255
+static uint8_t bmp_channel_value(BMPChannel channel, uint32_t pixel, uint8_t missing)
+{
+	if (channel.mask == 0) return missing;
+
+	uint32_t value = (pixel & channel.mask) >> channel.shift;
+	if (channel.bits >= 8) return value >> (channel.bits - 8);
+	return value * 255 / ((1u << channel.bits) - 1);
+}
+
+static void bmp_decode_masked(BMPDecode *decode, Color *dst, const uint8_t *src)
+{
+	const BMPChannel *channels = decode->channels;
+	int bytes_per_pixel = decode->bits_per_pixel / 8;
+	for (int x = 0; x < decode->image.width; ++x)
+	{
+		uint32_t pixel = 0;
+		memcpy(&pixel, src + x * bytes_per_pixel, bytes_per_pixel);
+		dst[x] = (Color)
+		{
+			.r = bmp_channel_value(channels[0], pixel, 0),
+			.g = bmp_channel_value(channels[1], pixel, 0),
+			.b = bmp_channel_value(channels[2], pixel, 0),
+			.a = bmp_channel_value(channels[3], pixel, 255),
+		};
+	}
+}
+
+// Indices are packed from the high bits of each byte
+static void bmp_decode_palette(BMPDecode *decode, Color *dst, const uint8_t *src)
+{
+	int width = decode->image.width;
+	if (decode->bits_per_pixel == 8)
+	{
+		for (int x = 0; x < width; ++x)
+			dst[x] = decode->palette[src[x]];
+		return;
+	}
+
+	int bits = decode->bits_per_pixel;
+	int per_byte = 8 / bits;
+	uint8_t mask = (1 << bits) - 1;
+	for (int x = 0; x < width; ++x)
+	{
+		int shift = 8 - bits * (x % per_byte + 1);
+		dst[x] = decode->palette[(src[x / per_byte] >> shift) & mask];
+	}
+}
+
+static void bmp_decode_rows(void *ctx, size_t begin, size_t end)
+{
+	BMPDecode *decode = ctx;
+	const SpanKernels *kernels = get_span_kernels();
+	int width = decode->image.width;
+	int height = decode->image.height;
+
+	for (size_t y = begin; y < end; ++y)
+	{
+		size_t row = decode->top_down ? y : height - 1 - y;
+		const uint8_t *src = decode->rows + row * decode->stride;
+		Color *dst = decode->image.pixels + y * width;
+
+		switch (decode->format)
+		{
+		case BMP_FORMAT_BGR:
+			kernels->swizzle_bgr_span(dst, src, width);
+			break;
+		case BMP_FORMAT_BGRA:
+			kernels->swizzle_bgra_span(dst, src, width, 0);
+			break;
+		case BMP_FORMAT_BGRX:
+			kernels->swizzle_bgra_span(dst, src, width, 0xFF000000);
+			break;
+		case BMP_FORMAT_PALETTE:
+			bmp_decode_palette(decode, dst, src);
+			break;
+		case BMP_FORMAT_MASKED:
+			bmp_decode_masked(decode, dst, src);
+			break;
+		}
+	}
+}
+
+static uint32_t bmp_read_u32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+#define BMP_ROWS_PER_TASK 32
+
+// The file is mapped and converted a row at a time straight into the
+// pixels of the image, rows are split over the thread pool
+void load_image_bmp(Image *image, const char *filename)
+{
+	FileMapping file;
+	if (!file_map(&file, filename))
+	{
+		fprintf(stderr, "ERROR: Failed to open file\n");
+		return;
+	}
+
+	BMPHeader header;
+	BMPInfoHeader info_header;
+	if (file.size < sizeof(BMPHeader) + sizeof(BMPInfoHeader))
+	{
+		fprintf(stderr, "ERROR: Invalid BMP file\n");
+		file_unmap(&file);
+		return;
+	}
+	memcpy(&header, file.data, sizeof(BMPHeader));
+	memcpy(&info_header, file.data + sizeof(BMPHeader), sizeof(BMPInfoHeader));
+
+	if (header.type != 0x4D42 || info_header.size < sizeof(BMPInfoHeader) ||
+	        info_header.width <= 0 || info_header.height == 0 || info_header.height == INT32_MIN)
+	{
+		fprintf(stderr, "ERROR: Invalid BMP file\n");
+		file_unmap(&file);
+		return;
+	}
+
+	uint32_t compression = info_header.compression;
+	bool bitfields = compression == BMP_BITFIELDS || compression == BMP_ALPHABITFIELDS;
+	if (compression != BMP_RGB && !bitfields)
+	{
+		fprintf(stderr, "ERROR: Compressed BMP files are not supported\n");
+		file_unmap(&file);
+		return;
+	}
+
+	BMPDecode decode = {0};
+	decode.image.width = info_header.width;
+	decode.image.height = info_header.height < 0 ? -info_header.height : info_header.height;
+	decode.top_down = info_header.height < 0;
+	decode.bits_per_pixel = info_header.bits_per_pixel;
+
+	fprintf(stderr, "INFO: Image size: %dx%d\n", decode.image.width, decode.image.height);
+	fprintf(stderr, "INFO: Bits per pixel: %d\n", decode.bits_per_pixel);
+
+	// Masks follow a plain info header and are part of the larger ones
+	size_t extra_offset = sizeof(BMPHeader) + sizeof(BMPInfoHeader);
+	size_t palette_offset = sizeof(BMPHeader) + info_header.size;
+	if (bitfields && info_header.size == sizeof(BMPInfoHeader))
+	{
+		palette_offset += compression == BMP_ALPHABITFIELDS ? 16 : 12;
+	}
+	if (palette_offset > file.size)
+	{
+		fprintf(stderr, "ERROR: Invalid BMP file\n");
+		file_unmap(&file);
+		return;
+	}
+
+	int bits = decode.bits_per_pixel;
+	if (bitfields && (bits == 16 || bits == 32))
+	{
+		bool has_alpha = compression == BMP_ALPHABITFIELDS || info_header.size >= 56;
+		for (int i = 0; i < (has_alpha ? 4 : 3); ++i)
+		{
+			decode.channels[i] = bmp_channel(bmp_read_u32(file.data + extra_offset + i * 4));
+		}
+
+		bool bgr = decode.channels[0].mask == 0x00FF0000 &&
+		           decode.channels[1].mask == 0x0000FF00 &&
+		           decode.channels[2].mask == 0x000000FF;
+		if (bits == 32 && bgr && decode.channels[3].mask == 0xFF000000)
+			decode.format = BMP_FORMAT_BGRA;
+		else if (bits == 32 && bgr && decode.channels[3].mask == 0)
+			decode.format = BMP_FORMAT_BGRX;
+		else
+			decode.format = BMP_FORMAT_MASKED;
+	}
+	else if (!bitfields && bits == 16)
+	{
+		// 5 bits per channel
+		decode.channels[0] = bmp_channel(0x7C00);
+		decode.channels[1] = bmp_channel(0x03E0);
+		decode.channels[2] = bmp_channel(0x001F);
+		decode.format = BMP_FORMAT_MASKED;
+	}
+	else if (!bitfields && bits == 24)
+	{
+		decode.format = BMP_FORMAT_BGR;
+	}
+	else if (!bitfields && bits == 32)
+	{
+		decode.format = BMP_FORMAT_BGRA;
+	}
+	else if (!bitfields && (bits == 1 || bits == 4 || bits == 8))
+	{
+		// Entries are stored as BGRX, indices past the palette are black
+		size_t count = info_header.colors_used != 0 ? info_header.colors_used : 1u << bits;
+		if (count > 256) count = 256;
+		if (count > (file.size - palette_offset) / 4) count = (file.size - palette_offset) / 4;
+
+		for (size_t i = 0; i < 256; ++i)
+			decode.palette[i] = COLOR_BLACK;
+		swizzle_bgra_span_scalar(decode.palette, file.data + palette_offset, count, 0xFF000000);
+		decode.format = BMP_FORMAT_PALETTE;
+	}
+	else
+	{
+		fprintf(stderr, "ERROR: Unsupported BMP format\n");
+		file_unmap(&file);
+		return;
+	}
+
+	// Rows are padded to 4 bytes, the last one may not be
+	decode.stride = (((size_t)decode.image.width * bits + 31) / 32) * 4;
+	size_t row_size = ((size_t)decode.image.width * bits + 7) / 8;
+	size_t pixels_size = decode.stride * (decode.image.height - 1) + row_size;
+	if (header.offset > file.size || file.size - header.offset < pixels_size)
+	{
+		fprintf(stderr, "ERROR: BMP file is truncated\n");
+		file_unmap(&file);
+		return;
+	}
+	decode.rows = file.data + header.offset;
+
+	decode.image.pixels = mem_alloc((size_t)decode.image.width * decode.image.height * sizeof(Color));
+	assert(decode.image.pixels != NULL);
+	parallel_for(0, decode.image.height, BMP_ROWS_PER_TASK, bmp_decode_rows, &decode);
+	file_unmap(&file);
+
+	image->width = decode.image.width;
+	image->height = decode.image.height;
+	image->clip = (Vec4)
+	{
+		.x = 0, .y = 0, .w = image->width, .h = image->height
+	};
+	image->pixels = decode.image.pixels;
+}
+
+void load_image(Image *image, const char *filename)
+{
+	fprintf(stderr, "INFO: Loading image: %s\n", filename);
+	const char *ext = filename + strlen(filename) - 4;
+	if (strcmp(ext, ".bmp") == 0)
+	{
+		load_image_bmp(image, filename);
+	}
+	else
+	{
+		fprintf(stderr, "Unsupported image format\n");
+	}
+}
+
+#define DRAW_IMAGE_CHUNK 256
+
+// Blends the crop of image scaled to rect
+static void draw_image_pixels(Image background, Image image, Vec4 rect, Vec4 crop_rect)
+{
+	const float sx = crop_rect.w / rect.w;
+	const float sy = crop_rect.h / rect.h;
+
+	// Only the destination pixels inside the clip are visited
+	int x0, y0, x1, y1;
+	if (!clip_bounds(background, rect, &x0, &y0, &x1, &y1)) return;
+
+	// Unscaled and pixel aligned, rows are blended as whole spans
+	const float ox = crop_rect.x - rect.x;
+	const float oy = crop_rect.y - rect.y;
+	if (sx == 1.0f && sy == 1.0f && ox == floorf(ox) && oy == floorf(oy))
+	{
+		const int dx = ox;
+		const int dy = oy;
+		const int xs = (x0 + dx < 0) ? -dx : x0;
+		const int xe = (x1 + dx > image.width) ? image.width - dx : x1;
+		if (xs >= xe) return;
+
+		for (int y = y0; y < y1; ++y)
+		{
+			const int iy = y + dy;
+			if (iy < 0 || iy >= image.height) continue;
+
+			layer_span(pixel_at(background, xs, y), &image.pixels[iy * image.width + xs + dx], xe - xs);
+		}
+		return;
+	}
+
+	// Nearest neighbour in 16.16 fixed point, sampled pixels are gathered
+	// into a small buffer and blended as spans. Positions step from the
+	// first pixel of the rect rather than of the clip so a pixel samples
+	// the same texel however the draw is clipped.
+	const int origin_x = floorf(rect.x);
+	const int origin_y = floorf(rect.y);
+	const int64_t step_x = (int64_t)(sx * 65536.0f);
+	const int64_t step_y = (int64_t)(sy * 65536.0f);
+	const int64_t start_x = (int64_t)(((origin_x - rect.x) * sx + crop_rect.x) * 65536.0f) + (x0 - origin_x) * step_x;
+	const int64_t start_y = (int64_t)(((origin_y - rect.y) * sy + crop_rect.y) * 65536.0f) + (y0 - origin_y) * step_y;
+
+	Color samples[DRAW_IMAGE_CHUNK];
+	for (int y = y0; y < y1; ++y)
+	{
+		const int iy = (start_y + (y - y0) * step_y) >> 16;
+		if (iy < 0 || iy >= image.height) continue;
+		const Color *row = image.pixels + iy * image.width;
+
+		int64_t fx = start_x;
+		int x = x0;
+		while (x < x1)
+		{
+			int n = 0;
+			int span_x = x;
+			for (; x < x1 && n < DRAW_IMAGE_CHUNK; ++x, fx += step_x)
+			{
+				const int ix = fx >> 16;
+				if (ix < 0 || ix >= image.width)
+				{
+					// Flushing so the span stays contiguous
+					if (n > 0) break;
+					span_x = x + 1;
+					continue;
+				}
+				samples[n++] = row[ix];
+			}
+			layer_span(pixel_at(background, span_x, y), samples, n);
+		}
+	}
+}
+
+void draw_image(Image background, Image image, Vec4 rect, Vec4 *crop)
+{
+	assert(image.pixels != NULL);
+
+	if (background.list != NULL)
+	{
+		record_command(background, (DrawCommand){
+			.kind = DRAW_IMAGE, .image = image, .rect = rect,
+			.crop = (crop != NULL) ? *crop : (Vec4){{0}}, .has_crop = crop != NULL
+		});
+		return;
+	}
+	assert(background.pixels != NULL);
+
+	Vec4 crop_rect;
+	if (crop != NULL)
+	{
+		crop_rect = *crop;
+	}
+	else
+	{
+		crop_rect = (Vec4)
+		{
+			.x = 0, .y = 0, .w = image.width, .h = image.height
+		};
+	}
+
+	ProfileScope scope = profile_begin(PROFILE_DRAW_IMAGE);
+	draw_image_pixels(background, image, rect, crop_rect);
+	profile_end(scope);
+}
+
+// Copies the pixels without blending, the top left corner of src lands
+// on position
+void copy_image(Image dst, Image src, Vec2 position)
+{
+	assert(src.pixels != NULL);
+
+	if (dst.list != NULL)
+	{
+		record_command(dst, (DrawCommand){
+			.kind = DRAW_COPY_IMAGE, .image = src, .position = position,
+			.rect = {.x = floorf(position.x), .y = floorf(position.y), .w = src.width, .h = src.height}
+		});
+		return;
+	}
+	assert(dst.pixels != NULL);
+
+	// Snapped once, clipping a fractional rect would round its two edges
+	// apart and copy a pixel more than a row has
+	const int ox = (int)floorf(position.x);
+	const int oy = (int)floorf(position.y);
+
+	int x0, y0, x1, y1;
+	Vec4 rect = {.x = ox, .y = oy, .w = src.width, .h = src.height};
+	if (!clip_bounds(dst, rect, &x0, &y0, &x1, &y1)) return;
+
+	ProfileScope scope = profile_begin(PROFILE_DRAW_IMAGE);
+	const int dx = x0 - ox;
+	const int dy = y0 - oy;
+	for (int y = y0; y < y1; ++y)
+	{
+		const Color *row = src.pixels + (y - y0 + dy) * src.width + dx;
+		memcpy(pixel_at(dst, x0, y), row, (x1 - x0) * sizeof(Color));
+	}
+	profile_end(scope);
+}
+
+Image begin_layer(Image image, Arena *arena)
+{
+	if (image.list != NULL)
+	{
+		record_command(image, (DrawCommand){.kind = DRAW_LAYER_BEGIN});
+		return image;
+	}
+
+	Image layer = new_image_arena(arena, image.clip.w, image.clip.h);
+	layer.x = image.clip.x;
+	layer.y = image.clip.y;
+	layer.clip = image.clip;
+	return layer;
+}
+
+void end_layer(Image image, Image layer, float opacity)
+{
+	// Recorded with the clip of the layer so it lands in the same tiles
+	// as the matching begin
+	if (layer.list != NULL)
+	{
+		record_command(layer, (DrawCommand){.kind = DRAW_LAYER_END, .value = opacity});
+		return;
+	}
+
+	fade_image(layer, opacity);
+	draw_image(image, layer, layer.clip, NULL);
+}
+
+void free_image(Image *image)
+{
+	mem_free(image->pixels);
+	image->pixels = NULL;
+}
+
+// Fixed size fields, the glyphs are used straight from the font cache
+typedef struct
+{
+	int32_t width;
+	int32_t height;
+	int32_t x_offset;
+	int32_t y_offset;
+	int32_t advance;
+	// First row of the glyph in the bitmaps of the font
+	uint32_t bitmap;
+} FontBDFGlyph;
+
+// Codepoints are looked up through pages of FONT_BDF_PAGE_SIZE entries,
+// pages without glyphs share the empty block 0
+#define FONT_BDF_PAGE_BITS 8
+#define FONT_BDF_PAGE_SIZE (1 << FONT_BDF_PAGE_BITS)
+#define FONT_BDF_MAX_CODEPOINT 0x10FFFF
+#define FONT_BDF_MAX_GLYPHS UINT16_MAX
+
+typedef struct
+{
+	int size;
+	int x_dpi;
+	int y_dpi;
+	// Glyph 0 is empty and stands for every missing codepoint
+	const FontBDFGlyph *glyphs;
+	uint32_t glyph_count;
+	// Block of every page below page_count
+	const uint16_t *pages;
+	uint32_t page_count;
+	// Glyph of every codepoint of a page
+	const uint16_t *blocks;
+	uint32_t block_count;
+	// Rows of every glyph bitmap
+	const uint64_t *bitmaps;
+	size_t row_count;
+	// The tables point into the cache when it is mapped, otherwise they
+	// are owned
+	FileMapping cache;
+} FontBDF;
+
+// The cache is written next to the font on the first load and mapped by
+// later ones, the parsed font is used in place. It is rebuilt when the
+// font changes or the version or a checksum does not match.
+#define FONT_CACHE_EXTENSION ".cache"
+// Written first and renamed to the cache once complete
+#define FONT_CACHE_TEMP_EXTENSION ".tmp"
+#define FONT_CACHE_PATH_MAX 1024
+#define FONT_CACHE_MAGIC 0x544E4645
+#define FONT_CACHE_VERSION 2
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	// Of the font the cache was made from
+	uint64_t source_size;
+	int64_t source_time;
+	int32_t size;
+	int32_t x_dpi;
+	int32_t y_dpi;
+	uint32_t glyph_count;
+	uint32_t page_count;
+	uint32_t block_count;
+	uint32_t row_count;
+	uint32_t glyphs_offset;
+	uint32_t pages_offset;
+	uint32_t blocks_offset;
+	uint32_t bitmaps_offset;
+	// Of the header up to this field and of the data after it
+	uint32_t header_checksum;
+	uint64_t data_checksum;
+} FontCacheHeader;
+
+static inline FontBDFGlyph font_bdf_glyph(const FontBDF *font_bdf, uint32_t codepoint)
+{
+	uint32_t page = codepoint >> FONT_BDF_PAGE_BITS;
+	if (page >= font_bdf->page_count) return font_bdf->glyphs[0];
+
+	uint32_t block = font_bdf->pages[page];
+	return font_bdf->glyphs[font_bdf->blocks[block * FONT_BDF_PAGE_SIZE + (codepoint & (FONT_BDF_PAGE_SIZE - 1))]];
+}
+
+// Value of a hex digit plus one, zero for anything else
+static const uint8_t bdf_hex_digits[256] =
+{
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+typedef struct
+{
+	const char *at;
+	const char *end;
+} BDFCursor;
+
+static bool bdf_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Returns the next line without its line break
+static bool bdf_next_line(BDFCursor *cursor, BDFCursor *line)
+{
+	if (cursor->at >= cursor->end) return false;
+
+	const char *newline = memchr(cursor->at, '\n', cursor->end - cursor->at);
+	line->at = cursor->at;
+	line->end = newline != NULL ? newline : cursor->end;
+	cursor->at = newline != NULL ? newline + 1 : cursor->end;
+	return true;
+}
+
+// Matches a keyword followed by a space or the end of the line
+static bool bdf_keyword(BDFCursor *line, const char *keyword, size_t length)
+{
+	if ((size_t)(line->end - line->at) < length || memcmp(line->at, keyword, length) != 0)
+		return false;
+	if (line->at + length < line->end && !bdf_is_space(line->at[length]))
+		return false;
+
+	line->at += length;
+	return true;
+}
+
+// Missing numbers read as zero
+static int bdf_int(BDFCursor *line)
+{
+	while (line->at < line->end && bdf_is_space(*line->at)) line->at++;
+
+	bool negative = line->at < line->end && *line->at == '-';
+	if (negative || (line->at < line->end && *line->at == '+')) line->at++;
+
+	int value = 0;
+	while (line->at < line->end && *line->at >= '0' && *line->at <= '9')
+	{
+		value = value * 10 + (*line->at - '0');
+		line->at++;
+	}
+	return negative ? -value : value;
+}
+
+static uint64_t bdf_hex(BDFCursor *line)
+{
+	uint64_t value = 0;
+	for (const char *c = line->at; c < line->end; ++c)
+	{
+		uint8_t digit = bdf_hex_digits[(unsigned char)*c];
+		if (digit == 0) break;
+		value = (value << 4) | (digit - 1);
+	}
+	return value;
+}
+
+#define BDF_KEYWORD(line, keyword) bdf_keyword(line, keyword, sizeof(keyword) - 1)
+
+// Parses the mapped file in a single pass. Rows of every glyph are
+// reserved in one block by its BBX and filled in by its BITMAP, the
+// codepoint tables are built once every glyph is known.
+static bool parse_font_bdf(FontBDF *font_bdf, const char *filename)
+{
+	FileMapping file;
+	if (!file_map(&file, filename))
+	{
+		fprintf(stderr, "ERROR: Failed to open file\n");
+		return false;
+	}
+
+	ARRAY(FontBDFGlyph) glyphs = {0};
+	ARRAY(uint32_t) codepoints = {0};
+	ARRAY(uint64_t) rows = {0};
+	array_append(&glyphs, (FontBDFGlyph){0});
+	array_append(&codepoints, 0);
+
+	BDFCursor cursor = {(const char *)file.data, (const char *)file.data + file.size};
+	BDFCursor line;
+	// Glyph of the current character, 0 when it is skipped
+	size_t glyph = 0;
+	bool bitmap = false;
+	// Rows past the BBX height are ignored, missing ones are left empty
+	size_t bitmap_row = 0;
+	size_t bitmap_end = 0;
+
+	while (bdf_next_line(&cursor, &line))
+	{
+		if (bitmap)
+		{
+			if (BDF_KEYWORD(&line, "ENDCHAR"))
+				bitmap = false;
+			else if (bitmap_row < bitmap_end)
+				rows.items[bitmap_row++] = bdf_hex(&line);
+			continue;
+		}
+
+		switch (line.at < line.end ? *line.at : 0)
+		{
+		case 'E':
+			if (BDF_KEYWORD(&line, "ENCODING"))
+			{
+				int code = bdf_int(&line);
+				glyph = 0;
+				if (code < 0 || code > FONT_BDF_MAX_CODEPOINT) break;
+
+				if (glyphs.length > FONT_BDF_MAX_GLYPHS)
+				{
+					fprintf(stderr, "ERROR: Font has more than %d glyphs\n", FONT_BDF_MAX_GLYPHS);
+					break;
+				}
+
+				glyph = glyphs.length;
+				array_append(&glyphs, (FontBDFGlyph){0});
+				array_append(&codepoints, code);
+			}
+			break;
+		case 'S':
+			if (BDF_KEYWORD(&line, "SIZE"))
+			{
+				font_bdf->size = bdf_int(&line);
+				font_bdf->x_dpi = bdf_int(&line);
+				font_bdf->y_dpi = bdf_int(&line);
+			}
+			break;
+		case 'B':
+			if (glyph == 0) break;
+
+			if (BDF_KEYWORD(&line, "BBX"))
+			{
+				FontBDFGlyph *g = &glyphs.items[glyph];
+				g->width = bdf_int(&line);
+				g->height = bdf_int(&line);
+				g->x_offset = bdf_int(&line);
+				g->y_offset = bdf_int(&line);
+				if (g->height < 0) g->height = 0;
+
+				g->bitmap = rows.length;
+				for (int i = 0; i < g->height; ++i)
+					array_append(&rows, 0);
+			}
+			else if (BDF_KEYWORD(&line, "BITMAP"))
+			{
+				bitmap = true;
+				bitmap_row = glyphs.items[glyph].bitmap;
+				bitmap_end = bitmap_row + glyphs.items[glyph].height;
+			}
+			break;
+		case 'D':
+			if (glyph == 0) break;
+
+			if (BDF_KEYWORD(&line, "DWIDTH"))
+			{
+				glyphs.items[glyph].advance = bdf_int(&line);
+			}
+			break;
+		}
+	}
+
+	file_unmap(&file);
+
+	uint32_t max_codepoint = 0;
+	for (size_t i = 1; i < codepoints.length; ++i)
+	{
+		if (codepoints.items[i] > max_codepoint) max_codepoint = codepoints.items[i];
+	}
+
+	// Pages only go up to the last one with a glyph, later codepoints
+	// are missing without a lookup
+	uint32_t page_count = codepoints.length > 1 ? (max_codepoint >> FONT_BDF_PAGE_BITS) + 1 : 0;
+	uint16_t *pages = mem_calloc(page_count > 0 ? page_count : 1, sizeof(uint16_t));
+	assert(pages != NULL);
+
+	ARRAY(uint16_t) blocks = {0};
+	for (int i = 0; i < FONT_BDF_PAGE_SIZE; ++i)
+		array_append(&blocks, 0);
+
+	// A later glyph for the same codepoint replaces the earlier one
+	for (size_t i = 1; i < codepoints.length; ++i)
+	{
+		uint32_t page = codepoints.items[i] >> FONT_BDF_PAGE_BITS;
+		if (pages[page] == 0)
+		{
+			pages[page] = blocks.length / FONT_BDF_PAGE_SIZE;
+			for (int j = 0; j < FONT_BDF_PAGE_SIZE; ++j)
+				array_append(&blocks, 0);
+		}
+		blocks.items[pages[page] * FONT_BDF_PAGE_SIZE + (codepoints.items[i] & (FONT_BDF_PAGE_SIZE - 1))] = i;
+	}
+	array_free(&codepoints);
+
+	font_bdf->glyphs = glyphs.items;
+	font_bdf->glyph_count = glyphs.length;
+	font_bdf->pages = pages;
+	font_bdf->page_count = page_count;
+	font_bdf->blocks = blocks.items;
+	font_bdf->block_count = blocks.length / FONT_BDF_PAGE_SIZE;
+	font_bdf->bitmaps = rows.items;
+	font_bdf->row_count = rows.length;
+	return true;
+}
+
+// FNV-1a over whole words, any single changed word changes the result
+static uint64_t font_cache_checksum(const void *data, size_t size)
+{
+	const uint8_t *bytes = data;
+	uint64_t hash = 0xCBF29CE484222325ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001B3ull;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+	return hash;
+}
+
+static bool font_cache_table_fits(uint64_t offset, uint64_t count, size_t item_size, size_t alignment, size_t size)
+{
+	return offset % alignment == 0 && offset + count * item_size <= size;
+}
+
+static bool load_font_cache(FontBDF *font_bdf, const char *cache_path, int64_t source_size, int64_t source_time)
+{
+	FileMapping cache;
+	if (!file_map(&cache, cache_path)) return false;
+
+	// The mapping is page aligned so the header and tables can be used
+	// where they are
+	const FontCacheHeader *header = (const FontCacheHeader *)cache.data;
+	bool valid = cache.size >= sizeof(FontCacheHeader) &&
+	             header->magic == FONT_CACHE_MAGIC &&
+	             header->version == FONT_CACHE_VERSION &&
+	             header->source_size == (uint64_t)source_size &&
+	             header->source_time == source_time &&
+	             header->header_checksum == (uint32_t)font_cache_checksum(header, offsetof(FontCacheHeader, header_checksum)) &&
+	             header->glyph_count > 0 && header->block_count > 0 &&
+	             font_cache_table_fits(header->glyphs_offset, header->glyph_count, sizeof(FontBDFGlyph), sizeof(uint32_t), cache.size) &&
+	             font_cache_table_fits(header->pages_offset, header->page_count, sizeof(uint16_t), sizeof(uint16_t), cache.size) &&
+	             font_cache_table_fits(header->blocks_offset, (uint64_t)header->block_count * FONT_BDF_PAGE_SIZE, sizeof(uint16_t), sizeof(uint16_t), cache.size) &&
+	             font_cache_table_fits(header->bitmaps_offset, header->row_count, sizeof(uint64_t), sizeof(uint64_t), cache.size) &&
+	             header->data_checksum == font_cache_checksum(header + 1, cache.size - sizeof(FontCacheHeader));
+	if (!valid)
+	{
+		file_unmap(&cache);
+		return false;
+	}
+
+	// Every index is checked once here so lookups never have to
+	const FontBDFGlyph *glyphs = (const FontBDFGlyph *)(cache.data + header->glyphs_offset);
+	const uint16_t *pages = (const uint16_t *)(cache.data + header->pages_offset);
+	const uint16_t *blocks = (const uint16_t *)(cache.data + header->blocks_offset);
+	for (uint32_t i = 0; i < header->glyph_count && valid; ++i)
+		valid = glyphs[i].height >= 0 && (uint64_t)glyphs[i].bitmap + glyphs[i].height <= header->row_count;
+	for (uint32_t i = 0; i < header->page_count && valid; ++i)
+		valid = pages[i] < header->block_count;
+	for (uint32_t i = 0; i < header->block_count * FONT_BDF_PAGE_SIZE && valid; ++i)
+		valid = blocks[i] < header->glyph_count;
+	if (!valid)
+	{
+		file_unmap(&cache);
+		return false;
+	}
+
+	font_bdf->size = header->size;
+	font_bdf->x_dpi = header->x_dpi;
+	font_bdf->y_dpi = header->y_dpi;
+	font_bdf->glyphs = glyphs;
+	font_bdf->glyph_count = header->glyph_count;
+	font_bdf->pages = pages;
+	font_bdf->page_count = header->page_count;
+	font_bdf->blocks = blocks;
+	font_bdf->block_count = header->block_count;
+	font_bdf->bitmaps = (const uint64_t *)(cache.data + header->bitmaps_offset);
+	font_bdf->row_count = header->row_count;
+	font_bdf->cache = cache;
+	return true;
+}
+
+// Tables are laid out one after the other, each aligned to its items
+static size_t font_cache_table(size_t *offset, size_t count, size_t item_size, size_t alignment)
+{
+	size_t start = (*offset + alignment - 1) / alignment * alignment;
+	*offset = start + count * item_size;
+	return start;
+}
+
+// Written to a temporary file first so a cache is never seen half written
+static void write_font_cache(const FontBDF *font_bdf, const char *cache_path, int64_t source_size, int64_t source_time)
+{
+	char temp_path[FONT_CACHE_PATH_MAX];
+	int temp_length = snprintf(temp_path, sizeof(temp_path), "%s" FONT_CACHE_TEMP_EXTENSION, cache_path);
+	if (temp_length < 0 || (size_t)temp_length >= sizeof(temp_path))
+	{
+		fprintf(stderr, "ERROR: Font cache path too long for %s\n", cache_path);
+		return;
+	}
+
+	size_t size = sizeof(FontCacheHeader);
+	size_t glyphs_offset = font_cache_table(&size, font_bdf->glyph_count, sizeof(FontBDFGlyph), sizeof(uint32_t));
+	size_t pages_offset = font_cache_table(&size, font_bdf->page_count, sizeof(uint16_t), sizeof(uint16_t));
+	size_t blocks_offset = font_cache_table(&size, font_bdf->block_count * FONT_BDF_PAGE_SIZE, sizeof(uint16_t), sizeof(uint16_t));
+	size_t bitmaps_offset = font_cache_table(&size, font_bdf->row_count, sizeof(uint64_t), sizeof(uint64_t));
+
+	uint8_t *data = mem_calloc(1, size);
+	assert(data != NULL);
+	FontCacheHeader *header = (FontCacheHeader *)data;
+	header->magic = FONT_CACHE_MAGIC;
+	header->version = FONT_CACHE_VERSION;
+	header->source_size = source_size;
+	header->source_time = source_time;
+	header->size = font_bdf->size;
+	header->x_dpi = font_bdf->x_dpi;
+	header->y_dpi = font_bdf->y_dpi;
+	header->glyph_count = font_bdf->glyph_count;
+	header->page_count = font_bdf->page_count;
+	header->block_count = font_bdf->block_count;
+	header->row_count = font_bdf->row_count;
+	header->glyphs_offset = glyphs_offset;
+	header->pages_offset = pages_offset;
+	header->blocks_offset = blocks_offset;
+	header->bitmaps_offset = bitmaps_offset;
+	memcpy(data + glyphs_offset, font_bdf->glyphs, font_bdf->glyph_count * sizeof(FontBDFGlyph));
+	if (font_bdf->page_count > 0)
+		memcpy(data + pages_offset, font_bdf->pages, font_bdf->page_count * sizeof(uint16_t));
+	memcpy(data + blocks_offset, font_bdf->blocks, font_bdf->block_count * FONT_BDF_PAGE_SIZE * sizeof(uint16_t));
+	if (font_bdf->row_count > 0)
+		memcpy(data + bitmaps_offset, font_bdf->bitmaps, font_bdf->row_count * sizeof(uint64_t));
+	header->header_checksum = (uint32_t)font_cache_checksum(header, offsetof(FontCacheHeader, header_checksum));
+	header->data_checksum = font_cache_checksum(header + 1, size - sizeof(FontCacheHeader));
+
+	FILE *file = fopen(temp_path, "wb");
+	bool ok = file != NULL;
+	if (ok)
+	{
+		ok = fwrite(data, size, 1, file) == 1;
+		ok = fclose(file) == 0 && ok;
+		ok = ok && file_rename(temp_path, (char *)cache_path);
+		if (!ok) remove(temp_path);
+	}
+	mem_free(data);
+
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: Failed to write font cache %s\n", cache_path);
+	}
+}
+
+void load_font_bdf(Font *font, const char *filename)
+{
+	uint64_t start = time_ns();
+
+	int64_t source_size = get_file_size(filename);
+	int64_t source_time = get_file_mod_time(filename);
+	if (source_size < 0)
+	{
+		fprintf(stderr, "ERROR: Failed to open file\n");
+		return;
+	}
+
+	// Fonts with paths too long for the cache are parsed every time
+	char cache_path[FONT_CACHE_PATH_MAX];
+	int cache_length = snprintf(cache_path, sizeof(cache_path), "%s" FONT_CACHE_EXTENSION, filename);
+	bool use_cache = cache_length >= 0 && (size_t)cache_length < sizeof(cache_path);
+
+	FontBDF *font_bdf = mem_calloc(1, sizeof(FontBDF));
+	assert(font_bdf != NULL);
+
+	if (use_cache && load_font_cache(font_bdf, cache_path, source_size, source_time))
+	{
+		fprintf(stderr, "INFO: Loaded font cache %s in %.3f ms\n", cache_path, (time_ns() - start) / 1000000.0);
+	}
+	else if (parse_font_bdf(font_bdf, filename))
+	{
+		fprintf(stderr, "INFO: Parsed font in %.3f ms\n", (time_ns() - start) / 1000000.0);
+		if (use_cache) write_font_cache(font_bdf, cache_path, source_size, source_time);
+	}
+	else
+	{
+		mem_free(font_bdf);
+		return;
+	}
+
+	font->format = FONT_BDF;
+	font->data = font_bdf;
+}
+
+void load_font(Font *font, const char *filename)
+{
+	fprintf(stderr, "INFO: Loading font: %s\n", filename);
+	const char *ext = filename + strlen(filename) - 4;
+	if (strcmp(ext, ".bdf") == 0)
+	{
+		load_font_bdf(font, filename);
+	}
+	else
+	{
+		fprintf(stderr, "Unsupported font format\n");
+	}
+}
+
+Vec2 measure_text_bdf(Font font, const char* text, int size)
+{
+	assert(font.data != NULL);
+
+	FontBDF *font_bdf = (FontBDF *)font.data;
+
+	float scaling = (float)size / (float)font_bdf->size;
+
+	int width = 0;
+	int height = 0;
+
+	for (const char *c = text; *c != '\0';)
+	{
+		FontBDFGlyph glyph = font_bdf_glyph(font_bdf, utf8_next(&c));
+
+		width += glyph.advance * scaling + size/10.0f;
+		height = fmaxf(height, glyph.height * scaling);
+	}
+
+	return (Vec2)
+	{
+		.x=width, .y=height
+	};
+
+}
+
+Vec2 measure_text(Font font, const char* text, int size)
+{
+	switch (font.format)
+	{
+		case FONT_BDF:
+			return measure_text_bdf(font, text, size);
+		default:
+			fprintf(stderr, "ERROR: Unsupported font format\n");
+			break;
+	}
+
+	return (Vec2)
+	{
+		.x=0, .y=0
+	};
+}
+
+float glyph_advance(Font font, uint32_t codepoint, int size)
+{
+	switch (font.format)
+	{
+		case FONT_BDF:
+		{
+			const FontBDF *font_bdf = (const FontBDF *)font.data;
+			return font_bdf_glyph(font_bdf, codepoint).advance * ((float)size / (float)font_bdf->size);
+		}
+		default:
+			fprintf(stderr, "ERROR: Unsupported font format\n");
+			break;
+	}
+	return 0.0f;
+}
+
+#define GLYPH_ATLAS_SIZE 1024
+#define GLYPH_CACHE_ENTRIES 4096
+#define GLYPH_CACHE_TABLE_SIZE (GLYPH_CACHE_ENTRIES * 2)
+#define GLYPH_CACHE_MAX_SHELVES 256
+#define GLYPH_SAMPLES 3
+
+typedef struct
+{
+	const void *font;
+	int codepoint;
+	int size;
+	int shelf;
+	int x;
+	int y;
+	int width;
 	int height;
-	int x_offset;
-	int y_offset;
-	int advance;
-	uint64_t *bitmap;
-} FontBDFGlyph;
+} GlyphCacheEntry;
+
+// Glyphs are packed left to right into horizontal shelves of the atlas,
+// a whole shelf is evicted at once when space runs out
+typedef struct
+{
+	int y;
+	int height;
+	int cursor;
+	uint64_t last_used;
+	// Entries placed on the shelf, only shelves with some are evicted
+	int entry_count;
+} GlyphCacheShelf;
+
+typedef struct
+{
+	uint8_t *atlas;
+	GlyphCacheEntry entries[GLYPH_CACHE_ENTRIES];
+	int entry_count;
+	// Open addressing table of entry index + 1, zero is empty
+	int table[GLYPH_CACHE_TABLE_SIZE];
+	GlyphCacheShelf shelves[GLYPH_CACHE_MAX_SHELVES];
+	int shelf_count;
+	uint64_t clock;
+	GlyphCacheStats stats;
+} GlyphCache;
+
+static GlyphCache glyph_cache = {0};
+
+// Changes whenever a cached glyph may have moved. Starts from the clock
+// when the atlas is made so layouts kept across a hot reload never match
+// the cache of the new library.
+static uint64_t glyph_cache_generation = 0;
+
+static uint32_t glyph_cache_hash(const void *font, int codepoint, int size)
+{
+	uint64_t h = (uint64_t)(uintptr_t)font;
+	h ^= (uint64_t)codepoint * 0x9E3779B97F4A7C15ull;
+	h ^= (uint64_t)size * 0xC2B2AE3D27D4EB4Full;
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 32;
+	return (uint32_t)h & (GLYPH_CACHE_TABLE_SIZE - 1);
+}
+
+static void glyph_cache_insert(int index)
+{
+	GlyphCacheEntry *entry = &glyph_cache.entries[index];
+	uint32_t slot = glyph_cache_hash(entry->font, entry->codepoint, entry->size);
+	while (glyph_cache.table[slot] != 0)
+		slot = (slot + 1) & (GLYPH_CACHE_TABLE_SIZE - 1);
+	glyph_cache.table[slot] = index + 1;
+}
+
+static GlyphCacheEntry *glyph_cache_find(const void *font, int codepoint, int size)
+{
+	uint32_t slot = glyph_cache_hash(font, codepoint, size);
+	while (glyph_cache.table[slot] != 0)
+	{
+		GlyphCacheEntry *entry = &glyph_cache.entries[glyph_cache.table[slot] - 1];
+		if (entry->font == font && entry->codepoint == codepoint && entry->size == size)
+			return entry;
+		slot = (slot + 1) & (GLYPH_CACHE_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
+
+// Drops every entry matching the predicate, entries are compacted and
+// the table rebuilt since eviction is rare compared to lookups. Shelves
+// left without entries are reused from the start.
+static void glyph_cache_remove(int shelf, const void *font)
+{
+	for (int i = 0; i < glyph_cache.shelf_count; ++i)
+		glyph_cache.shelves[i].entry_count = 0;
+
+	int count = 0;
+	for (int i = 0; i < glyph_cache.entry_count; ++i)
+	{
+		GlyphCacheEntry entry = glyph_cache.entries[i];
+		bool remove = (shelf >= 0 && entry.shelf == shelf) || (font != NULL && entry.font == font);
+		if (!remove)
+		{
+			glyph_cache.entries[count++] = entry;
+			glyph_cache.shelves[entry.shelf].entry_count++;
+		}
+	}
+	glyph_cache.entry_count = count;
+	glyph_cache_generation++;
+
+	for (int i = 0; i < glyph_cache.shelf_count; ++i)
+	{
+		if (glyph_cache.shelves[i].entry_count == 0)
+			glyph_cache.shelves[i].cursor = 0;
+	}
+
+	memset(glyph_cache.table, 0, sizeof(glyph_cache.table));
+	for (int i = 0; i < glyph_cache.entry_count; ++i)
+		glyph_cache_insert(i);
+}
+
+static void glyph_cache_evict_shelf(int shelf)
+{
+	glyph_cache_remove(shelf, NULL);
+	glyph_cache.shelves[shelf].cursor = 0;
+	glyph_cache.stats.evictions++;
+}
+
+// Finds room for a width x height mask, returns the shelf or -1
+static int glyph_cache_reserve(int width, int height)
+{
+	// Best fitting shelf that still has room
+	int best = -1;
+	for (int i = 0; i < glyph_cache.shelf_count; ++i)
+	{
+		GlyphCacheShelf *shelf = &glyph_cache.shelves[i];
+		if (shelf->height < height || shelf->height > height * 3 / 2 + 1) continue;
+		if (shelf->cursor + width > GLYPH_ATLAS_SIZE) continue;
+		if (best < 0 || shelf->height < glyph_cache.shelves[best].height)
+			best = i;
+	}
+	if (best >= 0) return best;
+
+	int used = 0;
+	if (glyph_cache.shelf_count > 0)
+	{
+		GlyphCacheShelf last = glyph_cache.shelves[glyph_cache.shelf_count - 1];
+		used = last.y + last.height;
+	}
+
+	if (used + height <= GLYPH_ATLAS_SIZE && glyph_cache.shelf_count < GLYPH_CACHE_MAX_SHELVES)
+	{
+		GlyphCacheShelf *shelf = &glyph_cache.shelves[glyph_cache.shelf_count];
+		shelf->y = used;
+		shelf->height = height;
+		shelf->cursor = 0;
+		shelf->entry_count = 0;
+		return glyph_cache.shelf_count++;
+	}
+
+	// Atlas is full, the least recently used shelf tall enough is reused
+	int lru = -1;
+	for (int i = 0; i < glyph_cache.shelf_count; ++i)
+	{
+		GlyphCacheShelf *shelf = &glyph_cache.shelves[i];
+		if (shelf->height < height) continue;
+		if (lru < 0 || shelf->last_used < glyph_cache.shelves[lru].last_used)
+			lru = i;
+	}
+
+	if (lru >= 0)
+		glyph_cache_evict_shelf(lru);
+	return lru;
+}
+
+// Supersamples the 1-bit glyph into an 8-bit coverage mask
+static void rasterize_glyph_bdf(const FontBDF *font_bdf, FontBDFGlyph glyph, float scaling, uint8_t *mask, int stride, int width, int height)
+{
+	const uint64_t *bitmap = font_bdf->bitmaps + glyph.bitmap;
+
+	// Bitmap rows are padded to whole bytes
+	int row_bits = (glyph.width + 7) / 8 * 8;
+
+	for (int gy = 0; gy < height; ++gy)
+	{
+		for (int gx = 0; gx < width; ++gx)
+		{
+			int coverage = 0;
+			for (int sy = 0; sy < GLYPH_SAMPLES; ++sy)
+			{
+				for (int sx = 0; sx < GLYPH_SAMPLES; ++sx)
+				{
+					float sample_y = ((float)gy + (float)sy / GLYPH_SAMPLES) / scaling;
+					float sample_x = ((float)gx + (float)sx / GLYPH_SAMPLES) / scaling;
+
+					int row = (int)sample_y;
+					int col = (int)sample_x;
+
+					if (row >= 0 && row < glyph.height && col >= 0 && col < glyph.width)
+					{
+						uint64_t bit = (uint64_t)1 << (row_bits - col - 1);
+
+						if (bitmap[row] & bit)
+							coverage++;
+					}
+				}
+			}
+
+			mask[gy * stride + gx] = coverage * 255 / (GLYPH_SAMPLES * GLYPH_SAMPLES);
+		}
+	}
+}
+
+static GlyphCacheEntry *glyph_cache_get_bdf(const FontBDF *font_bdf, int codepoint, int size)
+{
+	glyph_cache.clock++;
+
+	GlyphCacheEntry *entry = glyph_cache_find(font_bdf, codepoint, size);
+	if (entry != NULL)
+	{
+		glyph_cache.stats.hits++;
+		glyph_cache.shelves[entry->shelf].last_used = glyph_cache.clock;
+		return entry;
+	}
+	glyph_cache.stats.misses++;
+
+	if (glyph_cache.atlas == NULL)
+	{
+		glyph_cache.atlas = mem_alloc(GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE);
+		assert(glyph_cache.atlas != NULL);
+		glyph_cache_generation = time_ns();
+	}
+
+	FontBDFGlyph glyph = font_bdf_glyph(font_bdf, codepoint);
+	float scaling = (float)size / (float)font_bdf->size;
+	int width = glyph.width * scaling;
+	int height = glyph.height * scaling;
+	if (width > GLYPH_ATLAS_SIZE || height > GLYPH_ATLAS_SIZE) return NULL;
+
+	// A full cache has entries on some shelf, evicting the least recently
+	// used of those frees at least one
+	if (glyph_cache.entry_count == GLYPH_CACHE_ENTRIES)
+	{
+		int lru = -1;
+		for (int i = 0; i < glyph_cache.shelf_count; ++i)
+		{
+			GlyphCacheShelf *shelf = &glyph_cache.shelves[i];
+			if (shelf->entry_count == 0) continue;
+			if (lru < 0 || shelf->last_used < glyph_cache.shelves[lru].last_used)
+				lru = i;
+		}
+		assert(lru >= 0);
+		glyph_cache_evict_shelf(lru);
+	}
+
+	int shelf_index = glyph_cache_reserve(width, height);
+	if (shelf_index < 0) return NULL;
+
+	GlyphCacheShelf *shelf = &glyph_cache.shelves[shelf_index];
+	int index = glyph_cache.entry_count++;
+	entry = &glyph_cache.entries[index];
+	entry->font = font_bdf;
+	entry->codepoint = codepoint;
+	entry->size = size;
+	entry->shelf = shelf_index;
+	entry->x = shelf->cursor;
+	entry->y = shelf->y;
+	entry->width = width;
+	entry->height = height;
+
+	shelf->cursor += width;
+	shelf->last_used = glyph_cache.clock;
+	shelf->entry_count++;
+	glyph_cache_insert(index);
+
+	uint8_t *mask = glyph_cache.atlas + entry->y * GLYPH_ATLAS_SIZE + entry->x;
+	rasterize_glyph_bdf(font_bdf, glyph, scaling, mask, GLYPH_ATLAS_SIZE, width, height);
+	return entry;
+}
+
+GlyphCacheStats glyph_cache_stats(void)
+{
+	GlyphCacheStats stats = glyph_cache.stats;
+	stats.glyphs = glyph_cache.entry_count;
+	stats.memory = sizeof(glyph_cache);
+	if (glyph_cache.atlas != NULL)
+		stats.memory += GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE;
+	return stats;
+}
+
+void glyph_cache_clear(void)
+{
+	mem_free(glyph_cache.atlas);
+	memset(&glyph_cache, 0, sizeof(glyph_cache));
+	glyph_cache_generation++;
+}
+
+// Blends a width x height coverage mask with its top left corner at x, y
+static void draw_glyph_mask(Image image, const uint8_t *glyph_mask, int stride, int width, int height, int x, int y, Color color)
+{
+	int x0, y0, x1, y1;
+	Vec4 rect = {.x = x, .y = y, .w = width, .h = height};
+	if (!clip_bounds(image, rect, &x0, &y0, &x1, &y1)) return;
+
+	const SpanKernels *kernels = get_span_kernels();
+	for (int py = y0; py < y1; ++py)
+	{
+		const uint8_t *mask = glyph_mask + (py - y) * stride + (x0 - x);
+		kernels->layer_span_mask(pixel_at(image, x0, py), color, mask, x1 - x0);
+	}
+}
+
+// Rasterizes every glyph of the text into the cache ahead of drawing it
+// from several threads, returns the rect covered by the glyphs
+static Vec4 cache_text_bdf(Font font, const char *text, int size, Vec2 position)
+{
+	FontBDF *font_bdf = (FontBDF *)font.data;
+	float scaling = (float)size / (float)font_bdf->size;
+
+	// Same stepping as draw_text_bdf so the bounds are exact
+	int x = position.x;
+	int y = position.y;
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+	for (const char *c = text; *c != '\0';)
+	{
+		uint32_t code = utf8_next(&c);
+		FontBDFGlyph glyph = font_bdf_glyph(font_bdf, code);
+		int width = glyph.width * scaling;
+		int height = glyph.height * scaling;
+		if (width > 0 && height > 0)
+		{
+			int gx = x + (int)(glyph.x_offset * scaling);
+			int gy = y + (int)(glyph.y_offset * scaling);
+			x0 = (gx < x0) ? gx : x0;
+			y0 = (gy < y0) ? gy : y0;
+			x1 = (gx + width > x1) ? gx + width : x1;
+			y1 = (gy + height > y1) ? gy + height : y1;
+			glyph_cache_get_bdf(font_bdf, code, size);
+		}
+
+		x += glyph.advance * scaling;
+	}
+
+	if (x0 >= x1) return (Vec4){{0}};
+	return (Vec4){.x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0};
+}
+
+// Layers and uncached glyphs of a tile are allocated from the arena of the
+// thread drawing it, which is reset for every tile
+static Arena tile_scratch[THREAD_POOL_MAX_THREADS] = {0};
+
+// Shared drawing only reads the cache so tiles can draw text in parallel,
+// glyphs missing from it are rasterized on the spot without being stored
+static void draw_glyph_bdf(Image image, const FontBDF *font_bdf, uint32_t code, int size, int x, int y, Color text_color, bool shared)
+{
+	GlyphCacheEntry *entry = shared ? glyph_cache_find(font_bdf, code, size) : glyph_cache_get_bdf(font_bdf, code, size);
+	if (entry != NULL)
+	{
+		const uint8_t *mask = glyph_cache.atlas + entry->y * GLYPH_ATLAS_SIZE + entry->x;
+		draw_glyph_mask(image, mask, GLYPH_ATLAS_SIZE, entry->width, entry->height, x, y, text_color);
+		return;
+	}
+
+	// Evicted since it was cached or too large for the atlas
+	FontBDFGlyph glyph = font_bdf_glyph(font_bdf, code);
+	float scaling = (float)size / (float)font_bdf->size;
+	int width = glyph.width * scaling;
+	int height = glyph.height * scaling;
+	// Shared drawing only happens from tiles, whose arena keeps the pool
+	// threads from allocating
+	size_t mask_size = (size_t)width * height;
+	uint8_t *mask = shared ? arena_alloc(&tile_scratch[thread_pool_thread_index()], mask_size) : mem_alloc(mask_size);
+	assert(mask != NULL);
+	rasterize_glyph_bdf(font_bdf, glyph, scaling, mask, width, width, height);
+	draw_glyph_mask(image, mask, width, width, height, x, y, text_color);
+	if (!shared) mem_free(mask);
+}
+
+void draw_text_bdf(Image image, Font font, const char *text, int size, Vec2 position, Color text_color, bool shared)
+{
+	assert(font.data != NULL);
+
+	FontBDF *font_bdf = (FontBDF *)font.data;
+	int x = position.x;
+	int y = position.y;
+
+	float scaling = (float)size / (float)font_bdf->size;
+
+	for (const char *c = text; *c != '\0';)
+	{
+		uint32_t code = utf8_next(&c);
+		FontBDFGlyph glyph = font_bdf_glyph(font_bdf, code);
+
+		int x_offset = glyph.x_offset * scaling;
+		int y_offset = glyph.y_offset * scaling;
+		bool empty = (int)(glyph.width * scaling) <= 0 || (int)(glyph.height * scaling) <= 0;
+
+		// Glyphs outside the clip are not even looked up
+		Vec4 rect = {.x = x + x_offset, .y = y + y_offset, .w = (int)(glyph.width * scaling), .h = (int)(glyph.height * scaling)};
+		if (!empty && !clip_is_empty(clip_image(image, rect)))
+		{
+			draw_glyph_bdf(image, font_bdf, code, size, x + x_offset, y + y_offset, text_color, shared);
+		}
+
+		x += glyph.advance * scaling;
+	}
+}
+
+static void draw_text_font(Image image, Font font, const char *text, int size, Vec2 position, Color text_color, bool shared)
+{
+	ProfileScope scope = profile_begin(PROFILE_DRAW_TEXT);
+	switch (font.format)
+	{
+		case FONT_BDF:
+			draw_text_bdf(image, font, text, size, position, text_color, shared);
+			break;
+		default:
+			fprintf(stderr, "ERROR: Unsupported font format\n");
+			break;
+	}
+	profile_end(scope);
+}
 
-#define FONT_BDF_GLYPH_COUNT 128
-typedef struct
+void draw_text(Image image, Font font, const char *text, int size, Vec2 position, Color text_color)
 {
-	int size;
-	int x_dpi;
-	int y_dpi;
-	FontBDFGlyph glyphs[FONT_BDF_GLYPH_COUNT];
-} FontBDF;
+	assert(font.data != NULL);
 
-void load_font_bdf(Font *font, const char *filename)
-{
-	FILE *file = fopen(filename, "r");
-	if (file == NULL)
+	if (image.list == NULL)
 	{
-		fprintf(stderr, "ERROR: Failed to open file\n");
+		draw_text_font(image, font, text, size, position, text_color, false);
 		return;
 	}
 
-	font->format = FONT_BDF;
-	font->data = malloc(sizeof(FontBDF));
-	memset(font->data, 0, sizeof(FontBDF));
+	if (clip_is_empty(image)) return;
 
-	FontBDF *font_bdf = (FontBDF *)font->data;
+	Vec4 bounds;
+	switch (font.format)
+	{
+		case FONT_BDF:
+			bounds = cache_text_bdf(font, text, size, position);
+			break;
+		default:
+			fprintf(stderr, "ERROR: Unsupported font format\n");
+			return;
+	}
+	if (clip_is_empty(clip_image(image, bounds))) return;
+
+	// The caller's string may not outlive the frame
+	size_t length = strlen(text) + 1;
+	char *copy = arena_alloc(image.list->arena, length);
+	memcpy(copy, text, length);
+	record_command(image, (DrawCommand){
+		.kind = DRAW_TEXT, .font = font, .text = copy, .size = size,
+		.rect = bounds, .position = position, .color = text_color
+	});
+}
 
-	char line[256];
-	int code = 0;
-	int i = 0;
-	bool bitmap = false;
+// FNV-1a, draw commands are hashed field by field so padding never counts
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+#define hash_field(hash, field) hash_bytes((hash), &(field), sizeof(field))
 
-	while (fgets(line, sizeof(line), file))
+// Same stepping as draw_text_bdf and measure_text_bdf
+static void layout_text_bdf(TextLayout *layout, const char *text)
+{
+	FontBDF *font_bdf = (FontBDF *)layout->font.data;
+	int size = layout->size;
+	float scaling = (float)size / (float)font_bdf->size;
+
+	int x = 0;
+	int extent_width = 0;
+	int extent_height = 0;
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+	for (const char *c = text; *c != '\0';)
 	{
-		if (strncmp(line, "ENCODING", 8) == 0)
-		{
-			code = 0;
-			sscanf(line, "ENCODING %d", &code);
-		}
-		else if (strncmp(line, "SIZE", 4) == 0)
+		uint32_t code = utf8_next(&c);
+		FontBDFGlyph glyph = font_bdf_glyph(font_bdf, code);
+
+		extent_width += glyph.advance * scaling + size/10.0f;
+		extent_height = fmaxf(extent_height, glyph.height * scaling);
+
+		int width = glyph.width * scaling;
+		int height = glyph.height * scaling;
+		if (width > 0 && height > 0)
 		{
-			int size, x_dpi, y_dpi;
-			sscanf(line, "SIZE %d %d %d", &size, &x_dpi, &y_dpi);
-			font_bdf->size = size;
-			font_bdf->x_dpi = x_dpi;
-			font_bdf->y_dpi = y_dpi;
+			TextLayoutGlyph g = {
+				.codepoint = code,
+				.x = x + (int)(glyph.x_offset * scaling),
+				.y = (int)(glyph.y_offset * scaling),
+				.width = width,
+				.height = height,
+				.atlas_x = -1,
+				.atlas_y = -1,
+			};
+			array_append(&layout->glyphs, g);
+
+			x0 = (g.x < x0) ? g.x : x0;
+			y0 = (g.y < y0) ? g.y : y0;
+			x1 = (g.x + width > x1) ? g.x + width : x1;
+			y1 = (g.y + height > y1) ? g.y + height : y1;
 		}
-		else
-		{
-			if (code < 0 || code >= FONT_BDF_GLYPH_COUNT)
-				continue;
 
-			if (strncmp(line, "BBX", 3) == 0)
-			{
-				int width, height, x_offset, y_offset;
-				sscanf(line, "BBX %d %d %d %d", &width, &height, &x_offset, &y_offset);
-				font_bdf->glyphs[code].width = width;
-				font_bdf->glyphs[code].height = height;
-				font_bdf->glyphs[code].x_offset = x_offset;
-				font_bdf->glyphs[code].y_offset = y_offset;
-			}
-			else if (strncmp(line, "BITMAP", 6) == 0)
-			{
-				bitmap = true;
-				i = 0;
+		x += glyph.advance * scaling;
+	}
 
-				size_t bitmap_size = font_bdf->glyphs[code].height * sizeof(uint64_t);
-				font_bdf->glyphs[code].bitmap = malloc(bitmap_size);
-				memset(font_bdf->glyphs[code].bitmap, 0, bitmap_size);
-			}
-			else if (strncmp(line, "DWIDTH", 6) == 0)
-			{
-				int advance;
-				sscanf(line, "DWIDTH %d", &advance);
-				font_bdf->glyphs[code].advance = advance;
-			}
-			else if (strncmp(line, "ENDCHAR", 7) == 0)
-			{
-				bitmap = false;
-			}
-			else if (bitmap)
-			{
-				uint64_t row;
-				sscanf(line, "%llx", &row);
+	layout->extent = (Vec2){.x = extent_width, .y = extent_height};
+	if (x0 < x1)
+		layout->bounds = (Vec4){.x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0};
+}
 
-				font_bdf->glyphs[code].bitmap[i] = row;
-				i++;
-			}
-		}
-	}
+uint64_t text_layout_hash(Font font, const char *text, size_t length, int size)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	hash = hash_field(hash, font.data);
+	hash = hash_field(hash, size);
+	return hash_bytes(hash, text, length);
 }
 
-void load_font(Font *font, const char *filename)
+void layout_text(TextLayout *layout, Font font, const char *text, int size)
 {
-	fprintf(stderr, "INFO: Loading font: %s\n", filename);
-	const char *ext = filename + strlen(filename) - 4;
-	if (strcmp(ext, ".bdf") == 0)
-	{
-		load_font_bdf(font, filename);
-	}
-	else
+	assert(font.data != NULL);
+
+	layout->font = font;
+	layout->size = size;
+	layout->glyphs.length = 0;
+	layout->extent = (Vec2){{0}};
+	layout->bounds = (Vec4){{0}};
+	layout->atlas_generation = 0;
+
+	layout->hash = text_layout_hash(font, text, strlen(text), size);
+
+	switch (font.format)
 	{
-		fprintf(stderr, "Unsupported font format\n");
+		case FONT_BDF:
+			layout_text_bdf(layout, text);
+			break;
+		default:
+			fprintf(stderr, "ERROR: Unsupported font format\n");
+			break;
 	}
 }
 
-Vec2 measure_text_bdf(Font font, const char* text, int size)
+static bool text_layout_cached(const TextLayout *layout)
 {
-	assert(font.data != NULL);
+	return glyph_cache.atlas != NULL && layout->atlas_generation == glyph_cache_generation;
+}
 
-	FontBDF *font_bdf = (FontBDF *)font.data;
-	int n = strlen(text);
+// Looks up the atlas place of every glyph once. Caching a glyph can
+// evict an earlier one of the same layout, the places are only kept when
+// a pass finishes without the cache changing.
+static void cache_text_layout(TextLayout *layout)
+{
+	if (text_layout_cached(layout)) return;
 
-	float scaling = (float)size / (float)font_bdf->size;
+	const FontBDF *font_bdf = (const FontBDF *)layout->font.data;
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		uint64_t generation = glyph_cache_generation;
+		for (size_t i = 0; i < layout->glyphs.length; ++i)
+		{
+			TextLayoutGlyph *g = &layout->glyphs.items[i];
+			GlyphCacheEntry *entry = glyph_cache_get_bdf(font_bdf, g->codepoint, layout->size);
+			g->atlas_x = entry != NULL ? entry->x : -1;
+			g->atlas_y = entry != NULL ? entry->y : -1;
+		}
 
-	int width = 0;
-	int height = 0;
+		if (generation == glyph_cache_generation && glyph_cache.atlas != NULL)
+		{
+			layout->atlas_generation = generation;
+			return;
+		}
+	}
+	layout->atlas_generation = 0;
+}
 
-	for (int i = 0; i < n; ++i)
+static void draw_text_layout_glyphs(Image image, const TextLayout *layout, Vec2 position, Color text_color, bool shared)
+{
+	ProfileScope scope = profile_begin(PROFILE_DRAW_TEXT);
+	const FontBDF *font_bdf = (const FontBDF *)layout->font.data;
+	int x = position.x;
+	int y = position.y;
+
+	for (size_t i = 0; i < layout->glyphs.length; ++i)
 	{
-		char ch = text[i];
-		FontBDFGlyph glyph = font_bdf->glyphs[(int)ch];
+		const TextLayoutGlyph *g = &layout->glyphs.items[i];
+		Vec4 rect = {.x = x + g->x, .y = y + g->y, .w = g->width, .h = g->height};
+		if (clip_is_empty(clip_image(image, rect))) continue;
 
-		width += glyph.advance * scaling + size/10.0f;
-		height = fmaxf(height, glyph.height * scaling);
+		// Drawing a glyph that is not cached can evict the others
+		if (g->atlas_x >= 0 && text_layout_cached(layout))
+		{
+			const uint8_t *mask = glyph_cache.atlas + g->atlas_y * GLYPH_ATLAS_SIZE + g->atlas_x;
+			draw_glyph_mask(image, mask, GLYPH_ATLAS_SIZE, g->width, g->height, rect.x, rect.y, text_color);
+		}
+		else
+		{
+			draw_glyph_bdf(image, font_bdf, g->codepoint, layout->size, rect.x, rect.y, text_color, shared);
+		}
 	}
+	profile_end(scope);
+}
 
-	return (Vec2)
+void draw_text_layout(Image image, TextLayout *layout, Vec2 position, Color text_color)
+{
+	assert(layout->font.data != NULL);
+
+	if (image.list == NULL)
 	{
-		.x=width, .y=height
-	};
+		draw_text_layout_glyphs(image, layout, position, text_color, false);
+		return;
+	}
 
+	if (clip_is_empty(image) || layout->glyphs.length == 0) return;
+
+	Vec4 bounds = layout->bounds;
+	bounds.x += (int)position.x;
+	bounds.y += (int)position.y;
+	if (clip_is_empty(clip_image(image, bounds))) return;
+
+	cache_text_layout(layout);
+	record_command(image, (DrawCommand){
+		.kind = DRAW_TEXT, .font = layout->font, .layout = layout, .size = layout->size,
+		.rect = bounds, .position = position, .color = text_color
+	});
 }
 
-Vec2 measure_text(Font font, const char* text, int size)
+void free_text_layout(TextLayout *layout)
 {
-	switch (font.format)
+	array_free(&layout->glyphs);
+}
+
+void free_font_bdf(Font *font)
+{
+	FontBDF *font_bdf = (FontBDF *)font->data;
+	glyph_cache_remove(-1, font_bdf);
+	if (font_bdf->cache.data != NULL)
+	{
+		file_unmap(&font_bdf->cache);
+	}
+	else
+	{
+		mem_free((void *)font_bdf->glyphs);
+		mem_free((void *)font_bdf->pages);
+		mem_free((void *)font_bdf->blocks);
+		mem_free((void *)font_bdf->bitmaps);
+	}
+	mem_free(font->data);
+	font->data = NULL;
+}
+
+void free_font(Font *font)
+{
+	switch (font->format)
 	{
 		case FONT_BDF:
-			return measure_text_bdf(font, text, size);
+			free_font_bdf(font);
+			break;
 		default:
 			fprintf(stderr, "ERROR: Unsupported font format\n");
 			break;
 	}
-
-	return (Vec2)
-	{
-		.x=0, .y=0
-	};
 }
 
-void draw_text_bdf(Image image, Font font, const char *text, int size, Vec2 position, Color text_color)
+#define TILE_SIZE 64
+#define LAYER_STACK_MAX 32
+
+Image begin_draw_list(DrawList *list, Image image, Arena *arena)
 {
-	assert(font.data != NULL);
+	assert(list != NULL);
+	assert(arena != NULL);
+	assert(image.list == NULL);
 
-	FontBDF *font_bdf = (FontBDF *)font.data;
-	int x = position.x;
-	int y = position.y;
+	list->commands.length = 0;
+	list->target = image;
+	list->arena = arena;
 
-	int n = strlen(text);
+	image.list = list;
+	return image;
+}
 
-	float scaling = (float)size / (float)font_bdf->size;
-	static int samples = 3;
+// Pixel bounds a command can touch, exclusive right and bottom edges
+static bool command_bounds(DrawList *list, DrawCommand *command, int *x0, int *y0, int *x1, int *y1)
+{
+	Image image = list->target;
+	image.clip = command->clip;
 
-	for (int i = 0; i < n; ++i)
+	switch (command->kind)
 	{
-		char ch = text[i];
-		FontBDFGlyph glyph = font_bdf->glyphs[(int)ch];
+		case DRAW_RECT:
+		case DRAW_ROUNDED_RECT:
+		case DRAW_IMAGE:
+		case DRAW_COPY_IMAGE:
+		case DRAW_TEXT:
+			return clip_bounds(image, command->rect, x0, y0, x1, y1);
+		default:
+			return clip_bounds(image, image.clip, x0, y0, x1, y1);
+	}
+}
 
-		int width = glyph.width * scaling;
-		int height = glyph.height * scaling;
+// Sorts the command indices by tile, counted first so every bin is a
+// slice of one array allocated from the frame arena
+static void bin_draw_list(DrawList *list)
+{
+	Vec4 clip = list->target.clip;
+	list->tiles_x = ((int)clip.w + TILE_SIZE - 1) / TILE_SIZE;
+	list->tiles_y = ((int)clip.h + TILE_SIZE - 1) / TILE_SIZE;
+	const int tile_count = list->tiles_x * list->tiles_y;
 
-		int x_offset = glyph.x_offset * scaling;
-		int y_offset = glyph.y_offset * scaling;
+	list->bin_start = arena_alloc(list->arena, (tile_count + 1) * sizeof(int));
+	memset(list->bin_start, 0, (tile_count + 1) * sizeof(int));
 
-		for (int gy = 0; gy < height; ++gy)
+	size_t total = 0;
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		for (size_t i = 0; i < list->commands.length; ++i)
 		{
-			for (int gx = 0; gx < width; ++gx)
+			int x0, y0, x1, y1;
+			if (!command_bounds(list, &list->commands.items[i], &x0, &y0, &x1, &y1)) continue;
+
+			const int tx0 = (x0 - (int)clip.x) / TILE_SIZE;
+			const int ty0 = (y0 - (int)clip.y) / TILE_SIZE;
+			const int tx1 = (x1 - 1 - (int)clip.x) / TILE_SIZE;
+			const int ty1 = (y1 - 1 - (int)clip.y) / TILE_SIZE;
+			for (int ty = ty0; ty <= ty1; ++ty)
 			{
-				int coverage = 0;
-				for (int sy = 0; sy < samples; ++sy)
+				for (int tx = tx0; tx <= tx1; ++tx)
 				{
-					for (int sx = 0; sx < samples; ++sx)
-					{
-						float sample_y = ((float)gy + (float)sy / samples) / scaling;
-						float sample_x = ((float)gx + (float)sx / samples) / scaling;
-
-						int row = (int)sample_y;
-						int col = (int)sample_x;
-
-						if (row >= 0 && row < glyph.height && col >= 0 && col < glyph.width)
-						{
-							uint64_t mask = 1 << (16 - col - 1);
-
-							if (glyph.bitmap[row] & mask)
-								coverage++;
-						}
-					}
+					const int tile = ty * list->tiles_x + tx;
+					if (pass == 0)
+						list->bin_start[tile + 1]++;
+					else
+						list->bin_commands[list->bin_start[tile]++] = i;
 				}
-
-				float coverage_ratio = (float)coverage / (samples * samples);
-				Color base = get_pixel(image, x + gx + x_offset, y + gy + y_offset);
-				Color color = mix_color(base, text_color, coverage_ratio);
-				put_pixel(image, x + gx + x_offset, y + gy + y_offset, color);
 			}
 		}
 
-		x += glyph.advance * scaling;
+		if (pass == 0)
+		{
+			for (int t = 0; t < tile_count; ++t)
+				list->bin_start[t + 1] += list->bin_start[t];
+			total = list->bin_start[tile_count];
+			list->bin_commands = arena_alloc(list->arena, (total + 1) * sizeof(int));
+		}
 	}
+
+	// Filling advanced every start to the start of the next bin
+	for (int t = tile_count; t > 0; --t)
+		list->bin_start[t] = list->bin_start[t - 1];
+	list->bin_start[0] = 0;
 }
 
-void draw_text(Image image, Font font, const char *text, int size, Vec2 position, Color text_color)
+static void draw_command(Image image, DrawCommand *command)
 {
-	switch (font.format)
+	switch (command->kind)
 	{
-		case FONT_BDF:
-			draw_text_bdf(image, font, text, size, position, text_color);
+		case DRAW_CLEAR:
+			clear_image(image, command->color);
+			break;
+		case DRAW_RECT:
+			draw_rect(image, command->rect, command->color);
+			break;
+		case DRAW_ROUNDED_RECT:
+			draw_rounded_rect(image, command->rect, command->color, command->value);
+			break;
+		case DRAW_CURVE:
+			draw_curve(image, command->curve, command->color);
+			break;
+		case DRAW_IMAGE:
+			draw_image(image, command->image, command->rect, command->has_crop ? &command->crop : NULL);
+			break;
+		case DRAW_COPY_IMAGE:
+			copy_image(image, command->image, command->position);
+			break;
+		case DRAW_TEXT:
+			if (command->layout != NULL)
+				draw_text_layout_glyphs(image, command->layout, command->position, command->color, true);
+			else
+				draw_text_font(image, command->font, command->text, command->size, command->position, command->color, true);
 			break;
 		default:
-			fprintf(stderr, "ERROR: Unsupported font format\n");
+			unreachable();
 			break;
 	}
 }
 
-void free_font_bdf(Font *font)
+// Replays the commands of one tile, layers are only as large as their
+// overlap with the tile and come from the scratch arena of the thread
+static void draw_tile(DrawList *list, int tile, Arena *scratch)
 {
-	FontBDF *font_bdf = (FontBDF *)font->data;
-	for (int i = 0; i < FONT_BDF_GLYPH_COUNT; ++i)
+	arena_reset(scratch);
+
+	Image image = list->target;
+	image.list = NULL;
+	image = clip_image(image, (Vec4){
+		.x = image.clip.x + (tile % list->tiles_x) * TILE_SIZE,
+		.y = image.clip.y + (tile / list->tiles_x) * TILE_SIZE,
+		.w = TILE_SIZE,
+		.h = TILE_SIZE,
+	});
+
+	Image layers[LAYER_STACK_MAX];
+	int depth = 0;
+	layers[0] = image;
+
+	for (int i = list->bin_start[tile]; i < list->bin_start[tile + 1]; ++i)
 	{
-		free(font_bdf->glyphs[i].bitmap);
+		DrawCommand *command = &list->commands.items[list->bin_commands[i]];
+		Image target = clip_image(layers[depth], command->clip);
+
+		if (command->kind == DRAW_LAYER_BEGIN)
+		{
+			assert(depth + 1 < LAYER_STACK_MAX);
+			layers[++depth] = clip_is_empty(target) ? target : begin_layer(target, scratch);
+		}
+		else if (command->kind == DRAW_LAYER_END)
+		{
+			assert(depth > 0);
+			Image layer = layers[depth--];
+			if (!clip_is_empty(layer))
+				end_layer(layers[depth], layer, command->value);
+		}
+		else
+		{
+			draw_command(target, command);
+		}
 	}
-	free(font->data);
-	font->data = NULL;
+	assert(depth == 0);
 }
 
-void free_font(Font *font)
+static uint64_t hash_command(DrawCommand *command)
 {
-	switch (font->format)
+	uint64_t hash = 0xCBF29CE484222325ull;
+	hash = hash_field(hash, command->kind);
+	hash = hash_field(hash, command->clip);
+	hash = hash_field(hash, command->rect);
+	hash = hash_field(hash, command->position);
+	hash = hash_field(hash, command->color);
+	hash = hash_field(hash, command->value);
+	hash = hash_field(hash, command->curve);
+	hash = hash_field(hash, command->image.pixels);
+	hash = hash_field(hash, command->image.width);
+	hash = hash_field(hash, command->image.height);
+	hash = hash_field(hash, command->image.x);
+	hash = hash_field(hash, command->image.y);
+	hash = hash_field(hash, command->crop);
+	hash = hash_field(hash, command->has_crop);
+	hash = hash_field(hash, command->font.data);
+	hash = hash_field(hash, command->size);
+	if (command->text != NULL)
+		hash = hash_bytes(hash, command->text, strlen(command->text));
+	if (command->layout != NULL)
+		hash = hash_field(hash, command->layout->hash);
+	return hash;
+}
+
+void invalidate_draw_list(DrawList *list)
+{
+	list->history_count = 0;
+}
+
+// Tiles in a row are joined into runs, a run with the same span as one
+// in the row above extends it
+static void add_damage(DrawList *list, EnvRect rect)
+{
+	for (int i = 0; i < list->damage_count; ++i)
 	{
-		case FONT_BDF:
-			free_font_bdf(font);
-			break;
-		default:
-			fprintf(stderr, "ERROR: Unsupported font format\n");
-			break;
+		EnvRect *damage = &list->damage[i];
+		if (damage->x == rect.x && damage->width == rect.width && damage->y + damage->height == rect.y)
+		{
+			damage->height += rect.height;
+			return;
+		}
+	}
+
+	if (list->damage_count < ENV_MAX_DAMAGE)
+	{
+		list->damage[list->damage_count++] = rect;
+		return;
+	}
+
+	// Out of rects, the last one grows to cover the new one
+	EnvRect *last = &list->damage[ENV_MAX_DAMAGE - 1];
+	int x0 = (rect.x < last->x) ? rect.x : last->x;
+	int y0 = (rect.y < last->y) ? rect.y : last->y;
+	int x1 = (rect.x + rect.width > last->x + last->width) ? rect.x + rect.width : last->x + last->width;
+	int y1 = (rect.y + rect.height > last->y + last->height) ? rect.y + rect.height : last->y + last->height;
+	*last = (EnvRect){.x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0};
+}
+
+// Compares the commands of every tile with the previous frame, returns
+// the tiles to draw for a buffer presented buffer_age frames ago
+static int find_dirty_tiles(DrawList *list, int buffer_age, int *tiles)
+{
+	const int tile_count = list->tiles_x * list->tiles_y;
+	const Vec4 clip = list->target.clip;
+
+	uint64_t *command_hashes = arena_alloc(list->arena, (list->commands.length + 1) * sizeof(uint64_t));
+	for (size_t i = 0; i < list->commands.length; ++i)
+		command_hashes[i] = hash_command(&list->commands.items[i]);
+
+	list->frame++;
+	bool reset = list->history_count != tile_count || memcmp(&list->history_clip, &clip, sizeof(clip)) != 0;
+	if (reset)
+	{
+		list->tile_hashes = mem_realloc(list->tile_hashes, tile_count * sizeof(uint64_t));
+		list->tile_changed = mem_realloc(list->tile_changed, tile_count * sizeof(uint64_t));
+		assert(list->tile_hashes != NULL && list->tile_changed != NULL);
+		list->history_count = tile_count;
+		list->history_clip = clip;
+	}
+
+	list->damage_count = 0;
+	int dirty_count = 0;
+	for (int tile = 0; tile < tile_count; ++tile)
+	{
+		uint64_t hash = 0xCBF29CE484222325ull;
+		for (int i = list->bin_start[tile]; i < list->bin_start[tile + 1]; ++i)
+			hash = hash_field(hash, command_hashes[list->bin_commands[i]]);
+
+		if (reset || hash != list->tile_hashes[tile])
+		{
+			list->tile_hashes[tile] = hash;
+			list->tile_changed[tile] = list->frame;
+		}
+
+		if (buffer_age <= 0 || list->frame - list->tile_changed[tile] < (uint64_t)buffer_age)
+			tiles[dirty_count++] = tile;
+	}
+
+	if (reset)
+	{
+		add_damage(list, (EnvRect){.x = clip.x, .y = clip.y, .width = clip.w, .height = clip.h});
+		return dirty_count;
+	}
+
+	for (int ty = 0; ty < list->tiles_y; ++ty)
+	{
+		int tx = 0;
+		while (tx < list->tiles_x)
+		{
+			if (list->tile_changed[ty * list->tiles_x + tx] != list->frame)
+			{
+				tx++;
+				continue;
+			}
+
+			int run = tx;
+			while (tx < list->tiles_x && list->tile_changed[ty * list->tiles_x + tx] == list->frame)
+				tx++;
+
+			EnvRect rect = {
+				.x = clip.x + run * TILE_SIZE,
+				.y = clip.y + ty * TILE_SIZE,
+				.width = (tx - run) * TILE_SIZE,
+				.height = TILE_SIZE,
+			};
+			if (rect.x + rect.width > clip.x + clip.w) rect.width = clip.x + clip.w - rect.x;
+			if (rect.y + rect.height > clip.y + clip.h) rect.height = clip.y + clip.h - rect.y;
+			add_damage(list, rect);
+		}
+	}
+	return dirty_count;
+}
+
+typedef struct
+{
+	DrawList *list;
+	int *tiles;
+} TileJob;
+
+static void draw_tiles(void *ctx, size_t begin, size_t end)
+{
+	TileJob *job = (TileJob *)ctx;
+	Arena *scratch = &tile_scratch[thread_pool_thread_index()];
+	for (size_t i = begin; i < end; ++i)
+	{
+		draw_tile(job->list, job->tiles[i], scratch);
+	}
+}
+
+void end_draw_list(DrawList *list, int buffer_age)
+{
+	assert(list != NULL);
+	list->damage_count = 0;
+	if (clip_is_empty(list->target)) return;
+
+	ProfileScope scope = profile_begin(PROFILE_RASTERIZE);
+	bin_draw_list(list);
+
+	TileJob job = {.list = list};
+	job.tiles = arena_alloc(list->arena, list->tiles_x * list->tiles_y * sizeof(int));
+	int dirty_count = find_dirty_tiles(list, buffer_age, job.tiles);
+	parallel_for(0, dirty_count, 1, draw_tiles, &job);
+	profile_end(scope);
+}
+
+void free_tile_scratch(void)
+{
+	for (int i = 0; i < THREAD_POOL_MAX_THREADS; ++i)
+	{
+		arena_free(&tile_scratch[i]);
 	}
 }
+
+void free_draw_list(DrawList *list)
+{
+	array_free(&list->commands);
+	mem_free(list->tile_hashes);
+	mem_free(list->tile_changed);
+	list->tile_hashes = NULL;
+	list->tile_changed = NULL;
+	list->history_count = 0;
+	list->bin_start = NULL;
+	list->bin_commands = NULL;
+}
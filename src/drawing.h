@@ -39,6 +39,11 @@ typedef union
 #define COLOR_PURPLE  (Color){.rgba = 0xFF00FF00}
 #define COLOR_YELLOW  (Color){.rgba = 0xFFFF00FF}
 
+Color layer_color(Color bottom, Color top);
+void fill_span(Color *dst, Color color, size_t n);
+void layer_span(Color *dst, const Color *src, size_t n);
+void layer_span_color(Color *dst, Color color, size_t n);
+
 typedef union
 {
 	PACK(struct
@@ -72,11 +77,23 @@ Vec4 v4_add_v4(Vec4 a, Vec4 b);
 Vec4 v4_add_v2(Vec4 a, Vec2 b);
 Vec2 v2_add_v2(Vec2 a, Vec2 b);
 
+typedef struct DrawList DrawList;
+
 typedef struct
 {
 	int width;
 	int height;
 	Color *pixels;
+
+	// Drawing coordinates of the first pixel, non zero for layers
+	int x;
+	int y;
+
+	// Drawing is restricted to this rect, always pixel aligned
+	Vec4 clip;
+
+	// When set draw calls are recorded into the list instead of drawn
+	DrawList *list;
 } Image;
 
 float lerp(float a, float b, float t);
@@ -86,15 +103,29 @@ bool inside_rect(Vec2 p, Vec4 r);
 Image image_from_env(Env* env);
 Env env_from_image(Image image);
 
-void blur_image(Image image);
+Image clip_image(Image image, Vec4 rect);
+bool clip_is_empty(Image image);
+
+void blur_image(Image image, int radius);
 void fade_image(Image image, float opacity);
 Image scale_image(Image image, float sx, float sy);
 Image duplicate_image(Image image);
 
 Image new_image(int width, int height);
+
+Image new_image_arena(Arena *arena, int width, int height);
+Image duplicate_image_arena(Arena *arena, Image image);
+Image scale_image_arena(Arena *arena, Image image, float sx, float sy);
+void blur_image_arena(Arena *arena, Image image, int radius);
 void load_image(Image *image, const char *filename);
 
+// Transparent layer covering the clip of the image, end_layer fades it
+// and blends it back
+Image begin_layer(Image image, Arena *arena);
+void end_layer(Image image, Image layer, float opacity);
+
 void draw_image(Image background, Image image, Vec4 rect, Vec4 *crop);
+void copy_image(Image dst, Image src, Vec2 position);
 void free_image(Image* image);
 void clear_image(Image image, Color color);
 
@@ -128,5 +159,138 @@ typedef struct
 
 void load_font(Font *font, const char *filename);
 Vec2 measure_text(Font font, const char* text, int size);
+// How far draw_text moves right after the glyph
+float glyph_advance(Font font, uint32_t codepoint, int size);
 void draw_text(Image image,  Font font, const char *text, int size, Vec2 position, Color text_color);
 void free_font(Font *font);
+
+typedef struct
+{
+	uint32_t codepoint;
+	// Top left corner relative to the origin of the text
+	int x;
+	int y;
+	int width;
+	int height;
+	// Place in the glyph atlas, -1 when it did not fit
+	int atlas_x;
+	int atlas_y;
+} TextLayoutGlyph;
+
+// Glyph positions of a string, laid out once and drawn any number of
+// times. The layout keeps no pointer to the text.
+typedef struct
+{
+	Font font;
+	int size;
+	// Only the glyphs with pixels
+	ARRAY(TextLayoutGlyph) glyphs;
+	// Same as measure_text
+	Vec2 extent;
+	// Pixels covered by the glyphs relative to the origin
+	Vec4 bounds;
+	// Of the font, size and text, draw lists hash it instead of the text
+	uint64_t hash;
+	// The atlas places are valid while this matches the glyph cache
+	uint64_t atlas_generation;
+} TextLayout;
+
+// Reuses the memory of the layout, laying out text no longer than
+// before does not allocate
+void layout_text(TextLayout *layout, Font font, const char *text, int size);
+// Hash the layout of length bytes of text would get, tells whether a
+// layout is still up to date without laying the text out
+uint64_t text_layout_hash(Font font, const char *text, size_t length, int size);
+// A recorded layout must not change until the draw list is rasterized
+void draw_text_layout(Image image, TextLayout *layout, Vec2 position, Color text_color);
+void free_text_layout(TextLayout *layout);
+
+typedef struct
+{
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t glyphs;
+	size_t memory;
+} GlyphCacheStats;
+
+GlyphCacheStats glyph_cache_stats(void);
+void glyph_cache_clear(void);
+
+typedef enum
+{
+	DRAW_CLEAR,
+	DRAW_RECT,
+	DRAW_ROUNDED_RECT,
+	DRAW_CURVE,
+	DRAW_IMAGE,
+	DRAW_COPY_IMAGE,
+	DRAW_TEXT,
+	DRAW_LAYER_BEGIN,
+	DRAW_LAYER_END,
+} DrawCommandKind;
+
+typedef struct
+{
+	DrawCommandKind kind;
+	// Clip of the target image when the command was recorded
+	Vec4 clip;
+	// Pixels the command can touch, also the destination of images
+	Vec4 rect;
+	// Origin of text and copied images
+	Vec2 position;
+	Color color;
+	// Border radius of rounded rects, opacity of layers
+	float value;
+	BezierCurve curve;
+	Image image;
+	Vec4 crop;
+	bool has_crop;
+	Font font;
+	const char *text;
+	// Drawn instead of the text when set
+	const TextLayout *layout;
+	int size;
+} DrawCommand;
+
+typedef ARRAY(DrawCommand) DrawCommands;
+
+// Draw calls recorded for a frame, rasterized in screen tiles on the
+// thread pool. Every tile replays the commands touching it in order so
+// the result matches drawing them directly.
+struct DrawList
+{
+	DrawCommands commands;
+	Image target;
+	// Text and tile bins live here until the owner resets the arena
+	Arena *arena;
+
+	int tiles_x;
+	int tiles_y;
+	// Commands of tile i are bin_commands[bin_start[i]..bin_start[i+1]]
+	int *bin_start;
+	int *bin_commands;
+
+	// Hash of the commands of every tile and the frame it last changed
+	// in, kept between frames to skip tiles that would come out the same
+	uint64_t frame;
+	Vec4 history_clip;
+	int history_count;
+	uint64_t *tile_hashes;
+	uint64_t *tile_changed;
+
+	// Regions that changed in the last frame, in tile sized steps
+	EnvRect damage[ENV_MAX_DAMAGE];
+	int damage_count;
+};
+
+Image begin_draw_list(DrawList *list, Image image, Arena *arena);
+// Only tiles that changed within the last buffer_age frames are drawn,
+// the contents of images are assumed to stay the same while their
+// pixels do not move
+void end_draw_list(DrawList *list, int buffer_age);
+// Forgets the previous frames so the next one is drawn in full
+void invalidate_draw_list(DrawList *list);
+void free_draw_list(DrawList *list);
+// Memory kept between frames by the threads drawing tiles
+void free_tile_scratch(void);
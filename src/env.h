@@ -5,13 +5,33 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#define ENV_MAX_DAMAGE 32
+
+typedef struct
+{
+	int x;
+	int y;
+	int width;
+	int height;
+} EnvRect;
+
 typedef struct
 {
 	double delta_time;
+	// Set by the platform, seconds spent presenting the previous frame
+	double present_time;
 	int width;
 	int height;
 	uint8_t *buffer;
 
+	// Set by the platform, how many frames ago the buffer was last
+	// presented. Zero when its contents are unknown, like a new buffer.
+	int buffer_age;
+
+	// Set by the app, the regions of the buffer that changed this frame
+	EnvRect damage[ENV_MAX_DAMAGE];
+	int damage_count;
+
 	size_t key_code;
 	bool key_down;
 
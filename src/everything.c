@@ -3,17 +3,38 @@
 #include "basic.h"
 #include "drawing.h"
 #include "hotreload.h"
+#include "profiler.h"
 #include "views.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Frames after startup or a resize that may allocate, a later frame that
+// allocates ends the program. Unset disables the check.
+#define ALLOC_WARMUP_ENV "EVERYTHING_ALLOC_WARMUP"
+#define NOTE_PATH "assets/note.txt"
+
 typedef struct
 {
 	Image background_image;
+	// Background already scaled to the window and flattened on white
+	Image scaled_background;
 	Font font;
 	View* view;
+	NoteView* note_view;
+	Arena frame_arena;
+	DrawList draw_list;
+	// Toggled with a right click
+	bool show_profiler;
+	bool mouse_right_was_down;
+	// Where the last frame ended and the last hot reload started, in
+	// time_ns() time
+	uint64_t frame_end_ns;
+	uint64_t reload_start_ns;
+	// Negative when allocations are not checked
+	int alloc_warmup;
+	int frames_since_resize;
 	int width;
 	int height;
 } AppState;
@@ -22,13 +43,55 @@ AppState *state = NULL;
 
 export void app_load(void)
 {
-	state = malloc(sizeof(AppState));
+	state = mem_alloc(sizeof(AppState));
 	memset(state, 0, sizeof(AppState));
 
 	load_image(&state->background_image, "assets/sample3.bmp");
 	load_font(&state->font, "assets/spleen-16x32.bdf");
+
+	const char *trace_path = getenv(PROFILE_TRACE_ENV);
+	if (trace_path != NULL)
+	{
+		profile_trace_start(trace_path, false);
+	}
+
+	const char *alloc_warmup = getenv(ALLOC_WARMUP_ENV);
+	state->alloc_warmup = (alloc_warmup != NULL) ? atoi(alloc_warmup) : -1;
+}
+
+// The parts of the layout that follow the window size
+static Vec4 list_rect(int width, int height)
+{
+	return (Vec4){.x = 0, .y = 0, .w = width/3, .h = height};
+}
+
+static Vec4 note_rect(int width, int height)
+{
+	return (Vec4){.x = width/3 + 20, .y = 20, .w = width/3, .h = height - 40};
 }
 
+// Panels are inset from the list, their text spans the whole list
+#define PANEL_INSET 30
+
+// Keeps the views and their state, scrolled panels keep their position
+// and the note reflows to its new width when drawn
+static void resize_views(int width, int height)
+{
+	Vec4 list = list_rect(width, height);
+	state->view->rect = list;
+	for (size_t i = 0; i < state->view->children.length; i++)
+	{
+		View* panel = state->view->children.items[i];
+		panel->rect.w = list.w - PANEL_INSET;
+		for (size_t j = 0; j < panel->children.length; j++)
+		{
+			panel->children.items[j]->rect.w = list.w;
+		}
+	}
+	state->note_view->base.rect = note_rect(width, height);
+}
+
+// Builds the view tree, later size changes only go through resize_views
 export void app_init(Env* env)
 {
 	state->width = env->width;
@@ -38,15 +101,14 @@ export void app_init(Env* env)
 	{
 		destroy_view(state->view);
 	}
+	if (state->note_view != NULL)
+	{
+		destroy_view((View*)state->note_view);
+	}
 	
 	ScrollView* scroll_view = new_scroll_view(&(ScrollViewArgs){
 		.base = (ViewArgs){
-			.rect = (Vec4) {
-				.x = 0,
-				.y = 0,
-				.w = env->width/3,
-				.h = env->height,
-			},
+			.rect = list_rect(env->width, env->height),
 		},
 		.axis = DIRECTION_VERTICAL,
 	});
@@ -58,7 +120,7 @@ export void app_init(Env* env)
 				.rect = (Vec4) {
 					.x = 10,
 					.y = 60*i + 20,
-					.w = env->width/3-30,
+					.w = env->width/3 - PANEL_INSET,
 					.h = 50,
 				},
 			},
@@ -86,34 +148,139 @@ export void app_init(Env* env)
 		array_append(&scroll_view->base.children, (View*)panel_view);
 	}
 	state->view = (View*)scroll_view;
+
+	state->note_view = new_note_view(&(NoteViewArgs){
+		.base = (ViewArgs){
+			.rect = note_rect(env->width, env->height),
+		},
+		.font = state->font,
+		.text_size = 16,
+		.text_color = COLOR_BLACK,
+	});
+
+	// The note stays empty when the file is missing
+	FileMapping note = {0};
+	if (file_map(&note, NOTE_PATH))
+	{
+		note_view_edit(state->note_view, 0, 0, (const char *)note.data, note.size);
+		file_unmap(&note);
+	}
+	else
+	{
+		fprintf(stderr, "ERROR: Failed to open %s\n", NOTE_PATH);
+	}
 }
 
-export void app_update(Env *env)
+void update_scaled_background(int width, int height)
 {
+	if (state->scaled_background.width == width && state->scaled_background.height == height)
+		return;
+
+	free_image(&state->scaled_background);
+	state->scaled_background = new_image(width, height);
+	clear_image(state->scaled_background, COLOR_WHITE);
+
+	// Plain white when the image failed to load
+	if (state->background_image.pixels == NULL)
+		return;
+
+	Image scaled = scale_image(state->background_image,
+		(float)width / state->background_image.width,
+		(float)height / state->background_image.height);
+
+	draw_image(state->scaled_background, scaled, (Vec4){
+		.x = 0,
+		.y = 0,
+		.w = width,
+		.h = height,
+	}, NULL);
+	free_image(&scaled);
+}
+
+// Returns true while another frame is needed without new input
+export bool app_update(Env *env)
+{
+	ProfileScope frame_scope = profile_begin(PROFILE_FRAME);
+	AllocStats allocs_before = alloc_stats();
+
+	// The platform presents right after the last frame returned
+	if (state->frame_end_ns != 0)
+	{
+		profile_add_at(PROFILE_PRESENT, state->frame_end_ns, env->present_time * 1e9);
+	}
+
+	if (env->mouse_right_down && !state->mouse_right_was_down)
+	{
+		state->show_profiler = !state->show_profiler;
+	}
+	state->mouse_right_was_down = env->mouse_right_down;
+
 	if (state->width != env->width || state->height != env->height)
 	{
 		state->width = env->width;
 		state->height = env->height;
-		app_init(env);
+		state->frames_since_resize = 0;
+		resize_views(env->width, env->height);
 	}
 
-	Image image = image_from_env(env);
-	clear_image(image, COLOR_WHITE);
-	draw_image(image, state->background_image, (Vec4){
-		.x = 0,
-		.y = 0,
-		.w = env->width,
-		.h = env->height,
-	}, NULL);
-	draw_view(state->view, env);
+	// Everything allocated from the frame arena lives for this frame only
+	arena_reset(&state->frame_arena);
+
+	// Only rescaled on resize, otherwise the background is a plain copy
+	update_scaled_background(env->width, env->height);
+
+	// Recorded first, then only the tiles whose commands changed are
+	// rasterized on every core
+	Image image = begin_draw_list(&state->draw_list, image_from_env(env), &state->frame_arena);
+	copy_image(image, state->scaled_background, (Vec2){.x = 0, .y = 0});
+	bool animating = draw_view(state->view, image, env, &state->frame_arena);
+	animating |= draw_view((View*)state->note_view, image, env, &state->frame_arena);
 
 	char fps[32];
 	snprintf(fps, 32, "FPS: %.2f", 1/env->delta_time);
 	draw_text(image, state->font, fps, 32, (Vec2){.x = env->width-200, .y = 50}, COLOR_GREEN);
+
+	// Shows the frames before this one, kept updating while visible
+	if (state->show_profiler)
+	{
+		draw_profile_overlay(image, state->font, (Vec2){.x = env->width-460, .y = 100});
+	}
+
+	end_draw_list(&state->draw_list, env->buffer_age);
+
+	env->damage_count = state->draw_list.damage_count;
+	memcpy(env->damage, state->draw_list.damage, env->damage_count * sizeof(EnvRect));
+
+	AllocStats allocs = alloc_stats();
+	allocs.calls -= allocs_before.calls;
+	allocs.bytes -= allocs_before.bytes;
+	allocs.frees -= allocs_before.frees;
+
+	profile_end(frame_scope);
+	profile_frame_end(allocs);
+	state->frame_end_ns = time_ns();
+
+	if (state->alloc_warmup >= 0 && state->frames_since_resize >= state->alloc_warmup && allocs.calls > 0)
+	{
+		fprintf(stderr, "ERROR: Frame %d after warmup made %lld allocations of %lld bytes\n",
+		        state->frames_since_resize, (long long)allocs.calls, (long long)allocs.bytes);
+		exit(1);
+	}
+	state->frames_since_resize++;
+
+	return animating || state->show_profiler;
 }
 
 export AppStateHandle app_pre_reload(void)
 {
+	state->reload_start_ns = time_ns();
+	profile_trace_stop();
+
+	// The pool threads run code of this library which is about to be
+	// unloaded
+	thread_pool_stop();
+	free_tile_scratch();
+
 	return (AppStateHandle) {
 		.state = state,
 		.size = sizeof(AppState)
@@ -122,7 +289,20 @@ export AppStateHandle app_pre_reload(void)
 
 export void app_post_reload(AppStateHandle handle)
 {
-	state = malloc(sizeof(AppState));
+	state = mem_alloc(sizeof(AppState));
 	memcpy(state, handle.state, handle.size);
-	free(handle.state);
+	mem_free(handle.state);
+
+	// The new code may draw the same commands differently
+	invalidate_draw_list(&state->draw_list);
+	state->frames_since_resize = 0;
+
+	const char *trace_path = getenv(PROFILE_TRACE_ENV);
+	if (trace_path != NULL)
+	{
+		profile_trace_start(trace_path, true);
+	}
+
+	uint64_t now = time_ns();
+	profile_add_at(PROFILE_HOT_RELOAD, state->reload_start_ns, now - state->reload_start_ns);
 }
@@ -0,0 +1,252 @@
+#include "config.h"
+#include "env.h"
+#include "hotreload.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define LIBRARY_PATH "everything.dll"
+#else
+#include <time.h>
+#ifdef __APPLE__
+#define LIBRARY_PATH "./everything.dylib"
+#else
+#define LIBRARY_PATH "./everything.so"
+#endif
+#endif
+
+// Renders a scripted sequence of frames into memory without a window,
+// for benchmarks and for comparing frames on machines without a display
+//
+// Usage: everything_headless [-frames N] [-size WxH] [-full] [-overlay] [-dump DIR]
+//   -full     draws every frame from scratch instead of reusing the last one
+//   -overlay  right clicks on the first frame to show the profiler
+//   -dump     writes every frame to DIR/frame_NNNN.bmp
+//
+// EVERYTHING_ALLOC_WARMUP=N makes the app fail a frame that allocates
+// after the first N frames since the start or the last resize
+
+Env env = {0};
+AppModule module = {0};
+
+double get_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart * 1000.0 / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000.0 + now.tv_nsec/1000000.0;
+#endif
+}
+
+void resize_buffer(int width, int height)
+{
+	env.buffer = realloc(env.buffer, (size_t)width * height * sizeof(uint32_t));
+	if (env.buffer == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to allocate frame buffer\n");
+		exit(1);
+	}
+
+	memset(env.buffer, 0, (size_t)width * height * sizeof(uint32_t));
+	env.width = width;
+	env.height = height;
+	env.buffer_age = 0;
+}
+
+// The input of every frame only depends on its index so runs can be
+// compared with each other. The pointer sweeps down the panels on the
+// left, clicks every 30 frames and the window shrinks for the last
+// quarter of the run.
+void script_frame(int frame, int frames, int width, int height, bool overlay)
+{
+	if (frame == frames - frames/4 && frames >= 4)
+	{
+		resize_buffer(width*3/4, height*3/4);
+	}
+
+	int mouse_x = env.width/6;
+	int mouse_y = (frame * 13) % env.height;
+
+	env.mouse_moved = mouse_x != env.mouse_x || mouse_y != env.mouse_y;
+	env.mouse_x = mouse_x;
+	env.mouse_y = mouse_y;
+	env.mouse_left_down = frame % 30 == 29;
+	env.mouse_right_down = overlay && frame == 0;
+	env.key_down = false;
+
+	// Fixed so the FPS text is the same in every run
+	env.delta_time = 1.0 / 60.0;
+}
+
+static void put_u16(uint8_t *dst, uint16_t value)
+{
+	dst[0] = value & 0xFF;
+	dst[1] = (value >> 8) & 0xFF;
+}
+
+static void put_u32(uint8_t *dst, uint32_t value)
+{
+	put_u16(dst, value & 0xFFFF);
+	put_u16(dst + 2, value >> 16);
+}
+
+bool write_bmp(const char *filename, const uint8_t *pixels, int width, int height)
+{
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to open %s\n", filename);
+		return false;
+	}
+
+	uint32_t image_size = (uint32_t)width * height * 4;
+	uint8_t header[54] = {0};
+	put_u16(header, 0x4D42);
+	put_u32(header + 2, sizeof(header) + image_size);
+	put_u32(header + 10, sizeof(header));
+	put_u32(header + 14, 40);
+	put_u32(header + 18, width);
+	// Negative height for rows stored top down
+	put_u32(header + 22, (uint32_t)-height);
+	put_u16(header + 26, 1);
+	put_u16(header + 28, 32);
+	put_u32(header + 34, image_size);
+	fwrite(header, sizeof(header), 1, file);
+
+	uint8_t *row = malloc(width * 4);
+	for (int y = 0; y < height; y++)
+	{
+		const uint8_t *src = pixels + (size_t)y * width * 4;
+		for (int x = 0; x < width; x++)
+		{
+			// BMP stores BGRA, the app draws RGBA everywhere but on windows
+#ifdef _WIN32
+			memcpy(row + x*4, src + x*4, 4);
+#else
+			row[x*4 + 0] = src[x*4 + 2];
+			row[x*4 + 1] = src[x*4 + 1];
+			row[x*4 + 2] = src[x*4 + 0];
+			row[x*4 + 3] = src[x*4 + 3];
+#endif
+		}
+		fwrite(row, width * 4, 1, file);
+	}
+	free(row);
+
+	bool ok = ferror(file) == 0;
+	fclose(file);
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: Failed to write %s\n", filename);
+	}
+	return ok;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-frames N] [-size WxH] [-full] [-overlay] [-dump DIR]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int frames = 120;
+	int width = INIT_WIDTH;
+	int height = INIT_HEIGHT;
+	bool full = false;
+	bool overlay = false;
+	const char *dump_dir = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+		{
+			frames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+		{
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "-full") == 0)
+		{
+			full = true;
+		}
+		else if (strcmp(argv[i], "-overlay") == 0)
+		{
+			overlay = true;
+		}
+		else if (strcmp(argv[i], "-dump") == 0 && i + 1 < argc)
+		{
+			dump_dir = argv[++i];
+		}
+		else
+		{
+			usage(argv[0]);
+		}
+	}
+
+	if (frames <= 0 || width <= 0 || height <= 0)
+	{
+		usage(argv[0]);
+	}
+
+	load_module(&module, LIBRARY_PATH);
+	module.app_load();
+
+	resize_buffer(width, height);
+	module.app_init(&env);
+
+	double *times = malloc(frames * sizeof(double));
+	double total = 0.0;
+	for (int i = 0; i < frames; i++)
+	{
+		script_frame(i, frames, width, height, overlay);
+
+		double start = get_time();
+		module.app_update(&env);
+		double elapsed = get_time() - start;
+
+		times[i] = elapsed;
+		total += elapsed;
+		printf("frame %d: %.3f ms, %d damage rects\n", i, elapsed, env.damage_count);
+
+		// A single buffer keeps what was drawn into it last frame
+		env.buffer_age = full ? 0 : 1;
+
+		// Writing the frame out is what presenting it means here
+		env.present_time = 0.0;
+		if (dump_dir != NULL)
+		{
+			double present_start = get_time();
+			char filename[1024];
+			snprintf(filename, sizeof(filename), "%s/frame_%04d.bmp", dump_dir, i);
+			if (!write_bmp(filename, env.buffer, env.width, env.height)) exit(1);
+			env.present_time = (get_time() - present_start) / 1000.0;
+		}
+	}
+
+	qsort(times, frames, sizeof(double), compare_doubles);
+	printf("frames: %d, mean: %.3f ms, median: %.3f ms, min: %.3f ms, max: %.3f ms\n",
+	       frames, total / frames, times[frames / 2], times[0], times[frames - 1]);
+
+	free(times);
+	free(env.buffer);
+	return 0;
+}
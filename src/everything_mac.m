@@ -32,7 +32,10 @@ double getTime(void)
 @property(nonatomic, strong) NSWindow *window;
 @property(nonatomic, strong) NSImage *image;
 @property(nonatomic, strong) NSBitmapImageRep *imageRep;
+// Only runs while input arrives or the app is animating
+@property(nonatomic, assign) NSTimer *frameTimer;
 
+- (void)scheduleFrame;
 - (void)updateFrame;
 - (void)handleInput:(NSEvent *)event;
 @end
@@ -58,11 +61,7 @@ double getTime(void)
 
 	self.lastFrameTime = getTime();
 
-	[NSTimer scheduledTimerWithTimeInterval:1.0 / 60.0
-	 target:self
-	 selector:@selector(updateFrame)
-	 userInfo:nil
-	 repeats:YES];
+	[self scheduleFrame];
 
 	int inputEvents = NSEventMaskKeyDown | NSEventMaskMouseMoved | NSEventMaskLeftMouseDown | NSEventMaskRightMouseDown;
 	[NSEvent addLocalMonitorForEventsMatchingMask:inputEvents handler:^NSEvent *(NSEvent *event)
@@ -79,6 +78,11 @@ double getTime(void)
 	return frameSize;
 }
 
+- (void)windowDidResize:(NSNotification *)notification
+{
+	[self scheduleFrame];
+}
+
 - (void)windowWillClose:(NSNotification *)notification
 {
 	[self.window release];
@@ -86,6 +90,17 @@ double getTime(void)
 	exit(EXIT_SUCCESS);
 }
 
+- (void)scheduleFrame
+{
+	if (self.frameTimer != nil) return;
+
+	self.frameTimer = [NSTimer scheduledTimerWithTimeInterval:1.0 / 60.0
+	                   target:self
+	                   selector:@selector(updateFrame)
+	                   userInfo:nil
+	                   repeats:YES];
+}
+
 - (void)updateFrame
 {
 	double currentFrameTime = getTime();
@@ -108,6 +123,7 @@ double getTime(void)
 		env.buffer = malloc(newBufferSize);
 		env.width = width;
 		env.height = height;
+		env.buffer_age = 0;
 	}
 
 	if (!app_initialised)
@@ -117,10 +133,28 @@ double getTime(void)
 	}
 
 	// Updating the actual app
-	module.app_update(&env);
+	bool needsFrame = module.app_update(&env);
+	env.buffer_age = 1;
 	self.inputUsed = true;
 
+	// Idle until the next input event
+	if (!needsFrame)
+	{
+		[self.frameTimer invalidate];
+		self.frameTimer = nil;
+	}
+
+	// Nothing changed, the layer keeps showing the last image
+	if (env.damage_count == 0 && self.image != nil)
+	{
+		self.lastFrameTime = currentFrameTime;
+		env.present_time = 0.0;
+		[self resetInput];
+		return;
+	}
+
 	// Create a new NSBitmapImageRep with the updated buffer
+	double presentStart = getTime();
 	uint32_t pitch = width * sizeof(uint32_t);
 	uint8_t *buffer = env.buffer;
 
@@ -147,6 +181,7 @@ double getTime(void)
 	// Update the layer contents with the new image
 	self.window.contentView.layer.contents = self.image;
 	self.lastFrameTime = currentFrameTime;
+	env.present_time = (getTime() - presentStart) / 1000.0;
 
 	[self resetInput];
 }
@@ -182,6 +217,7 @@ double getTime(void)
 	}
 
 	self.inputUsed = false;
+	[self scheduleFrame];
 }
 
 - (void)resetInput
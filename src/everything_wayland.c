@@ -20,18 +20,55 @@
 struct wl_display *display;
 struct wl_compositor *compositor;
 struct wl_surface *surface;
-struct wl_buffer *buffer;
 struct wl_shm *shm;
 struct wl_seat *seat;
 struct wl_keyboard *keyboard;
 struct wl_pointer *pointer;
 struct wl_callback_listener cb_listener;
+// Frame callback of the last commit, nothing is drawn while it is
+// outstanding and nothing at all while the app is idle
+struct wl_callback *frame_callback = NULL;
+bool frame_requested = false;
 
 // XDG Shell stuff
 struct xdg_wm_base *shell;
 struct xdg_toplevel *window;
 
-void *pixel_data;
+// Buffers carved out of one shm pool, the compositor may still read the
+// last ones presented while the next frame is drawn into a free one
+#define BUFFER_COUNT 3
+
+// Buffers of an earlier size the compositor may still be reading,
+// their part of the pool is kept until they are released
+#define RETIRED_BUFFER_COUNT (BUFFER_COUNT * 8)
+
+typedef struct
+{
+	struct wl_buffer *buffer;
+	uint8_t *pixels;
+	// Bytes of the pool it covers
+	size_t offset;
+	size_t size;
+	// Attached and not released by the compositor yet
+	bool busy;
+	// Frames since it was presented, zero when never drawn
+	int age;
+	// Replaced by a resize, destroyed when released
+	bool retired;
+} ShmBuffer;
+
+ShmBuffer buffers[BUFFER_COUNT];
+ShmBuffer retired_buffers[RETIRED_BUFFER_COUNT];
+
+// The pool outlives resizes, it is created with headroom and only grows
+// geometrically so a drag resize does not map a new file at every step
+struct wl_shm_pool *pool;
+int pool_fd = -1;
+void *pool_data;
+size_t pool_size;
+// A frame was due while every buffer was busy
+bool frame_pending = false;
+
 int width = INIT_WIDTH;
 int height = INIT_HEIGHT;
 double last_frame_time = 0.0;
@@ -83,54 +120,224 @@ static int create_shm_file(size_t size)
 	return -1;
 }
 
-void window_resize(void)
+void render_frame(void);
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer)
 {
-	size_t stride = width * 4;
-	size_t buffer_size = height * stride;
-	size_t pool_length = 1;
-	size_t pool_size = buffer_size * pool_length;
+	(void)wl_buffer;
 
-	int fd = create_shm_file(pool_size);
-	if (fd < 0)
+	ShmBuffer *released = data;
+	released->busy = false;
+	if (released->retired)
 	{
-		fprintf(stderr, "ERROR: Failed to create shm file.\n");
+		wl_buffer_destroy(released->buffer);
+		*released = (ShmBuffer){0};
 		return;
 	}
 
-	// Storing the buffer as a global array so we can
-	// reuse it later
-	pixel_data = mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (pixel_data == NULL)
+	if (frame_pending)
+	{
+		frame_pending = false;
+		render_frame();
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener =
+{
+	.release = buffer_release,
+};
+
+void destroy_buffers(void)
+{
+	for (int i = 0; i < BUFFER_COUNT; i++)
+	{
+		if (buffers[i].buffer) wl_buffer_destroy(buffers[i].buffer);
+		buffers[i] = (ShmBuffer){0};
+	}
+	for (int i = 0; i < RETIRED_BUFFER_COUNT; i++)
+	{
+		if (retired_buffers[i].buffer) wl_buffer_destroy(retired_buffers[i].buffer);
+		retired_buffers[i] = (ShmBuffer){0};
+	}
+}
+
+// Buffers the compositor is done with are destroyed, busy ones stay
+// alive until their release so their memory is not drawn into
+void retire_buffers(void)
+{
+	for (int i = 0; i < BUFFER_COUNT; i++)
+	{
+		ShmBuffer *buffer = &buffers[i];
+		if (buffer->buffer == NULL) continue;
+
+		ShmBuffer *slot = NULL;
+		for (int j = 0; buffer->busy && j < RETIRED_BUFFER_COUNT && slot == NULL; j++)
+		{
+			if (retired_buffers[j].buffer == NULL) slot = &retired_buffers[j];
+		}
+
+		// A compositor holding on to this many buffers is not reading
+		// them anymore
+		if (slot == NULL)
+		{
+			wl_buffer_destroy(buffer->buffer);
+		}
+		else
+		{
+			*slot = *buffer;
+			slot->retired = true;
+			wl_buffer_set_user_data(slot->buffer, slot);
+		}
+		*buffer = (ShmBuffer){0};
+	}
+}
+
+// Lowest offset where size bytes overlap no retired buffer
+size_t free_pool_offset(size_t size)
+{
+	size_t offset = 0;
+	bool moved = true;
+	while (moved)
+	{
+		moved = false;
+		for (int i = 0; i < RETIRED_BUFFER_COUNT; i++)
+		{
+			ShmBuffer *retired = &retired_buffers[i];
+			if (retired->buffer == NULL) continue;
+
+			if (offset < retired->offset + retired->size && retired->offset < offset + size)
+			{
+				offset = retired->offset + retired->size;
+				moved = true;
+			}
+		}
+	}
+	return offset;
+}
+
+void destroy_pool(void)
+{
+	if (pool) wl_shm_pool_destroy(pool);
+	if (pool_data) munmap(pool_data, pool_size);
+	if (pool_fd >= 0) close(pool_fd);
+
+	pool = NULL;
+	pool_fd = -1;
+	pool_data = NULL;
+	pool_size = 0;
+}
+
+// Makes the pool hold at least size bytes, smaller sizes reuse it as is
+bool reserve_pool(size_t size)
+{
+	if (pool != NULL && size <= pool_size) return true;
+
+	size_t new_pool_size = size + size / 2;
+	if (pool != NULL && new_pool_size < pool_size * 2)
+	{
+		new_pool_size = pool_size * 2;
+	}
+
+	if (pool == NULL)
+	{
+		pool_fd = create_shm_file(new_pool_size);
+		if (pool_fd < 0)
+		{
+			fprintf(stderr, "ERROR: Failed to create shm file.\n");
+			return false;
+		}
+	}
+	else if (ftruncate(pool_fd, new_pool_size) < 0)
+	{
+		fprintf(stderr, "ERROR: Failed to grow shm file.\n");
+		return false;
+	}
+
+	void *data = mmap(NULL, new_pool_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0);
+	if (data == MAP_FAILED)
 	{
 		fprintf(stderr, "ERROR: Failed to mmap file.\n");
-		return;
+		if (pool == NULL) destroy_pool();
+		return false;
 	}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, pool_size);
-	buffer = wl_shm_pool_create_buffer(
-	             pool, 0, width, height, stride, WL_SHM_FORMAT_ARGB8888);
-	wl_shm_pool_destroy(pool);
+	if (pool_data) munmap(pool_data, pool_size);
+	pool_data = data;
+	pool_size = new_pool_size;
 
-	close(fd);
+	if (pool == NULL)
+	{
+		pool = wl_shm_create_pool(shm, pool_fd, pool_size);
+	}
+	else
+	{
+		wl_shm_pool_resize(pool, pool_size);
+	}
+	return true;
 }
 
+// The new buffers go where the pool is not shared with a retired one
+void window_resize(void)
+{
+	retire_buffers();
+
+	size_t stride = width * 4;
+	size_t buffer_size = height * stride;
+	size_t base = free_pool_offset(buffer_size * BUFFER_COUNT);
+	if (!reserve_pool(base + buffer_size * BUFFER_COUNT)) return;
+
+	for (int i = 0; i < BUFFER_COUNT; i++)
+	{
+		size_t offset = base + i * buffer_size;
+		buffers[i].buffer = wl_shm_pool_create_buffer(
+		             pool, offset, width, height, stride, WL_SHM_FORMAT_ARGB8888);
+		buffers[i].pixels = (uint8_t *)pool_data + offset;
+		buffers[i].offset = offset;
+		buffers[i].size = buffer_size;
+		wl_buffer_add_listener(buffers[i].buffer, &buffer_listener, &buffers[i]);
+	}
+}
+
+// The free buffer presented most recently needs the least redrawing
+ShmBuffer *acquire_buffer(void)
+{
+	ShmBuffer *best = NULL;
+	for (int i = 0; i < BUFFER_COUNT; i++)
+	{
+		ShmBuffer *candidate = &buffers[i];
+		if (candidate->buffer == NULL || candidate->busy) continue;
+
+		if (best == NULL || (candidate->age > 0 && (best->age == 0 || candidate->age < best->age)))
+			best = candidate;
+	}
+	return best;
+}
+
+// Only the edge triggered inputs, buttons stay down until released
 void reset_input()
 {
 	if (!input_used) return;
 
 	env.key_down = false;
-	env.mouse_left_down = false;
-	env.mouse_right_down = false;
 	env.mouse_moved = false;
 }
 
 void render_frame(void)
 {
+	ShmBuffer *target = acquire_buffer();
+	if (target == NULL)
+	{
+		// Drawn as soon as the compositor releases a buffer
+		frame_pending = true;
+		return;
+	}
+
 	double current_frame_time = get_time();
 	double dt = (current_frame_time- last_frame_time) / 1000.0;
 
 	env.delta_time = dt;
-	env.buffer = pixel_data;
+	env.buffer = target->pixels;
+	env.buffer_age = target->age;
 	env.width = width;
 	env.height = height;
 
@@ -140,12 +347,34 @@ void render_frame(void)
 		app_initialised = true;
 	}
 
-	module.app_update(&env);
+	frame_requested = module.app_update(&env);
 	input_used = true;
+	last_frame_time = current_frame_time;
 
-	wl_surface_attach(surface, buffer, 0, 0);
-	wl_surface_damage(surface, 0, 0, width, height);
+	// Only the regions the app redrew need to be composited again
+	double present_start = get_time();
+	wl_surface_attach(surface, target->buffer, 0, 0);
+	for (int i = 0; i < env.damage_count; ++i)
+	{
+		EnvRect rect = env.damage[i];
+		wl_surface_damage_buffer(surface, rect.x, rect.y, rect.width, rect.height);
+	}
+
+	if (frame_callback == NULL)
+	{
+		frame_callback = wl_surface_frame(surface);
+		wl_callback_add_listener(frame_callback, &cb_listener, NULL);
+	}
 	wl_surface_commit(surface);
+	wl_display_flush(display);
+	env.present_time = (get_time() - present_start) / 1000.0;
+
+	for (int i = 0; i < BUFFER_COUNT; i++)
+	{
+		if (buffers[i].age > 0) buffers[i].age++;
+	}
+	target->age = 1;
+	target->busy = true;
 
 	reset_input();
 }
@@ -156,10 +385,14 @@ void update_frame(void* data, struct wl_callback* cb, uint32_t cb_data)
 	(void)cb_data;
 
 	wl_callback_destroy(cb);
-	cb = wl_surface_frame(surface);
-	wl_callback_add_listener(cb, &cb_listener, NULL);
+	frame_callback = NULL;
 
-	render_frame();
+	// Idle until input arrives unless the app asked for another frame
+	if (frame_requested)
+	{
+		frame_requested = false;
+		render_frame();
+	}
 }
 
 struct wl_callback_listener cb_listener =
@@ -167,6 +400,19 @@ struct wl_callback_listener cb_listener =
 	.done = update_frame,
 };
 
+// Draws right away when the compositor is not busy with the last frame,
+// otherwise as soon as it is done with it
+void request_frame(void)
+{
+	if (frame_callback != NULL)
+	{
+		frame_requested = true;
+		return;
+	}
+
+	render_frame();
+}
+
 static void pointer_enter(void *data,
                           struct wl_pointer *wl_pointer,
                           uint32_t serial,
@@ -192,6 +438,10 @@ static void pointer_leave(void *data,
 	(void)wl_pointer;
 	(void)serial;
 	(void)surface;
+
+	// A button released after the pointer left is not reported
+	env.mouse_left_down = false;
+	env.mouse_right_down = false;
 }
 
 static void pointer_motion(void *data,
@@ -203,8 +453,8 @@ static void pointer_motion(void *data,
 	(void)data;
 	(void)wl_pointer;
 	(void)time;
-	env.mouse_x = surface_x;
-	env.mouse_y = surface_y;
+	env.mouse_x = wl_fixed_to_int(surface_x);
+	env.mouse_y = wl_fixed_to_int(surface_y);
 }
 
 static void pointer_button(void *data,
@@ -218,10 +468,11 @@ static void pointer_button(void *data,
 	(void)wl_pointer;
 	(void)serial;
 	(void)time;
-	(void)state;
 
-	env.mouse_left_down = button == BTN_LEFT;
-	env.mouse_right_down = button == BTN_RIGHT;
+	// Held until the release of the same button
+	bool pressed = state == WL_POINTER_BUTTON_STATE_PRESSED;
+	if (button == BTN_LEFT) env.mouse_left_down = pressed;
+	if (button == BTN_RIGHT) env.mouse_right_down = pressed;
 }
 
 static void pointer_axis(void *data,
@@ -237,11 +488,14 @@ static void pointer_axis(void *data,
 	(void)value;
 }
 
+// Sent after a group of pointer events that belong together
 static void pointer_frame(void *data,
                           struct wl_pointer *wl_pointer)
 {
 	(void)data;
 	(void)wl_pointer;
+
+	request_frame();
 }
 
 static void pointer_axis_source(void *data,
@@ -374,9 +628,6 @@ static void toplevel_configure(void* data, struct xdg_toplevel* toplevel,
 
 	if (width != w || height != h)
 	{
-		size_t old_buffer_size = width*height*4;
-		munmap(pixel_data, old_buffer_size);
-
 		width = w;
 		height = h;
 		window_resize();
@@ -402,7 +653,7 @@ static void xrfc_configure(void* data, struct xdg_surface* xrfc, uint32_t serial
 	(void)data;
 
 	xdg_surface_ack_configure(xrfc, serial);
-	if (!pixel_data)
+	if (!pool)
 	{
 		window_resize();
 	}
@@ -501,9 +752,6 @@ int main(void)
 		fprintf(stderr, "ERROR: Failed to create a Wayland surface.\n");
 		exit(1);
 	}
-	struct wl_callback* cb = wl_surface_frame(surface);
-	wl_callback_add_listener(cb, &cb_listener, NULL);
-
 	struct xdg_surface* xrfc = xdg_wm_base_get_xdg_surface(shell, surface);
 	xdg_surface_add_listener(xrfc, &xrfc_listener, NULL);
 
@@ -523,7 +771,9 @@ int main(void)
 	}
 
 	// Clean up
-	if(buffer) wl_buffer_destroy(buffer);
+	if (frame_callback) wl_callback_destroy(frame_callback);
+	destroy_buffers();
+	destroy_pool();
 	xdg_toplevel_destroy(window);
 	xdg_surface_destroy(xrfc);
 	wl_surface_destroy(surface);
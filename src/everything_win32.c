@@ -11,6 +11,8 @@ Env env = {0};
 AppModule module = {0};
 bool appInitialised = false;
 double lastFrameTime = 0.0;
+// Seconds the last WM_PAINT took, reported to the app with the next frame
+double presentTime = 0.0;
 
 HWND hWnd;
 HDC hdcMem;
@@ -20,10 +22,14 @@ HBITMAP hBitmap;
 #define FPS 60
 #define FRAME_TIME (1000 / FPS)
 
+// The frame timer only runs while input arrives or the app is animating
+bool timerActive = false;
+
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 void AllocateBuffer(int width, int height);
 void FreeBuffer(void);
-void UpdateBuffer(void);
+bool UpdateBuffer(void);
+void RequestFrame(void);
 double GetUnixTime(void);
 
 int WINAPI WinMain(
@@ -64,7 +70,7 @@ int WINAPI WinMain(
 	ShowWindow(hWnd, nShowCmd);
 	UpdateWindow(hWnd);
 
-    SetTimer(hWnd, TIMER_ID, FRAME_TIME, NULL);
+	RequestFrame();
 
 	MSG msg = {0};
 	while (GetMessage(&msg, 0, 0, 0))
@@ -96,29 +102,35 @@ LRESULT CALLBACK WndProc(
 	{
 		env.mouse_x = GET_X_LPARAM(lParam);
 		env.mouse_y = GET_Y_LPARAM(lParam);
+		RequestFrame();
 	}
 	break;
 
 	case WM_LBUTTONDOWN:
 	{
 		env.mouse_left_down = true;
+		RequestFrame();
 	}
 	break;
 
 	case WM_LBUTTONUP:
 	{
 		env.mouse_left_down = false;
+		RequestFrame();
 	}
 	break;
 
 	case WM_RBUTTONDOWN:
 	{
 		env.mouse_right_down = true;
+		RequestFrame();
 	}
+	break;
 
 	case WM_RBUTTONUP:
 	{
 		env.mouse_right_down = false;
+		RequestFrame();
 	}
 	break;
 
@@ -135,28 +147,43 @@ LRESULT CALLBACK WndProc(
 			FreeBuffer();
 			AllocateBuffer(new_width, new_height);
 			InvalidateRect(hWnd, NULL, TRUE);
+			RequestFrame();
 		}
 	}
 	break;
 
 	case WM_PAINT:
 	{
+		double paintStart = GetUnixTime();
 		PAINTSTRUCT ps;
 		HDC hdc = BeginPaint(hWnd, &ps);
 
 		if (env.buffer != NULL)
 		{
-            BitBlt(hdc, 0, 0, env.width, env.height, hdcMem, 0, 0, SRCCOPY);
+            RECT dirty = ps.rcPaint;
+            BitBlt(hdc, dirty.left, dirty.top, dirty.right - dirty.left, dirty.bottom - dirty.top,
+                   hdcMem, dirty.left, dirty.top, SRCCOPY);
 		}
 
 		EndPaint(hWnd, &ps);
+		presentTime = GetUnixTime() - paintStart;
 	}
 	break;
 
 	case WM_TIMER:
 	if (wParam == TIMER_ID) {
-		UpdateBuffer();
-		InvalidateRect(hWnd, NULL, TRUE); 
+		if (!UpdateBuffer())
+		{
+			KillTimer(hWnd, TIMER_ID);
+			timerActive = false;
+		}
+		// Only what the app redrew is painted again
+		for (int i = 0; i < env.damage_count; ++i)
+		{
+			EnvRect damage = env.damage[i];
+			RECT rect = {damage.x, damage.y, damage.x + damage.width, damage.y + damage.height};
+			InvalidateRect(hWnd, &rect, FALSE);
+		}
 	}
 	break;
 
@@ -173,11 +200,13 @@ LRESULT CALLBACK WndProc(
 }
 
 
-void UpdateBuffer(void)
+// Returns true when the app needs another frame
+bool UpdateBuffer(void)
 {
 	double startTime = GetUnixTime();
 	double dt = startTime - lastFrameTime;
 	env.delta_time = dt;
+	env.present_time = presentTime;
 
 	if (module.app_init && !appInitialised)
 	{
@@ -185,12 +214,25 @@ void UpdateBuffer(void)
 		appInitialised = true;
 	}
 
+	bool needsFrame = false;
 	if (module.app_update)
 	{
-		module.app_update(&env);
+		needsFrame = module.app_update(&env);
+		env.buffer_age = 1;
 	}
 
 	lastFrameTime = startTime;
+	return needsFrame;
+}
+
+void RequestFrame(void)
+{
+	// Messages sent while the window is being created come before hWnd
+	// is set, WinMain starts the timer after that
+	if (timerActive || hWnd == NULL) return;
+
+	SetTimer(hWnd, TIMER_ID, FRAME_TIME, NULL);
+	timerActive = true;
 }
 
 void AllocateBuffer(int width, int height)
@@ -218,6 +260,7 @@ void AllocateBuffer(int width, int height)
 
 	env.width = width;
 	env.height = height;
+	env.buffer_age = 0;
 }
 
 void FreeBuffer(void)
@@ -27,7 +27,7 @@ void load_module(AppModule *module, char* file_path)
 
 	module->app_load = (void (*)(void))GetProcAddress(module->handle, "app_load");
 	module->app_init = (void (*)(Env*))GetProcAddress(module->handle, "app_init");
-	module->app_update = (void (*)(Env*))GetProcAddress(module->handle, "app_update");
+	module->app_update = (bool (*)(Env*))GetProcAddress(module->handle, "app_update");
 	module->app_pre_reload = (AppStateHandle (*)(void))GetProcAddress(module->handle, "app_pre_reload");
 	module->app_post_reload = (void (*)(AppStateHandle))GetProcAddress(module->handle, "app_post_reload");
 
@@ -18,7 +18,8 @@ typedef struct
 {
 	void (*app_load)(void);
 	void (*app_init)(Env *env);
-	void (*app_update)(Env *env);
+	// Returns true while the app needs another frame without new input
+	bool (*app_update)(Env *env);
 
 	// For hot reloading
 	AppStateHandle (*app_pre_reload)(void);
@@ -2,14 +2,42 @@
 #include "basic.h"
 
 void compile_self(int argc, char **argv);
-void compile_library(void);
-void compile_executable(void);
+void compile_library(void *arg);
+void compile_executable(void *arg);
+void compile_headless(void *arg);
+bool run_bench(int argc, char **argv);
+bool run_checks(void);
 
 int main(int argc, char **argv)
 {
     compile_self(argc, argv);
-    compile_library();
-    compile_executable();
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        return run_bench(argc - 2, argv + 2) ? 0 : 1;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "check") == 0)
+    {
+        return run_checks() ? 0 : 1;
+    }
+
+    // Independent of each other, so both compilers run at once and
+    // report back instead of exiting under the other one
+    bool library_ok = true;
+    bool executable_ok = true;
+    bool headless_ok = true;
+    WaitGroup group = {0};
+    thread_pool_submit(&group, compile_library, &library_ok);
+    thread_pool_submit(&group, compile_executable, &executable_ok);
+    thread_pool_submit(&group, compile_headless, &headless_ok);
+    wait_group_wait(&group);
+    thread_pool_stop();
+
+    if (!library_ok || !executable_ok || !headless_ok)
+    {
+        exit(1);
+    }
 
     fprintf(stderr, "INFO: Compilation successful\n");
 
@@ -18,8 +46,6 @@ int main(int argc, char **argv)
 
 void compile_self(int argc, char **argv)
 {
-    unused(argc);
-
     char* binary_path = argv[0];
     char* source_path = __FILE__;
 
@@ -52,9 +78,11 @@ void compile_self(int argc, char **argv)
             array_append(&cmd, "-Wextra");
             array_append(&cmd, "-Wpedantic");
             array_append(&cmd, "-O2");
+            array_append(&cmd, "-pthread");
             array_append(&cmd, "-o");
             array_append(&cmd, binary_path);
             array_append(&cmd, source_path);
+            array_append(&cmd, "-lm");
         #endif
 
         bool success = cmd_run_sync(&cmd);
@@ -67,19 +95,26 @@ void compile_self(int argc, char **argv)
         }
 
         Cmd cmd2 = {0};
-        array_append(&cmd2, binary_path);
+        for (int i = 0; i < argc; i++)
+        {
+            array_append(&cmd2, argv[i]);
+        }
 
         cmd_run_sync(&cmd2);
         exit(0);
     }
 }
 
-void compile_library(void)
+void compile_library(void *arg)
 {
+    bool *ok = (bool *)arg;
+
     char* src_files[] = {
         "src/everything.c",
         "src/drawing.c",
         "src/views.c",
+        "src/paragraph.c",
+        "src/profiler.c",
     };
     int src_files_count = countof(src_files);
 
@@ -116,6 +151,7 @@ void compile_library(void)
         array_append(&cmd, "-Wpedantic");
         array_append(&cmd, "-g");
         array_append(&cmd, "-O2");
+        array_append(&cmd, "-pthread");
     #ifdef __APPLE__
         array_append(&cmd, "-dynamiclib");
     #else
@@ -128,6 +164,9 @@ void compile_library(void)
         {
             array_append(&cmd, src_files[i]);
         }
+        // The app is loaded with every symbol resolved up front, so the
+        // math functions have to be linked into it
+        array_append(&cmd, "-lm");
     #endif
 
         bool success = cmd_run_sync(&cmd);
@@ -135,14 +174,16 @@ void compile_library(void)
 
         if (!success)
         {
-            fprintf(stderr, "ERROR: Failed to compile executable\n");
-            exit(1);
+            fprintf(stderr, "ERROR: Failed to compile library\n");
+            *ok = false;
         }
     }
 }
 
-void compile_executable(void)
+void compile_executable(void *arg)
 {
+    bool *ok = (bool *)arg;
+
 #ifdef _WIN32
     char* src_files[] = {
         "src/everything_win32.c",
@@ -210,7 +251,188 @@ void compile_executable(void)
         if (!success)
         {
             fprintf(stderr, "ERROR: Failed to compile executable\n");
-            exit(1);
+            *ok = false;
         }
     }
 }
+
+// Runs the app without a window, see src/everything_headless.c
+void compile_headless(void *arg)
+{
+    bool *ok = (bool *)arg;
+
+    char* src_files[] = {
+        "src/everything_headless.c",
+        "src/hotreload.c",
+    };
+    int src_files_count = countof(src_files);
+#ifdef _WIN32
+    char* exe_name = "everything_headless.exe";
+#else
+    char* exe_name = "everything_headless";
+#endif
+
+    if (file_needs_rebuild(exe_name, src_files, src_files_count))
+    {
+        Cmd cmd = {0};
+    #ifdef _WIN32
+        array_append(&cmd, "cl.exe");
+        array_append(&cmd, "/nologo");
+        array_append(&cmd, "/Zi");
+        array_append(&cmd, "/O2");
+        for (int i = 0; i < src_files_count; i++)
+        {
+            array_append(&cmd, src_files[i]);
+        }
+        array_append(&cmd, "User32.lib");
+        array_append(&cmd, "/Fe:");
+        array_append(&cmd, exe_name);
+    #else
+        array_append(&cmd, "cc");
+        array_append(&cmd, "-Wall");
+        array_append(&cmd, "-Wextra");
+        array_append(&cmd, "-g");
+        array_append(&cmd, "-O2");
+        array_append(&cmd, "-o");
+        array_append(&cmd, exe_name);
+        for (int i = 0; i < src_files_count; i++)
+        {
+            array_append(&cmd, src_files[i]);
+        }
+    #ifdef __linux__
+        array_append(&cmd, "-ldl");
+    #endif
+    #endif
+
+        bool success = cmd_run_sync(&cmd);
+        array_free(&cmd);
+
+        if (!success)
+        {
+            fprintf(stderr, "ERROR: Failed to compile headless executable\n");
+            *ok = false;
+        }
+    }
+}
+
+// Builds the drawing micro benchmarks and runs them, the arguments are
+// passed on to the benchmark
+bool run_bench(int argc, char **argv)
+{
+    char* src_files[] = {
+        "src/bench.c",
+        "src/drawing.c",
+        "src/paragraph.c",
+        "src/profiler.c",
+    };
+    int src_files_count = countof(src_files);
+#ifdef _WIN32
+    char* exe_name = "bench.exe";
+#else
+    char* exe_name = "./bench";
+#endif
+
+    if (file_needs_rebuild(exe_name, src_files, src_files_count))
+    {
+        Cmd cmd = {0};
+    #ifdef _WIN32
+        array_append(&cmd, "cl.exe");
+        array_append(&cmd, "/nologo");
+        array_append(&cmd, "/Zi");
+        array_append(&cmd, "/O2");
+        for (int i = 0; i < src_files_count; i++)
+        {
+            array_append(&cmd, src_files[i]);
+        }
+        array_append(&cmd, "/Fe:");
+        array_append(&cmd, exe_name);
+    #else
+        array_append(&cmd, "cc");
+        array_append(&cmd, "-Wall");
+        array_append(&cmd, "-Wextra");
+        array_append(&cmd, "-g");
+        array_append(&cmd, "-O2");
+        array_append(&cmd, "-pthread");
+        array_append(&cmd, "-o");
+        array_append(&cmd, exe_name);
+        for (int i = 0; i < src_files_count; i++)
+        {
+            array_append(&cmd, src_files[i]);
+        }
+        array_append(&cmd, "-lm");
+    #endif
+
+        bool success = cmd_run_sync(&cmd);
+        array_free(&cmd);
+
+        if (!success)
+        {
+            fprintf(stderr, "ERROR: Failed to compile bench\n");
+            return false;
+        }
+    }
+
+    Cmd cmd = {0};
+    array_append(&cmd, exe_name);
+    for (int i = 0; i < argc; i++)
+    {
+        array_append(&cmd, argv[i]);
+    }
+
+    bool success = cmd_run_sync(&cmd);
+    array_free(&cmd);
+    return success;
+}
+
+// Frames the headless check runs and how many of them may allocate
+#define CHECK_FRAMES "60"
+#define CHECK_ALLOC_WARMUP "3"
+
+// Runs the scripted headless frames failing on any allocation after the
+// warmup, then the checks of the bench. Needs no window system.
+bool run_checks(void)
+{
+    bool library_ok = true;
+    bool headless_ok = true;
+    WaitGroup group = {0};
+    thread_pool_submit(&group, compile_library, &library_ok);
+    thread_pool_submit(&group, compile_headless, &headless_ok);
+    wait_group_wait(&group);
+    thread_pool_stop();
+
+    if (!library_ok || !headless_ok)
+    {
+        return false;
+    }
+
+    // Read by the app, see src/everything.c
+#ifdef _WIN32
+    _putenv("EVERYTHING_ALLOC_WARMUP=" CHECK_ALLOC_WARMUP);
+    char* exe_name = "everything_headless.exe";
+#else
+    setenv("EVERYTHING_ALLOC_WARMUP", CHECK_ALLOC_WARMUP, 1);
+    char* exe_name = "./everything_headless";
+#endif
+
+    Cmd cmd = {0};
+    array_append(&cmd, exe_name);
+    array_append(&cmd, "-frames");
+    array_append(&cmd, CHECK_FRAMES);
+    bool success = cmd_run_sync(&cmd);
+    array_free(&cmd);
+
+    if (!success)
+    {
+        fprintf(stderr, "ERROR: Headless frames allocated after the warmup or failed\n");
+        return false;
+    }
+
+    char* bench_args[] = {"-check"};
+    if (!run_bench(countof(bench_args), bench_args))
+    {
+        return false;
+    }
+
+    fprintf(stderr, "INFO: Checks passed\n");
+    return true;
+}
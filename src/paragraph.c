@@ -0,0 +1,313 @@
+#include "paragraph.h"
+
+#include <math.h>
+#include <string.h>
+
+void paragraph_layout_init(ParagraphLayout *layout, Font font, int size, int width)
+{
+	assert(font.data != NULL);
+
+	memset(layout, 0, sizeof(ParagraphLayout));
+	layout->font = font;
+	layout->size = size;
+	layout->line_height = size + size/4;
+	layout->width = width;
+	paragraph_layout_set_text(layout, "", 0);
+}
+
+void free_paragraph_layout(ParagraphLayout *layout)
+{
+	array_free(&layout->text);
+	array_free(&layout->paragraphs);
+	array_free(&layout->line_starts);
+	for (size_t i = 0; i < layout->drawn_lines.length; ++i)
+	{
+		free_text_layout(&layout->drawn_lines.items[i]);
+	}
+	array_free(&layout->drawn_lines);
+	array_free(&layout->split);
+	array_free(&layout->wrapped);
+	array_free(&layout->scratch);
+}
+
+// Greedy word wrap, lines break after the last space that fits and words
+// longer than a line are broken anywhere. Spaces may hang past the width.
+// Stepping matches draw_text so wrapped lines never draw past the width.
+static size_t wrap_paragraph(ParagraphLayout *layout, const char *text, size_t length, int *widest_line)
+{
+	size_t count = 1;
+	array_append(&layout->wrapped, 0);
+
+	int x = 0;
+	int widest = 0;
+	uint32_t line_start = 0;
+	// Where the text after the last space starts and x up to there
+	uint32_t break_at = 0;
+	int x_at_break = 0;
+
+	const char *c = text;
+	while ((size_t)(c - text) < length)
+	{
+		uint32_t offset = c - text;
+		uint32_t codepoint = utf8_next(&c);
+		float advance = glyph_advance(layout->font, codepoint, layout->size);
+
+		if (codepoint != ' ' && layout->width > 0 && offset > line_start && (int)(x + advance) > layout->width)
+		{
+			if (break_at > line_start)
+			{
+				widest = (x_at_break > widest) ? x_at_break : widest;
+				x -= x_at_break;
+				line_start = break_at;
+			}
+			else
+			{
+				widest = (x > widest) ? x : widest;
+				x = 0;
+				line_start = offset;
+			}
+			array_append(&layout->wrapped, line_start);
+			count++;
+		}
+
+		x += advance;
+		if (codepoint == ' ')
+		{
+			break_at = c - text;
+			x_at_break = x;
+		}
+	}
+
+	*widest_line = (x > widest) ? x : widest;
+	return count;
+}
+
+// Splits text[start..end) at its line breaks and wraps the pieces into
+// layout->split and layout->wrapped
+static void split_paragraphs(ParagraphLayout *layout, size_t start, size_t end, size_t first_line)
+{
+	layout->split.length = 0;
+	layout->wrapped.length = 0;
+
+	size_t position = start;
+	while (true)
+	{
+		const char *newline = memchr(layout->text.items + position, '\n', end - position);
+		size_t paragraph_end = (newline != NULL) ? (size_t)(newline - layout->text.items) : end;
+
+		Paragraph paragraph = {
+			.start = position,
+			.length = paragraph_end - position,
+			.first_line = first_line + layout->wrapped.length,
+		};
+		paragraph.line_count = wrap_paragraph(layout, layout->text.items + position, paragraph.length, &paragraph.widest_line);
+		array_append(&layout->split, paragraph);
+
+		if (newline == NULL) break;
+		position = paragraph_end + 1;
+	}
+}
+
+// Replaces count paragraphs from first with the ones in text[start..end),
+// the paragraphs after them move by byte_delta bytes
+static void reflow(ParagraphLayout *layout, size_t first, size_t count, size_t start, size_t end, ptrdiff_t byte_delta)
+{
+	size_t first_line = 0;
+	size_t old_lines = 0;
+	if (first < layout->paragraphs.length)
+	{
+		first_line = layout->paragraphs.items[first].first_line;
+		Paragraph last = layout->paragraphs.items[first + count - 1];
+		old_lines = last.first_line + last.line_count - first_line;
+	}
+
+	split_paragraphs(layout, start, end, first_line);
+	array_splice(&layout->paragraphs, first, count, layout->split.items, layout->split.length);
+	array_splice(&layout->line_starts, first_line, old_lines, layout->wrapped.items, layout->wrapped.length);
+
+	ptrdiff_t line_delta = (ptrdiff_t)layout->wrapped.length - (ptrdiff_t)old_lines;
+	for (size_t i = first + layout->split.length; i < layout->paragraphs.length; ++i)
+	{
+		layout->paragraphs.items[i].start += byte_delta;
+		layout->paragraphs.items[i].first_line += line_delta;
+	}
+}
+
+// Last paragraph starting at or before offset
+static size_t find_paragraph(const ParagraphLayout *layout, size_t offset)
+{
+	size_t low = 0;
+	size_t high = layout->paragraphs.length;
+	while (high - low > 1)
+	{
+		size_t middle = low + (high - low) / 2;
+		if (layout->paragraphs.items[middle].start <= offset)
+			low = middle;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// Paragraph holding the wrapped line
+static size_t find_paragraph_of_line(const ParagraphLayout *layout, size_t line)
+{
+	size_t low = 0;
+	size_t high = layout->paragraphs.length;
+	while (high - low > 1)
+	{
+		size_t middle = low + (high - low) / 2;
+		if (layout->paragraphs.items[middle].first_line <= line)
+			low = middle;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+static void terminate_text(ParagraphLayout *layout)
+{
+	array_append(&layout->text, '\0');
+	layout->text.length--;
+}
+
+void paragraph_layout_set_text(ParagraphLayout *layout, const char *text, size_t length)
+{
+	layout->text.length = 0;
+	array_splice(&layout->text, 0, 0, text, length);
+	terminate_text(layout);
+
+	layout->paragraphs.length = 0;
+	layout->line_starts.length = 0;
+	reflow(layout, 0, 0, 0, length, 0);
+}
+
+void paragraph_layout_edit(ParagraphLayout *layout, size_t offset, size_t remove, const char *insert, size_t insert_length)
+{
+	assert(offset + remove <= layout->text.length);
+
+	// Both ends of the range are inside a paragraph or at its line break,
+	// so the paragraphs from first to last cover every changed byte
+	size_t first = find_paragraph(layout, offset);
+	size_t last = find_paragraph(layout, offset + remove);
+	size_t start = layout->paragraphs.items[first].start;
+	size_t end = layout->paragraphs.items[last].start + layout->paragraphs.items[last].length;
+
+	array_splice(&layout->text, offset, remove, insert, insert_length);
+	terminate_text(layout);
+
+	ptrdiff_t byte_delta = (ptrdiff_t)insert_length - (ptrdiff_t)remove;
+	reflow(layout, first, last - first + 1, start, end + byte_delta, byte_delta);
+}
+
+void paragraph_layout_set_width(ParagraphLayout *layout, int width)
+{
+	if (width == layout->width) return;
+	layout->width = width;
+
+	// Lines are rebuilt in order into wrapped, which then becomes the
+	// line table, so every paragraph is visited once
+	layout->wrapped.length = 0;
+	for (size_t i = 0; i < layout->paragraphs.length; ++i)
+	{
+		Paragraph *paragraph = &layout->paragraphs.items[i];
+		size_t first_line = layout->wrapped.length;
+		if (paragraph->line_count == 1 && (width <= 0 || paragraph->widest_line <= width))
+		{
+			array_append(&layout->wrapped, 0);
+		}
+		else
+		{
+			paragraph->line_count = wrap_paragraph(layout, layout->text.items + paragraph->start, paragraph->length, &paragraph->widest_line);
+		}
+		paragraph->first_line = first_line;
+	}
+
+	uint32_t *line_starts = layout->line_starts.items;
+	size_t capacity = layout->line_starts.capacity;
+	layout->line_starts.items = layout->wrapped.items;
+	layout->line_starts.length = layout->wrapped.length;
+	layout->line_starts.capacity = layout->wrapped.capacity;
+	layout->wrapped.items = line_starts;
+	layout->wrapped.length = 0;
+	layout->wrapped.capacity = capacity;
+}
+
+size_t paragraph_layout_line_count(const ParagraphLayout *layout)
+{
+	Paragraph last = layout->paragraphs.items[layout->paragraphs.length - 1];
+	return last.first_line + last.line_count;
+}
+
+float paragraph_layout_height(const ParagraphLayout *layout)
+{
+	return (float)paragraph_layout_line_count(layout) * layout->line_height;
+}
+
+static void reserve_drawn_lines(ParagraphLayout *layout, size_t glyphs)
+{
+	size_t capacity = layout->drawn_line_capacity * 2;
+	layout->drawn_line_capacity = (capacity > glyphs) ? capacity : glyphs;
+	for (size_t i = 0; i < layout->drawn_lines.length; ++i)
+	{
+		array_reserve(&layout->drawn_lines.items[i].glyphs, layout->drawn_line_capacity);
+	}
+}
+
+void draw_paragraph_layout(Image image, ParagraphLayout *layout, Vec2 position, float scroll, Color text_color)
+{
+	if (clip_is_empty(image)) return;
+
+	// Glyphs can reach into the lines next to theirs
+	float top = position.y - scroll;
+	ptrdiff_t first = (ptrdiff_t)floorf((image.clip.y - top) / layout->line_height) - 1;
+	ptrdiff_t last = (ptrdiff_t)ceilf((image.clip.y + image.clip.h - top) / layout->line_height) + 1;
+	ptrdiff_t line_count = paragraph_layout_line_count(layout);
+	if (first < 0) first = 0;
+	if (last > line_count) last = line_count;
+	if (first >= last) return;
+
+	// Every visible line needs a layout of its own. Sized for the most
+	// lines the clip can overlap at any scroll, so scrolling keeps it.
+	size_t slots = (size_t)ceilf(image.clip.h / (float)layout->line_height) + 3;
+	while (layout->drawn_lines.length < slots)
+	{
+		array_append(&layout->drawn_lines, (TextLayout){0});
+		array_reserve(&layout->drawn_lines.items[layout->drawn_lines.length - 1].glyphs, layout->drawn_line_capacity);
+	}
+
+	size_t p = find_paragraph_of_line(layout, first);
+	for (ptrdiff_t line = first; line < last; ++line)
+	{
+		while (line >= (ptrdiff_t)(layout->paragraphs.items[p].first_line + layout->paragraphs.items[p].line_count))
+			p++;
+
+		Paragraph paragraph = layout->paragraphs.items[p];
+		size_t index = line - paragraph.first_line;
+		size_t line_start = layout->line_starts.items[paragraph.first_line + index];
+		size_t line_end = (index + 1 < paragraph.line_count)
+			? layout->line_starts.items[paragraph.first_line + index + 1]
+			: paragraph.length;
+		if (line_end == line_start) continue;
+
+		const char *text = layout->text.items + paragraph.start + line_start;
+		size_t length = line_end - line_start;
+		TextLayout *line_layout = &layout->drawn_lines.items[line % layout->drawn_lines.length];
+		uint64_t hash = text_layout_hash(layout->font, text, length, layout->size);
+		if (line_layout->font.data == NULL || line_layout->hash != hash)
+		{
+			// A line has at most one glyph per byte
+			if (length > layout->drawn_line_capacity)
+			{
+				reserve_drawn_lines(layout, length);
+			}
+			layout->scratch.length = 0;
+			array_splice(&layout->scratch, 0, 0, text, length);
+			array_append(&layout->scratch, '\0');
+			layout_text(line_layout, layout->font, layout->scratch.items, layout->size);
+		}
+
+		Vec2 line_position = {.x = position.x, .y = top + (float)line * layout->line_height};
+		draw_text_layout(image, line_layout, line_position, text_color);
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "basic.h"
+#include "drawing.h"
+
+// Word wrapped layout of a long text split into paragraphs at line
+// breaks. Every paragraph keeps where its wrapped lines start, so an edit
+// only wraps the paragraphs it touches again and drawing only visits the
+// lines inside the clip.
+
+typedef struct
+{
+	// Bytes of the paragraph in the text, without its line break
+	size_t start;
+	size_t length;
+	// Index of its first wrapped line in the whole text
+	size_t first_line;
+	// At least one, even for an empty paragraph
+	size_t line_count;
+	// Pixels, decides whether a new width has to wrap it again
+	int widest_line;
+} Paragraph;
+
+typedef struct
+{
+	Font font;
+	int size;
+	int line_height;
+	// Lines are wrapped to this many pixels, zero or less never wraps
+	int width;
+
+	// Followed by a NUL that length does not count
+	ARRAY(char) text;
+	ARRAY(Paragraph) paragraphs;
+	// Start of every wrapped line relative to its paragraph
+	ARRAY(uint32_t) line_starts;
+
+	// Layouts of the lines drawn last, line i is kept at i modulo the
+	// length and laid out again when the hash of its text changes. So
+	// scrolling and edits elsewhere keep the layouts of unchanged lines
+	// and draw lists see the same hashes for them.
+	ARRAY(TextLayout) drawn_lines;
+	// Glyphs every drawn line has room for, grown for all of them at
+	// once so scrolling stops allocating after the longest lines
+	size_t drawn_line_capacity;
+
+	// Reused by edits and drawing so they do not allocate once large
+	// enough. A line being laid out is copied to scratch.
+	ARRAY(Paragraph) split;
+	ARRAY(uint32_t) wrapped;
+	ARRAY(char) scratch;
+} ParagraphLayout;
+
+void paragraph_layout_init(ParagraphLayout *layout, Font font, int size, int width);
+void free_paragraph_layout(ParagraphLayout *layout);
+
+// Replaces the whole text and wraps every paragraph
+void paragraph_layout_set_text(ParagraphLayout *layout, const char *text, size_t length);
+// Replaces remove bytes at offset with the inserted ones, only the
+// paragraphs touching that range are wrapped again
+void paragraph_layout_edit(ParagraphLayout *layout, size_t offset, size_t remove, const char *insert, size_t insert_length);
+// Paragraphs that fit on one line at both widths are not wrapped again
+void paragraph_layout_set_width(ParagraphLayout *layout, int width);
+
+size_t paragraph_layout_line_count(const ParagraphLayout *layout);
+float paragraph_layout_height(const ParagraphLayout *layout);
+
+// Draws the lines overlapping the clip of the image, the first line is
+// at position moved up by scroll. Draw lists keep the line layouts, so
+// a layout is drawn at most once per frame.
+void draw_paragraph_layout(Image image, ParagraphLayout *layout, Vec2 position, float scroll, Color text_color);
@@ -0,0 +1,402 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *profile_zone_names[PROFILE_ZONE_COUNT] = {
+	[PROFILE_FRAME] = "frame",
+	[PROFILE_DRAW_VIEW] = "draw_view",
+	[PROFILE_SCROLL_VIEW] = "scroll view",
+	[PROFILE_PANEL_VIEW] = "panel view",
+	[PROFILE_RECT_VIEW] = "rect view",
+	[PROFILE_TEXT_VIEW] = "text view",
+	[PROFILE_NOTE_VIEW] = "note view",
+	[PROFILE_RASTERIZE] = "rasterize",
+	[PROFILE_DRAW_TEXT] = "draw_text",
+	[PROFILE_DRAW_IMAGE] = "draw_image",
+	[PROFILE_PRESENT] = "present",
+	[PROFILE_HOT_RELOAD] = "hot reload",
+	[PROFILE_TRACE_FLUSH] = "trace flush",
+};
+
+static const int profile_zone_depth[PROFILE_ZONE_COUNT] = {
+	[PROFILE_FRAME] = 0,
+	[PROFILE_DRAW_VIEW] = 1,
+	[PROFILE_SCROLL_VIEW] = 2,
+	[PROFILE_PANEL_VIEW] = 2,
+	[PROFILE_RECT_VIEW] = 2,
+	[PROFILE_TEXT_VIEW] = 2,
+	[PROFILE_NOTE_VIEW] = 2,
+	[PROFILE_RASTERIZE] = 1,
+	[PROFILE_DRAW_TEXT] = 2,
+	[PROFILE_DRAW_IMAGE] = 2,
+	[PROFILE_PRESENT] = 0,
+	[PROFILE_HOT_RELOAD] = 0,
+	[PROFILE_TRACE_FLUSH] = 0,
+};
+
+// Every thread only touches its own counters while a frame is drawn
+static ProfileFrame profile_threads[THREAD_POOL_MAX_THREADS];
+
+static ProfileFrame profile_frames[PROFILE_FRAME_COUNT];
+static int profile_frame_next = 0;
+static int profile_frames_recorded = 0;
+
+// Allocation counters of a frame are kept as events too
+#define PROFILE_EVENT_ALLOCS PROFILE_ZONE_COUNT
+
+typedef struct
+{
+	uint64_t start;
+	union
+	{
+		uint64_t duration;
+		AllocStats allocs;
+	};
+	ProfileZone zone;
+} ProfileEvent;
+
+// Only the owning thread appends, flushing happens between frames
+typedef struct
+{
+	ProfileEvent *events;
+	size_t count;
+	size_t dropped;
+	bool named;
+} ProfileTraceBuffer;
+
+static ProfileTraceBuffer profile_trace_buffers[THREAD_POOL_MAX_THREADS];
+static FILE *profile_trace_file = NULL;
+static bool profile_trace_exit_registered = false;
+
+static void profile_trace_push(int thread, ProfileEvent event);
+
+ProfileScope profile_begin(ProfileZone zone)
+{
+	return (ProfileScope){.zone = zone, .start = time_ns()};
+}
+
+void profile_end(ProfileScope scope)
+{
+	profile_add(scope.zone, time_ns() - scope.start);
+}
+
+void profile_add(ProfileZone zone, uint64_t ns)
+{
+	profile_add_at(zone, time_ns() - ns, ns);
+}
+
+void profile_add_at(ProfileZone zone, uint64_t start, uint64_t ns)
+{
+	assert(zone < PROFILE_ZONE_COUNT);
+
+	const int thread = thread_pool_thread_index();
+	ProfileFrame *counters = &profile_threads[thread];
+	counters->ns[zone] += ns;
+	counters->count[zone]++;
+
+	profile_trace_push(thread, (ProfileEvent){
+		.start = start, .duration = ns, .zone = zone
+	});
+}
+
+static void profile_trace_push(int thread, ProfileEvent event)
+{
+	if (profile_trace_file == NULL) return;
+
+	ProfileTraceBuffer *buffer = &profile_trace_buffers[thread];
+	if (buffer->count == PROFILE_TRACE_CAPACITY)
+	{
+		buffer->dropped++;
+		return;
+	}
+	buffer->events[buffer->count++] = event;
+}
+
+void profile_frame_end(AllocStats allocs)
+{
+	ProfileFrame *frame = &profile_frames[profile_frame_next];
+	memset(frame, 0, sizeof(ProfileFrame));
+	frame->allocs = allocs;
+	profile_trace_push(thread_pool_thread_index(), (ProfileEvent){
+		.start = time_ns(), .allocs = allocs, .zone = PROFILE_EVENT_ALLOCS
+	});
+
+	for (int t = 0; t < THREAD_POOL_MAX_THREADS; ++t)
+	{
+		for (int zone = 0; zone < PROFILE_ZONE_COUNT; ++zone)
+		{
+			frame->ns[zone] += profile_threads[t].ns[zone];
+			frame->count[zone] += profile_threads[t].count[zone];
+		}
+	}
+	memset(profile_threads, 0, sizeof(profile_threads));
+
+	profile_frame_next = (profile_frame_next + 1) % PROFILE_FRAME_COUNT;
+	if (profile_frames_recorded < PROFILE_FRAME_COUNT) profile_frames_recorded++;
+
+	if (profile_trace_file == NULL) return;
+
+	// Flushed early enough that a frame rarely drops events
+	for (int t = 0; t < THREAD_POOL_MAX_THREADS; ++t)
+	{
+		if (profile_trace_buffers[t].count > PROFILE_TRACE_CAPACITY / 2)
+		{
+			profile_trace_flush();
+			break;
+		}
+	}
+}
+
+const ProfileFrame *profile_frame(int frames_ago)
+{
+	if (frames_ago < 0 || frames_ago >= profile_frames_recorded) return NULL;
+
+	int index = (profile_frame_next - 1 - frames_ago + PROFILE_FRAME_COUNT) % PROFILE_FRAME_COUNT;
+	return &profile_frames[index];
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// In milliseconds
+void profile_frame_percentiles(double *p50, double *p90, double *p99)
+{
+	*p50 = *p90 = *p99 = 0.0;
+	if (profile_frames_recorded == 0) return;
+
+	uint64_t times[PROFILE_FRAME_COUNT];
+	int count = profile_frames_recorded;
+	for (int i = 0; i < count; ++i)
+	{
+		times[i] = profile_frame(i)->ns[PROFILE_FRAME];
+	}
+	qsort(times, count, sizeof(uint64_t), compare_u64);
+
+	*p50 = times[count * 50 / 100] / 1e6;
+	*p90 = times[count * 90 / 100] / 1e6;
+	*p99 = times[count * 99 / 100] / 1e6;
+}
+
+#define PROFILE_OVERLAY_TEXT_SIZE 16
+#define PROFILE_OVERLAY_LINE 20
+#define PROFILE_OVERLAY_PADDING 8
+#define PROFILE_OVERLAY_NAME_WIDTH 180
+#define PROFILE_OVERLAY_BAR_WIDTH 160
+#define PROFILE_OVERLAY_WIDTH 440
+#define PROFILE_OVERLAY_GRAPH_HEIGHT 40
+// A full bar is a whole frame at 60 fps
+#define PROFILE_OVERLAY_BUDGET_NS 16666667.0
+
+// Frame time percentiles, allocations of the last frame, the frame times
+// of the ring as a graph and the average time of every zone as bars
+void draw_profile_overlay(Image image, Font font, Vec2 position)
+{
+	const int zone_lines = PROFILE_ZONE_COUNT;
+	const float height = 2*PROFILE_OVERLAY_PADDING + PROFILE_OVERLAY_GRAPH_HEIGHT +
+	                     (zone_lines + 2) * PROFILE_OVERLAY_LINE + PROFILE_OVERLAY_PADDING;
+	draw_rounded_rect(image, (Vec4){
+		.x = position.x, .y = position.y, .w = PROFILE_OVERLAY_WIDTH, .h = height
+	}, (Color){.rgba = 0xC0202020}, 6.0f);
+
+	float x = position.x + PROFILE_OVERLAY_PADDING;
+	float y = position.y + PROFILE_OVERLAY_PADDING;
+
+	double p50, p90, p99;
+	profile_frame_percentiles(&p50, &p90, &p99);
+
+	char line[96];
+	snprintf(line, sizeof(line), "p50 %.2f  p90 %.2f  p99 %.2f ms", p50, p90, p99);
+	draw_text(image, font, line, PROFILE_OVERLAY_TEXT_SIZE, (Vec2){.x = x, .y = y}, COLOR_WHITE);
+	y += PROFILE_OVERLAY_LINE;
+
+	const ProfileFrame *last = profile_frame(0);
+	if (last != NULL)
+	{
+		snprintf(line, sizeof(line), "allocs %lld  bytes %lld  frees %lld",
+		         (long long)last->allocs.calls, (long long)last->allocs.bytes, (long long)last->allocs.frees);
+		draw_text(image, font, line, PROFILE_OVERLAY_TEXT_SIZE, (Vec2){.x = x, .y = y}, COLOR_WHITE);
+	}
+	y += PROFILE_OVERLAY_LINE;
+
+	// Oldest frame on the left, frames over budget in red
+	const float graph_width = PROFILE_OVERLAY_WIDTH - 2*PROFILE_OVERLAY_PADDING;
+	const float column = graph_width / PROFILE_FRAME_COUNT;
+	for (int i = 0; i < PROFILE_FRAME_COUNT; ++i)
+	{
+		const ProfileFrame *frame = profile_frame(PROFILE_FRAME_COUNT - 1 - i);
+		if (frame == NULL) continue;
+
+		double t = frame->ns[PROFILE_FRAME] / PROFILE_OVERLAY_BUDGET_NS;
+		float bar = PROFILE_OVERLAY_GRAPH_HEIGHT * clamp(t, 0.0f, 1.0f);
+		if (bar < 1.0f) bar = 1.0f;
+		draw_rect(image, (Vec4){
+			.x = x + i * column,
+			.y = y + PROFILE_OVERLAY_GRAPH_HEIGHT - bar,
+			.w = column,
+			.h = bar,
+		}, t > 1.0 ? COLOR_RED : COLOR_GREEN);
+	}
+	y += PROFILE_OVERLAY_GRAPH_HEIGHT + PROFILE_OVERLAY_PADDING;
+
+	for (int zone = 0; zone < PROFILE_ZONE_COUNT; ++zone)
+	{
+		double total = 0.0;
+		int frames = 0;
+		for (; frames < PROFILE_FRAME_COUNT; ++frames)
+		{
+			const ProfileFrame *frame = profile_frame(frames);
+			if (frame == NULL) break;
+			total += frame->ns[zone];
+		}
+		double average = (frames > 0) ? total / frames : 0.0;
+
+		float indent = profile_zone_depth[zone] * PROFILE_OVERLAY_TEXT_SIZE;
+		draw_text(image, font, profile_zone_names[zone], PROFILE_OVERLAY_TEXT_SIZE,
+		          (Vec2){.x = x + indent, .y = y}, COLOR_WHITE);
+
+		float bar_x = x + PROFILE_OVERLAY_NAME_WIDTH;
+		float bar = PROFILE_OVERLAY_BAR_WIDTH * clamp(average / PROFILE_OVERLAY_BUDGET_NS, 0.0f, 1.0f);
+		draw_rect(image, (Vec4){
+			.x = bar_x, .y = y + 4, .w = PROFILE_OVERLAY_BAR_WIDTH, .h = PROFILE_OVERLAY_LINE - 8
+		}, (Color){.rgba = 0x40FFFFFF});
+		draw_rect(image, (Vec4){
+			.x = bar_x, .y = y + 4, .w = bar, .h = PROFILE_OVERLAY_LINE - 8
+		}, (Color){.r = 255, .g = 165, .b = 0, .a = 255});
+
+		snprintf(line, sizeof(line), "%.2f", average / 1e6);
+		draw_text(image, font, line, PROFILE_OVERLAY_TEXT_SIZE,
+		          (Vec2){.x = bar_x + PROFILE_OVERLAY_BAR_WIDTH + PROFILE_OVERLAY_PADDING, .y = y}, COLOR_WHITE);
+		y += PROFILE_OVERLAY_LINE;
+	}
+}
+
+static void profile_trace_exit(void)
+{
+	profile_trace_stop();
+}
+
+// Events are written as a JSON array which is only closed when tracing
+// stops, every event after the first is preceded by a comma so appending
+// to an unfinished trace stays valid
+bool profile_trace_start(const char *path, bool append)
+{
+	assert(path != NULL);
+	if (profile_trace_file != NULL) profile_trace_stop();
+
+	FILE *file = NULL;
+	if (append)
+	{
+		file = fopen(path, "r+b");
+
+		// The closing bracket written when tracing stopped is replaced,
+		// a trace that was never closed is continued as is
+		char end[2] = {0};
+		if (file != NULL && fseek(file, -2, SEEK_END) == 0 && fread(end, 1, 2, file) == 2)
+		{
+			fseek(file, (end[0] == ']' && end[1] == '\n') ? -2 : 0, SEEK_END);
+		}
+		else if (file != NULL)
+		{
+			fclose(file);
+			file = NULL;
+		}
+	}
+
+	if (file == NULL)
+	{
+		file = fopen(path, "wb");
+		if (file == NULL)
+		{
+			fprintf(stderr, "ERROR: Failed to open trace file %s\n", path);
+			return false;
+		}
+		fprintf(file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"everything\"}}");
+	}
+	profile_trace_file = file;
+
+	// Every buffer up front, so pushing an event never allocates on the
+	// pool threads. Pages of threads that never run stay untouched.
+	for (int t = 0; t < THREAD_POOL_MAX_THREADS; ++t)
+	{
+		profile_trace_buffers[t].events = mem_alloc(PROFILE_TRACE_CAPACITY * sizeof(ProfileEvent));
+		assert(profile_trace_buffers[t].events != NULL);
+	}
+
+	if (!profile_trace_exit_registered)
+	{
+		atexit(profile_trace_exit);
+		profile_trace_exit_registered = true;
+	}
+
+	fprintf(stderr, "INFO: Tracing to %s\n", path);
+	return true;
+}
+
+void profile_trace_flush(void)
+{
+	if (profile_trace_file == NULL) return;
+
+	ProfileScope scope = profile_begin(PROFILE_TRACE_FLUSH);
+	FILE *file = profile_trace_file;
+	for (int t = 0; t < THREAD_POOL_MAX_THREADS; ++t)
+	{
+		ProfileTraceBuffer *buffer = &profile_trace_buffers[t];
+		if (buffer->count == 0 && buffer->dropped == 0) continue;
+
+		if (!buffer->named)
+		{
+			char name[32] = "main";
+			if (t > 0) snprintf(name, sizeof(name), "worker %d", t);
+			fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			        "\"args\":{\"name\":\"%s\"}}", t, name);
+			buffer->named = true;
+		}
+
+		for (size_t i = 0; i < buffer->count; ++i)
+		{
+			ProfileEvent *event = &buffer->events[i];
+			if (event->zone == PROFILE_EVENT_ALLOCS)
+			{
+				fprintf(file, ",\n{\"name\":\"allocations\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+				        "\"args\":{\"calls\":%lld,\"bytes\":%lld}}", event->start / 1e3,
+				        (long long)event->allocs.calls, (long long)event->allocs.bytes);
+				continue;
+			}
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+			        profile_zone_names[event->zone], event->start / 1e3, event->duration / 1e3, t);
+		}
+
+		if (buffer->dropped > 0)
+		{
+			fprintf(stderr, "WARNING: Dropped %zu trace events of thread %d\n", buffer->dropped, t);
+		}
+		buffer->count = 0;
+		buffer->dropped = 0;
+	}
+	fflush(file);
+
+	// Only lands in the next flush
+	profile_end(scope);
+}
+
+void profile_trace_stop(void)
+{
+	if (profile_trace_file == NULL) return;
+
+	profile_trace_flush();
+	fprintf(profile_trace_file, "\n]\n");
+	fclose(profile_trace_file);
+	profile_trace_file = NULL;
+
+	for (int t = 0; t < THREAD_POOL_MAX_THREADS; ++t)
+	{
+		mem_free(profile_trace_buffers[t].events);
+		profile_trace_buffers[t] = (ProfileTraceBuffer){0};
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "basic.h"
+#include "drawing.h"
+
+// Zones are listed depth first, the overlay indents them by their depth
+typedef enum
+{
+	PROFILE_FRAME,
+	PROFILE_DRAW_VIEW,
+	PROFILE_SCROLL_VIEW,
+	PROFILE_PANEL_VIEW,
+	PROFILE_RECT_VIEW,
+	PROFILE_TEXT_VIEW,
+	PROFILE_NOTE_VIEW,
+	PROFILE_RASTERIZE,
+	PROFILE_DRAW_TEXT,
+	PROFILE_DRAW_IMAGE,
+	// Measured by the platform for the previous frame
+	PROFILE_PRESENT,
+	PROFILE_HOT_RELOAD,
+	PROFILE_TRACE_FLUSH,
+	PROFILE_ZONE_COUNT,
+} ProfileZone;
+
+// Frames kept for the overlay and percentiles
+#define PROFILE_FRAME_COUNT 120
+
+typedef struct
+{
+	ProfileZone zone;
+	uint64_t start;
+} ProfileScope;
+
+typedef struct
+{
+	uint64_t ns[PROFILE_ZONE_COUNT];
+	uint32_t count[PROFILE_ZONE_COUNT];
+	// Allocations made during the frame
+	AllocStats allocs;
+} ProfileFrame;
+
+// Zones may be timed on any thread of the pool, time spent in a zone on
+// several threads at once adds up
+ProfileScope profile_begin(ProfileZone zone);
+void profile_end(ProfileScope scope);
+void profile_add(ProfileZone zone, uint64_t ns);
+// For zones timed elsewhere, start is in time_ns() time
+void profile_add_at(ProfileZone zone, uint64_t start, uint64_t ns);
+
+// Collects the zones of every thread into the frame ring, call it once
+// per frame when no other thread is timing zones
+void profile_frame_end(AllocStats allocs);
+// Frame from frames_ago frames back, NULL when not recorded yet
+const ProfileFrame *profile_frame(int frames_ago);
+
+// Percentiles of the time of the frame zone over the recorded frames
+void profile_frame_percentiles(double *p50, double *p90, double *p99);
+
+void draw_profile_overlay(Image image, Font font, Vec2 position);
+
+// While tracing every zone is also kept as an event in a buffer of the
+// thread timing it. The events are written as Chrome trace JSON, which
+// Perfetto and chrome://tracing open, when the buffers fill up, when
+// tracing stops and at exit.
+#define PROFILE_TRACE_ENV "EVERYTHING_TRACE"
+#define PROFILE_TRACE_CAPACITY 16384
+
+// Appending continues a trace of an earlier run of the library, like one
+// from before a hot reload
+bool profile_trace_start(const char *path, bool append);
+void profile_trace_stop(void);
+void profile_trace_flush(void);
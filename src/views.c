@@ -1,4 +1,5 @@
 #include "basic.h"
+#include "profiler.h"
 #include "views.h"
 
 #include <math.h>
@@ -8,6 +9,7 @@
 void new_view(View* view, const ViewArgs* args)
 {
 	view->rect = args->rect;
+	view->opacity = (args->opacity > 0.0f) ? args->opacity : 1.0f;
 }
 
 Vec2 mouse_position(Env* env)
@@ -19,40 +21,56 @@ Vec2 mouse_position(Env* env)
 	};
 }
 
-Env new_env(Env* env, int width, int height)
+// Returns true when the view or one of its children is animating
+bool draw_view_clipped(View* view, Image image, Env *env, Arena *arena)
 {
-	assert (env != NULL);
-	Env new_env = *env;
-	new_env.width = width;
-	new_env.height = height;
-	size_t size = width * height * sizeof(Color);
-	new_env.buffer = malloc(size);
-	assert (new_env.buffer != NULL);
-	memset(new_env.buffer, 0, size);
-	return new_env;
-}
+	Vec4 rect = v4_add_v2(view->rect, view->offset);
 
-void draw_view(View* view, Env *env)
-{
-	assert(view != NULL);
-	assert(env != NULL);
+	// The view and its children can only draw inside its rect
+	Image target = clip_image(image, rect);
+	if (clip_is_empty(target)) return false;
 
-	Vec4 rect = v4_add_v2(view->rect, view->offset);
-	Env off_canvas = new_env(env, env->width, env->height);
+	const bool has_layer = view->opacity < 1.0f;
+	if (has_layer)
+	{
+		target = begin_layer(target, arena);
+	}
+
+	view->animating = false;
 	if (view->draw != NULL)
 	{
-		view->draw(view, rect, &off_canvas);
+		view->draw(view, rect, target, env);
 	}
+	bool animating = view->animating;
 
-    Vec2 child_offset = { .x = rect.x, .y = rect.y };
+	Vec2 child_offset = { .x = rect.x, .y = rect.y };
 	for (size_t i=0; i < view->children.length; i++)
 	{
 		View* child = view->children.items[i];
 		child->offset = child_offset;
-		draw_view(child, &off_canvas);
+		animating |= draw_view_clipped(child, target, env, arena);
 	}
-	draw_image(image_from_env(env), image_from_env(&off_canvas), rect, &rect);
-	free(off_canvas.buffer);
+
+	if (has_layer)
+	{
+		end_layer(image, target, view->opacity);
+	}
+	return animating;
+}
+
+// Layers for group opacity are allocated from the arena, the image may
+// be recording into a draw list. Returns true when a view needs another
+// frame.
+bool draw_view(View* view, Image image, Env *env, Arena *arena)
+{
+	assert(view != NULL);
+	assert(env != NULL);
+	assert(arena != NULL);
+
+	ProfileScope scope = profile_begin(PROFILE_DRAW_VIEW);
+	bool animating = draw_view_clipped(view, image, env, arena);
+	profile_end(scope);
+	return animating;
 }
 
 void destroy_view(View* view)
@@ -67,16 +85,21 @@ void destroy_view(View* view)
 		array_free(&view->children);
 	}
 
-	free(view);
+	if (view->destroy != NULL)
+	{
+		view->destroy(view);
+	}
+
+	mem_free(view);
 	view = NULL;
 }
 
 #define SCROLL_BAR_THICKNESS 10
 
-void draw_scroll_view(View* view, Vec4 rect, Env *env)
+void draw_scroll_view(View* view, Vec4 rect, Image image, Env *env)
 {
 	ScrollView* scroll_view = (ScrollView*) view;
-	Image image = image_from_env(env);
+	ProfileScope scope = profile_begin(PROFILE_SCROLL_VIEW);
 
 	float total_scroll = 0.0f;
 	float item_size = 0.0f;
@@ -139,7 +162,9 @@ void draw_scroll_view(View* view, Vec4 rect, Env *env)
 	Color scroll_bar_color = COLOR_RED;
 	Vec2 mouse_pos = mouse_position(env);
 
-	if (inside_rect(mouse_pos, scroll_bar) && env->mouse_left_down)
+	scroll_view->is_dragging = inside_rect(mouse_pos, scroll_bar) && env->mouse_left_down;
+	view->animating = scroll_view->is_dragging;
+	if (scroll_view->is_dragging)
 	{
 		if (scroll_view->axis == DIRECTION_HORIZONTAL)
 		{
@@ -164,12 +189,13 @@ void draw_scroll_view(View* view, Vec4 rect, Env *env)
 	}
 
 	draw_rect(image, scroll_bar_button, scroll_bar_color);
+	profile_end(scope);
 }
 
 ScrollView* new_scroll_view(ScrollViewArgs* args)
 {
 	assert(args != NULL);
-	ScrollView* view = malloc(sizeof(ScrollView));
+	ScrollView* view = mem_alloc(sizeof(ScrollView));
 	memset(view, 0, sizeof(ScrollView));
 	new_view((View*)view, (ViewArgs*)args);
 	view->base.draw = draw_scroll_view;
@@ -177,17 +203,20 @@ ScrollView* new_scroll_view(ScrollViewArgs* args)
 	return view;
 }
 
-void draw_rectangle_view(View* view, Vec4 rect, Env *env)
+void draw_rectangle_view(View* view, Vec4 rect, Image image, Env *env)
 {
 	RectView* rect_view = (RectView*) view;
-	Image image = image_from_env(env);
+	unused(env);
+
+	ProfileScope scope = profile_begin(PROFILE_RECT_VIEW);
 	draw_rect(image, rect, rect_view->color);
+	profile_end(scope);
 }
 
 RectView* new_rect_view(RectViewArgs* args)
 {
 	assert(args != NULL);
-	RectView* view = malloc(sizeof(RectView));
+	RectView* view = mem_alloc(sizeof(RectView));
 	memset(view, 0, sizeof(RectView));
 	new_view((View*)view, (ViewArgs*)args);
 	view->base.draw = draw_rectangle_view;
@@ -195,43 +224,145 @@ RectView* new_rect_view(RectViewArgs* args)
 	return view;
 }
 
-void draw_text_view(View* view, Vec4 rect, Env *env)
+void draw_text_view(View* view, Vec4 rect, Image image, Env *env)
 {
 	TextView* text_view = (TextView*) view;
-	Image image = image_from_env(env);
+	unused(env);
+
+	ProfileScope scope = profile_begin(PROFILE_TEXT_VIEW);
+	TextLayout *layout = &text_view->layout;
+	if (text_view->layout_dirty ||
+	        text_view->laid_out_text != text_view->text ||
+	        layout->font.data != text_view->font.data ||
+	        layout->size != text_view->text_size)
+	{
+		layout_text(layout, text_view->font, text_view->text, text_view->text_size);
+		text_view->laid_out_text = text_view->text;
+		text_view->layout_dirty = false;
+	}
 
-	draw_text(
+	draw_text_layout(
 	    image,
-	    text_view->font,
-	    text_view->text,
-	    text_view->text_size,
+	    layout,
 	    (Vec2)
 		{
 			.x = rect.x, .y = rect.y
 		},
 		text_view->text_color
 	);
+	profile_end(scope);
+}
 
+void destroy_text_view(View* view)
+{
+	TextView* text_view = (TextView*) view;
+	free_text_layout(&text_view->layout);
+}
+
+void text_view_set_text(TextView* view, const char *text)
+{
+	view->text = text;
+	view->layout_dirty = true;
 }
 
 TextView* new_text_view(TextViewArgs* args)
 {
 	assert(args != NULL);
-	TextView* view = malloc(sizeof(TextView));
+	TextView* view = mem_alloc(sizeof(TextView));
 	memset(view, 0, sizeof(TextView));
 	new_view((View*)view, (ViewArgs*)args);
 	view->base.draw = draw_text_view;
+	view->base.destroy = destroy_text_view;
 	view->font = args->font;
 	view->text = args->text;
 	view->text_size = args->text_size;
 	view->text_color = args->text_color;
+	view->layout_dirty = true;
+	return view;
+}
+
+void draw_note_view(View* view, Vec4 rect, Image image, Env *env)
+{
+	NoteView* note_view = (NoteView*) view;
+	ProfileScope scope = profile_begin(PROFILE_NOTE_VIEW);
+
+	ParagraphLayout *layout = &note_view->layout;
+	paragraph_layout_set_width(layout, rect.w - SCROLL_BAR_THICKNESS);
+
+	float total_scroll = fmaxf(paragraph_layout_height(layout) - rect.h, 0.0f);
+	Vec4 scroll_bar = {
+		.x = rect.x + rect.w - SCROLL_BAR_THICKNESS,
+		.y = rect.y,
+		.w = SCROLL_BAR_THICKNESS,
+		.h = rect.h,
+	};
+
+	note_view->is_dragging = inside_rect(mouse_position(env), scroll_bar) && env->mouse_left_down;
+	view->animating = note_view->is_dragging;
+	if (note_view->is_dragging)
+	{
+		note_view->scroll = (env->mouse_y - rect.y) / scroll_bar.h * total_scroll;
+	}
+	note_view->scroll = clamp(note_view->scroll, 0, total_scroll);
+
+	draw_paragraph_layout(
+	    image,
+	    layout,
+	    (Vec2)
+		{
+			.x = rect.x, .y = rect.y
+		},
+		note_view->scroll,
+		note_view->text_color
+	);
+
+	// The button is as tall as the share of the text in view
+	int scroll_bar_button_size = fmaxf(rect.h * rect.h / (total_scroll + rect.h), SCROLL_BAR_THICKNESS);
+	Vec4 scroll_bar_button = scroll_bar;
+	scroll_bar_button.h = scroll_bar_button_size;
+	if (total_scroll > 0.0f)
+	{
+		scroll_bar_button.y += note_view->scroll / total_scroll * (rect.h - scroll_bar_button_size);
+	}
+
+	draw_rect(image, scroll_bar, (Color){.rgba=0X60EEEEEE});
+	draw_rect(image, scroll_bar_button, COLOR_RED);
+	profile_end(scope);
+}
+
+void destroy_note_view(View* view)
+{
+	NoteView* note_view = (NoteView*) view;
+	free_paragraph_layout(&note_view->layout);
+}
+
+void note_view_edit(NoteView* view, size_t offset, size_t remove, const char *insert, size_t insert_length)
+{
+	paragraph_layout_edit(&view->layout, offset, remove, insert, insert_length);
+}
+
+NoteView* new_note_view(NoteViewArgs* args)
+{
+	assert(args != NULL);
+	NoteView* view = mem_alloc(sizeof(NoteView));
+	memset(view, 0, sizeof(NoteView));
+	new_view((View*)view, (ViewArgs*)args);
+	view->base.draw = draw_note_view;
+	view->base.destroy = destroy_note_view;
+	view->text_color = args->text_color;
+
+	paragraph_layout_init(&view->layout, args->font, args->text_size, args->base.rect.w - SCROLL_BAR_THICKNESS);
+	if (args->text != NULL)
+	{
+		paragraph_layout_set_text(&view->layout, args->text, strlen(args->text));
+	}
 	return view;
 }
 
-void draw_panel_view(View* view, Vec4 rect, Env *env)
+void draw_panel_view(View* view, Vec4 rect, Image image, Env *env)
 {
 	PanelView* panel_view = (PanelView*) view;
-	Image image = image_from_env(env);
+	ProfileScope scope = profile_begin(PROFILE_PANEL_VIEW);
 
 	Color color;
 	const bool is_mouse_over = inside_rect(mouse_position(env), rect);
@@ -245,12 +376,13 @@ void draw_panel_view(View* view, Vec4 rect, Env *env)
 	}
 
 	draw_rounded_rect(image, rect, color, panel_view->border_radius);
+	profile_end(scope);
 }
 
 PanelView* new_panel_view(PanelViewArgs* args)
 {
 	assert(args != NULL);
-	PanelView* view = malloc(sizeof(PanelView));
+	PanelView* view = mem_alloc(sizeof(PanelView));
 	memset(view, 0, sizeof(PanelView));
 	new_view((View*)view, (ViewArgs*)args);
 	view->base.draw = draw_panel_view;
@@ -2,12 +2,15 @@
 
 #include "env.h"
 #include "drawing.h"
+#include "paragraph.h"
 #include "basic.h"
 
 typedef struct View	View;
 typedef ARRAY(View*) Views;
 
-typedef void (*DrawFn)(View* view, Vec4 rect, Env *env);
+typedef void (*DrawFn)(View* view, Vec4 rect, Image image, Env *env);
+// Releases what the view owns besides its children and itself
+typedef void (*DestroyFn)(View* view);
 
 typedef struct View
 {
@@ -16,14 +19,24 @@ typedef struct View
 	Vec4* padding;
 	Views children;
 	DrawFn draw;
+	DestroyFn destroy;
+
+	// Views with opacity below 1 are drawn into a layer first
+	float opacity;
+
+	// Set by the draw function while the view needs another frame even
+	// without new input, like during a drag
+	bool animating;
 } View;
 
 typedef struct
 {
 	Vec4 rect;
+	// Zero is treated as fully opaque
+	float opacity;
 } ViewArgs;
 
-void draw_view(View* view, Env *env);
+bool draw_view(View* view, Image image, Env *env, Arena *arena);
 void destroy_view(View* view);
 
 typedef enum
@@ -69,6 +82,11 @@ typedef struct
 	const char *text;
 	Color text_color;
 	int text_size;
+
+	// Laid out again only when the text, font or size changes
+	TextLayout layout;
+	const char *laid_out_text;
+	bool layout_dirty;
 } TextView;
 
 typedef struct
@@ -82,6 +100,34 @@ typedef struct
 } TextViewArgs;
 
 TextView* new_text_view(TextViewArgs* args);
+// Also needed when the text is changed in place
+void text_view_set_text(TextView* view, const char *text);
+
+// Long word wrapped text, edits only wrap the changed paragraphs again
+// and only the visible lines are drawn
+typedef struct
+{
+	View base;
+	ParagraphLayout layout;
+	Color text_color;
+	// Pixels of text above the top of the view
+	float scroll;
+	bool is_dragging;
+} NoteView;
+
+typedef struct
+{
+	ViewArgs base;
+	Font font;
+	// Copied into the view
+	const char *text;
+	int text_size;
+	Color text_color;
+} NoteViewArgs;
+
+NoteView* new_note_view(NoteViewArgs* args);
+// Replaces remove bytes at offset with the inserted text
+void note_view_edit(NoteView* view, size_t offset, size_t remove, const char *insert, size_t insert_length);
 
 typedef struct
 {